@@ -0,0 +1,786 @@
+/**
+ * @file   bench.cpp
+ * @brief  Microbenchmarks for the individual format checkers.
+ *
+ * Each checker is timed in isolation against a handful of synthetic inputs:
+ * random bytes, zero bytes, "near miss" data (a valid file with one field
+ * broken, tiled across the buffer) and a valid file that it must accept.
+ * The results can be saved as a baseline and later compared against it, so
+ * that a change which slows a checker down is noticed.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "platform.hpp"
+#include "checkers.hpp"
+#include "parallel.hpp"
+#include "scanner.hpp"
+#include "stitch.hpp"
+
+/// Bytes of zeroes after every buffer, as main() guarantees for the checkers.
+#define BENCH_PAD CHECK_PADDING
+
+/// Data passed to a checker, with room for the checker to read past the end.
+struct Buffer {
+	std::vector<uint8_t> data;
+	unsigned long len;
+
+	Buffer(unsigned long len)
+		:	data(len + BENCH_PAD, 0),
+			len(len)
+	{
+	}
+};
+
+/// Append a 16-bit little-endian value.
+static void put_u16le(std::vector<uint8_t>& v, unsigned int n)
+{
+	v.push_back(n & 0xFF);
+	v.push_back((n >> 8) & 0xFF);
+}
+
+/// Append a 32-bit little-endian value.
+static void put_u32le(std::vector<uint8_t>& v, unsigned long n)
+{
+	put_u16le(v, n & 0xFFFF);
+	put_u16le(v, (n >> 16) & 0xFFFF);
+}
+
+/// Append a 16-bit big-endian value.
+static void put_u16be(std::vector<uint8_t>& v, unsigned int n)
+{
+	v.push_back((n >> 8) & 0xFF);
+	v.push_back(n & 0xFF);
+}
+
+/// Append a 32-bit big-endian value.
+static void put_u32be(std::vector<uint8_t>& v, unsigned long n)
+{
+	put_u16be(v, (n >> 16) & 0xFFFF);
+	put_u16be(v, n & 0xFFFF);
+}
+
+/// Append a string, which may contain embedded nulls.
+#define PUT_STR(v, s) v.insert(v.end(), (const uint8_t *)s, (const uint8_t *)s + sizeof(s) - 1)
+
+/// Append a number of copies of the same byte.
+static void put_fill(std::vector<uint8_t>& v, unsigned long count, uint8_t val)
+{
+	v.insert(v.end(), count, val);
+}
+
+/// A valid file and a way to break it, for one checker.
+struct Sample {
+	std::vector<uint8_t> valid;    ///< Must be accepted by the checker
+	std::vector<uint8_t> nearMiss; ///< Must be rejected, but only late on
+};
+
+static Sample sample_cdfm()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	v.push_back(6);  // speed
+	v.push_back(2);  // order count
+	v.push_back(1);  // pattern count
+	v.push_back(1);  // digital instrument count
+	v.push_back(1);  // OPL instrument count
+	v.push_back(0);  // loop destination
+	put_u32le(v, 47); // sample offset
+	v.push_back(0);  // order list
+	v.push_back(0);
+	put_u32le(v, 0); // pattern offsets
+	put_u32le(v, 0); // digital instrument: address
+	put_u32le(v, 64); // length
+	put_u32le(v, 0); // loop start
+	put_u32le(v, 0x00FFFFFF); // loop end
+	put_fill(v, 11, 0x01); // OPL instrument
+	v.push_back(0x00); // pattern: note on
+	v.push_back(0x30);
+	v.push_back(0x40);
+	v.push_back(0x60); // end of pattern
+	put_fill(v, 64, 0x80); // sample data
+
+	// Invalid command byte where the end of the pattern should be
+	s.nearMiss = v;
+	s.nearMiss[46] = 0x61;
+	return s;
+}
+
+static Sample sample_cmf()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	PUT_STR(v, "CTMF");
+	put_u16le(v, 0x0101); // version
+	put_u16le(v, 40); // instrument offset
+	put_u16le(v, 56); // music offset
+	put_u16le(v, 120); // ticks per quarter note
+	put_u16le(v, 120); // ticks per second
+	put_u16le(v, 0); // title
+	put_u16le(v, 0); // composer
+	put_u16le(v, 0); // remarks
+	put_fill(v, 16, 0); // channels in use
+	put_u16le(v, 1); // instrument count
+	put_u16le(v, 120); // tempo
+	put_fill(v, 16, 0x01); // instrument
+	v.push_back(0x00); // delay
+	v.push_back(0x90); // note on
+	v.push_back(0x3C);
+	v.push_back(0x7F);
+	v.push_back(0x00); // delay
+	v.push_back(0xFF); // end of track
+	v.push_back(0x2F);
+	v.push_back(0x00);
+
+	// Unknown version
+	s.nearMiss = v;
+	s.nearMiss[5] = 0x02;
+	return s;
+}
+
+static Sample sample_ibk()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	PUT_STR(v, "IBK\x1A");
+	for (unsigned int i = 0; i < IBK_COUNT; i++) {
+		put_fill(v, 11, 0x01); // OPL data
+		put_fill(v, 5, 0x00); // unused
+	}
+	for (unsigned int i = 0; i < IBK_COUNT; i++) {
+		PUT_STR(v, "INST\0\0\0\0\0");
+	}
+
+	// Unused byte set in the last instrument
+	s.nearMiss = v;
+	s.nearMiss[4 + 16 * IBK_COUNT - 1] = 0x01;
+	return s;
+}
+
+static Sample sample_iff()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	// An odd-length BODY without its pad byte, as for RIFF
+	PUT_STR(v, "FORM");
+	put_u32be(v, 4 + 8 + 20 + 8 + 31);
+	PUT_STR(v, "ILBM");
+	PUT_STR(v, "BMHD");
+	put_u32be(v, 20);
+	put_u16be(v, 16); // width
+	put_u16be(v, 16); // height
+	put_fill(v, 4, 0); // origin
+	v.push_back(1); // planes
+	put_fill(v, 3, 0); // mask, compression, pad
+	put_u16be(v, 0); // transparent colour
+	v.push_back(10); // aspect ratio
+	v.push_back(11);
+	put_u16be(v, 320); // page size
+	put_u16be(v, 200);
+	PUT_STR(v, "BODY");
+	put_u32be(v, 31);
+	put_fill(v, 31, 0x55);
+
+	// Chunk size far past the end of the data
+	s.nearMiss = v;
+	s.nearMiss[4] = 0x00;
+	s.nearMiss[5] = 0xF0;
+	return s;
+}
+
+static Sample sample_midi()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	PUT_STR(v, "MThd");
+	put_u32be(v, 6);
+	put_u16be(v, 0); // format
+	put_u16be(v, 1); // track count
+	put_u16be(v, 96); // ticks per quarter note
+	PUT_STR(v, "MTrk");
+	put_u32be(v, 8);
+	PUT_STR(v, "\x00\x90\x3C\x7F"); // note on
+	PUT_STR(v, "\x00\xFF\x2F\x00"); // end of track
+
+	// Track chunk with the wrong ID
+	s.nearMiss = v;
+	s.nearMiss[17] = 'x';
+	return s;
+}
+
+static Sample sample_riff()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	// The data chunk has an odd length and its pad byte is missing, as often
+	// happens at the end of a file, which must still be accepted
+	PUT_STR(v, "RIFF");
+	put_u32le(v, 4 + 8 + 16 + 8 + 63);
+	PUT_STR(v, "WAVE");
+	PUT_STR(v, "fmt ");
+	put_u32le(v, 16);
+	put_u16le(v, 1); // PCM
+	put_u16le(v, 1); // channels
+	put_u32le(v, 11025); // sample rate
+	put_u32le(v, 11025); // bytes per second
+	put_u16le(v, 1); // block align
+	put_u16le(v, 8); // bits per sample
+	PUT_STR(v, "data");
+	put_u32le(v, 63);
+	put_fill(v, 63, 0x80);
+
+	// Chunk size far past the end of the data
+	s.nearMiss = v;
+	s.nearMiss[7] = 0x7F;
+	return s;
+}
+
+static Sample sample_s3m()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	PUT_STR(v, "Benchmark song");
+	put_fill(v, 28 - v.size(), 0);
+	v.push_back(0x1A);
+	v.push_back(16); // type
+	put_u16le(v, 0);
+	put_u16le(v, 2); // order count
+	put_u16le(v, 1); // instrument count
+	put_u16le(v, 1); // pattern count
+	put_u16le(v, 0); // flags
+	put_u16le(v, 0x1320); // tracker version
+	put_u16le(v, 2); // sample format
+	PUT_STR(v, "SCRM");
+	put_fill(v, 0x60 - v.size(), 0);
+	v.push_back(0x00); // order list
+	v.push_back(0xFF);
+	put_u16le(v, 0x70 >> 4); // instrument pointer
+	put_u16le(v, 0x100 >> 4); // pattern pointer
+	put_fill(v, 0x70 - v.size(), 0);
+	v.push_back(1); // instrument type: PCM
+	PUT_STR(v, "SAMPLE.RAW\0\0");
+	v.push_back(0); // sample pointer, high byte
+	put_u16le(v, 0xC0 >> 4); // sample pointer, low word
+	put_u32le(v, 64); // sample length
+	put_fill(v, 0xC0 - v.size(), 0);
+	put_fill(v, 64, 0x80); // sample data
+	put_u16le(v, 64); // packed pattern length
+	put_fill(v, 64, 0x00);
+
+	// Instrument pointer far past the end of the data
+	s.nearMiss = v;
+	s.nearMiss[0x62] = 0xFF;
+	s.nearMiss[0x63] = 0xFF;
+	return s;
+}
+
+static Sample sample_tbsa()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	PUT_STR(v, "TBSA0.01");
+	put_u16le(v, 20); // order pointer list pointer
+	put_fill(v, 6, 0);
+	put_u16le(v, 28); // instrument pointer list
+	put_u16le(v, 52); // pattern segment pointer list
+	put_u16le(v, 24); // order pointer list
+	put_u16le(v, 0xFFFF);
+	v.push_back(1); // order count
+	v.push_back(0);
+	put_u16le(v, 28); // order
+	put_u16le(v, 32); // instrument pointer list
+	put_u16le(v, 0xFFFF);
+	put_fill(v, 20, 0x01); // instrument
+	put_u16le(v, 56); // pattern segment pointer list
+	put_u16le(v, 0xFFFF);
+	v.push_back(0x00); // pattern segment
+	v.push_back(0x00);
+	v.push_back(0xFF);
+
+	// Pattern segment that never ends
+	s.nearMiss = v;
+	s.nearMiss[58] = 0x00;
+	return s;
+}
+
+static Sample sample_voc()
+{
+	Sample s;
+	std::vector<uint8_t>& v = s.valid;
+	PUT_STR(v, "Creative Voice File\x1A");
+	put_u16le(v, 26); // header length
+	put_u16le(v, 0x010A); // version
+	put_u16le(v, (0x1233 - 0x010A) & 0xFFFF); // checksum
+	v.push_back(1); // sound data block
+	put_u16le(v, 2 + 64);
+	v.push_back(0);
+	v.push_back(0xA6); // sample rate
+	v.push_back(0); // codec
+	put_fill(v, 64, 0x80);
+	v.push_back(0); // terminator
+
+	// Bad checksum
+	s.nearMiss = v;
+	s.nearMiss[24] ^= 0x01;
+	return s;
+}
+
+/// Function to create the sample for a checker, in the same order as checkers[]
+typedef Sample (*SampleFunction)();
+
+static const SampleFunction sampleFunctions[] = {
+	sample_cdfm,
+	sample_cmf,
+	sample_ibk,
+	sample_iff,
+	sample_midi,
+	sample_riff,
+	sample_s3m,
+	sample_tbsa,
+	sample_voc,
+};
+
+/// Stop the compiler from removing checker calls whose result is unused.
+static volatile unsigned long sink;
+
+/// Call the checker at every offset in the buffer.
+/**
+ * @return Time taken per byte, in nanoseconds.
+ */
+static double time_scan(CheckFunction fn, const Buffer& buf)
+{
+	const uint8_t *content = &buf.data[0];
+	Match match;
+	unsigned long hits = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned long i = 0; i < buf.len; i++) {
+		if (fn(content + i, buf.len - i, &match)) hits++;
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	sink += hits;
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	return ns / buf.len;
+}
+
+/// Run the Scanner at every offset in the buffer.
+/**
+ * This is the cost of the whole dispatch as main() runs it, except that
+ * matches are counted rather than skipped over.
+ *
+ * @return Time taken per byte, in nanoseconds.
+ */
+static double time_scan_all(Scanner& scanner, const Buffer& buf)
+{
+	const uint8_t *content = &buf.data[0];
+	Match match;
+	unsigned long hits = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned long i = 0; i < buf.len; i++) {
+		if (scanner.matchAt(content + i, buf.len - i, &match) >= 0) hits++;
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	sink += hits;
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	return ns / buf.len;
+}
+
+/// Run Scanner::next() over the whole buffer.
+/**
+ * Like time_scan_all(), but using the scan loop main() runs, which is the
+ * fused loop unless the Scanner cannot use it.
+ *
+ * @return Time taken per byte, in nanoseconds.
+ */
+static double time_scan_next(Scanner& scanner, const Buffer& buf)
+{
+	const uint8_t *content = &buf.data[0];
+	Match match;
+	unsigned long hits = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned long long pos = 0; pos < buf.len; pos++) {
+		if (scanner.next(content, buf.len, &pos, buf.len, &match) >= 0) hits++;
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	sink += hits;
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	return ns / buf.len;
+}
+
+/// Memory for the parallel throughput test, optionally in huge pages.
+struct Region {
+	uint8_t *data;
+	unsigned long len;
+	bool huge;      ///< Huge pages were granted
+
+	Region(unsigned long len, bool wantHuge)
+		:	len(len),
+			huge(false)
+	{
+#ifdef _WIN32
+		this->data = new uint8_t[len];
+#else
+		this->data = (uint8_t *)MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if (wantHuge) {
+			this->data = (uint8_t *)mmap(0, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			this->huge = this->data != MAP_FAILED;
+		}
+#endif
+		if (this->data == MAP_FAILED) {
+			this->data = (uint8_t *)mmap(0, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (this->data == MAP_FAILED) {
+				std::cerr << "Unable to allocate " << len << " bytes for the "
+					"parallel scan: " << strerror(errno) << std::endl;
+				exit(2);
+			}
+#ifdef MADV_HUGEPAGE
+			// Fall back to transparent huge pages
+			if (wantHuge) {
+				this->huge = madvise(this->data, len, MADV_HUGEPAGE) == 0;
+			}
+#endif
+		}
+#endif
+	}
+
+	~Region()
+	{
+#ifdef _WIN32
+		delete[] this->data;
+#else
+		munmap(this->data, this->len);
+#endif
+	}
+};
+
+/// Scan a region on several threads the way main() does.
+/**
+ * @return Throughput in megabytes per second.
+ */
+static double time_parallel(const Scanner& prototype, const Region& region,
+	unsigned long len, unsigned int numThreads, bool numa)
+{
+	ParallelScanner parallel(prototype, numThreads, numa);
+	Scanner rescan(prototype);
+	Stitcher stitcher(&rescan, region.data, region.len, 0);
+	std::vector<Manifest> parts;
+	unsigned long long window = (unsigned long long)numThreads
+		* PARALLEL_PIECE_SIZE;
+	unsigned long hits = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (stitcher.position() < len) {
+		unsigned long long offset = stitcher.position();
+		parallel.scan(region.data, region.len, offset,
+			std::min<unsigned long long>(offset + window, len), &parts);
+		std::vector<ManifestEntry> keep, drop;
+		for (std::vector<Manifest>::const_iterator
+			p = parts.begin(); p != parts.end(); p++
+		) {
+			stitcher.add(*p, &keep, &drop);
+		}
+		hits += keep.size();
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	sink += hits;
+	double s = std::chrono::duration<double>(stop - start).count();
+	return len / s / 1048576;
+}
+
+/// Call the checker repeatedly on a file it should accept.
+/**
+ * @return Time taken per match, in nanoseconds, or a negative number if the
+ *   checker did not accept the file.
+ */
+static double time_accept(CheckFunction fn, const Buffer& buf, unsigned long count)
+{
+	const uint8_t *content = &buf.data[0];
+	Match match;
+	if (!fn(content, buf.len, &match)) return -1;
+	if (match.len != buf.len) return -1;
+
+	unsigned long total = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned long i = 0; i < count; i++) {
+		if (fn(content, buf.len, &match)) total += match.len;
+	}
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	sink += total;
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	return ns / count;
+}
+
+/// Fill the buffer with repeated copies of the given data.
+static void tile(Buffer& buf, const std::vector<uint8_t>& pattern)
+{
+	for (unsigned long i = 0; i < buf.len; i++) {
+		buf.data[i] = pattern[i % pattern.size()];
+	}
+}
+
+/// Fill memory with random data, always the same for the same length.
+static void randomise(uint8_t *data, unsigned long len)
+{
+	uint32_t x = 0x12345678;
+	for (unsigned long i = 0; i < len; i++) {
+		// xorshift32
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = x & 0xFF;
+	}
+}
+
+/// Results, keyed by "checker case".
+typedef std::map<std::string, double> Results;
+
+static bool load_baseline(const char *filename, Results *baseline)
+{
+	std::ifstream f(filename);
+	if (!f) return false;
+	std::string line;
+	while (std::getline(f, line)) {
+		if (line.empty() || (line[0] == '#')) continue;
+		std::istringstream ss(line);
+		std::string name, test;
+		double ns;
+		if (ss >> name >> test >> ns) {
+			(*baseline)[name + " " + test] = ns;
+		}
+	}
+	return true;
+}
+
+static bool save_baseline(const char *filename, const Results& results)
+{
+	std::ofstream f(filename);
+	if (!f) return false;
+	f << "# ripper6-bench baseline: checker, case, nanoseconds per byte "
+		"(or per match\n# for the 'accept' case).  Regenerate with "
+		"\"make bench-baseline\".\n";
+	for (Results::const_iterator
+		i = results.begin(); i != results.end(); i++
+	) {
+		f << i->first << ' ' << std::fixed << std::setprecision(3)
+			<< i->second << "\n";
+	}
+	return f.good();
+}
+
+/// Print one result and compare it against the baseline.
+/**
+ * @return false if the test failed to run at all.
+ */
+static bool report(const char *name, const char *test, double best,
+	const Results& baseline, double tolerance, Results *results,
+	unsigned int *regressions)
+{
+	std::string key = std::string(name) + " " + test;
+	std::cout << std::left << std::setw(8) << name << std::setw(10)
+		<< test << std::right;
+	if (best < 0) {
+		std::cout << "  FAILED: valid sample was not accepted" << std::endl;
+		return false;
+	}
+	(*results)[key] = best;
+	std::cout << std::fixed << std::setprecision(3) << std::setw(10) << best;
+
+	Results::const_iterator b = baseline.find(key);
+	if (b != baseline.end()) {
+		std::cout << std::setw(11) << b->second;
+		// Ignore tiny absolute differences, which are just timer noise
+		if ((best > b->second * tolerance) && (best - b->second > 0.05)) {
+			std::cout << "  REGRESSION (x" << std::setprecision(2)
+				<< best / b->second << ")";
+			(*regressions)++;
+		}
+	}
+	std::cout << std::endl;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long lenBuffer = 4 * 1024 * 1024;
+	unsigned int reps = 5;
+	double tolerance = 1.5;
+	const char *baselineFile = NULL;
+	const char *saveFile = NULL;
+	std::string only;
+	unsigned int numThreads = std::max(2u, std::thread::hardware_concurrency());
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if ((arg == "--size") && hasValue) {
+			lenBuffer = strtoul(argv[++i], NULL, 0);
+		} else if ((arg == "--reps") && hasValue) {
+			reps = strtoul(argv[++i], NULL, 0);
+		} else if ((arg == "--tolerance") && hasValue) {
+			tolerance = strtod(argv[++i], NULL);
+		} else if ((arg == "--baseline") && hasValue) {
+			baselineFile = argv[++i];
+		} else if ((arg == "--save") && hasValue) {
+			saveFile = argv[++i];
+		} else if ((arg == "--only") && hasValue) {
+			only = argv[++i];
+		} else if ((arg == "--threads") && hasValue) {
+			numThreads = strtoul(argv[++i], NULL, 0);
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--size BYTES] [--reps N] "
+				"[--only CHECKER]\n  [--threads N] [--save FILE] [--baseline FILE "
+				"[--tolerance FACTOR]]" << std::endl;
+			return 1;
+		}
+	}
+	if ((lenBuffer == 0) || (reps == 0) || (numThreads == 0)) {
+		std::cerr << "Buffer size, repetitions and threads must be non-zero."
+			<< std::endl;
+		return 1;
+	}
+
+	Results baseline;
+	if (baselineFile && !load_baseline(baselineFile, &baseline)) {
+		std::cerr << "Unable to read baseline " << baselineFile << std::endl;
+		return 2;
+	}
+
+	Buffer random(lenBuffer);
+	randomise(&random.data[0], random.len);
+	Buffer zero(lenBuffer);
+	Buffer nearMiss(lenBuffer);
+
+	Results results;
+	unsigned int regressions = 0;
+	bool failed = false;
+	std::cout << std::left << std::setw(8) << "checker" << std::setw(10)
+		<< "case" << std::right << std::setw(10) << "ns" << std::setw(11)
+		<< "baseline" << std::endl;
+	for (unsigned int c = 0; c < numCheckers; c++) {
+		const Checker& chk = checkers[c];
+		if (!only.empty() && (only != chk.name)) continue;
+
+		Sample sample = sampleFunctions[c]();
+		tile(nearMiss, sample.nearMiss);
+		Buffer valid(sample.valid.size());
+		std::copy(sample.valid.begin(), sample.valid.end(), valid.data.begin());
+		unsigned long acceptCount = lenBuffer / 64 + 1;
+
+		static const char *caseNames[] = {"random", "zero", "nearmiss", "accept"};
+		for (unsigned int t = 0; t < 4; t++) {
+			// Keep the fastest run, as anything slower is noise from elsewhere
+			double best = -1;
+			for (unsigned int r = 0; r < reps; r++) {
+				double ns;
+				switch (t) {
+					case 0: ns = time_scan(chk.fn, random); break;
+					case 1: ns = time_scan(chk.fn, zero); break;
+					case 2: ns = time_scan(chk.fn, nearMiss); break;
+					default: ns = time_accept(chk.fn, valid, acceptCount); break;
+				}
+				if (ns < 0) break;
+				if ((best < 0) || (ns < best)) best = ns;
+			}
+
+			if (!report(chk.name, caseNames[t], best, baseline, tolerance,
+				&results, &regressions)) failed = true;
+		}
+	}
+
+	// The full prefiltered dispatch over all checkers
+	if (only.empty() || (only == "all")) {
+		std::vector<Checker> list(checkers, checkers + numCheckers);
+		Scanner scanner(list);
+		static const char *caseNames[] = {"random", "zero"};
+		for (unsigned int t = 0; t < 2; t++) {
+			double best = -1;
+			for (unsigned int r = 0; r < reps; r++) {
+				double ns = time_scan_all(scanner, t == 0 ? random : zero);
+				if ((best < 0) || (ns < best)) best = ns;
+			}
+			report("all", caseNames[t], best, baseline, tolerance, &results,
+				&regressions);
+		}
+		for (unsigned int t = 0; t < 2; t++) {
+			double best = -1;
+			for (unsigned int r = 0; r < reps; r++) {
+				double ns = time_scan_next(scanner, t == 0 ? random : zero);
+				if ((best < 0) || (ns < best)) best = ns;
+			}
+			report("fused", caseNames[t], best, baseline, tolerance, &results,
+				&regressions);
+		}
+	}
+
+	// Whole-scan throughput with and without the NUMA and huge page options.
+	// This depends too much on the machine to compare against a baseline.
+	if (only.empty() || (only == "parallel")) {
+		std::vector<Checker> list(checkers, checkers + numCheckers);
+		Scanner scanner(list);
+		unsigned long lenRegion = lenBuffer * 4;
+		struct {
+			unsigned int threads;
+			bool numa;
+			bool huge;
+		} configs[] = {
+			{1, false, false},
+			{numThreads, false, false},
+			{numThreads, true, false},
+			{numThreads, true, true},
+		};
+		std::cout << "\nparallel scan of " << lenRegion / 1048576 << " MB, "
+			<< NumaTopology().nodes() << " NUMA node(s)\n"
+			<< std::left << std::setw(18) << "threads" << std::setw(6) << "numa"
+			<< std::setw(6) << "huge" << std::right << std::setw(10) << "MB/s"
+			<< std::endl;
+		for (unsigned int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+			Region region(lenRegion + BENCH_PAD, configs[c].huge);
+			randomise(region.data, lenRegion);
+			double best = 0;
+			for (unsigned int r = 0; r < reps; r++) {
+				double mbs = time_parallel(scanner, region, lenRegion,
+					configs[c].threads, configs[c].numa);
+				if (mbs > best) best = mbs;
+			}
+			std::cout << std::left << std::setw(18) << configs[c].threads
+				<< std::setw(6) << (configs[c].numa ? "yes" : "no")
+				<< std::setw(6) << (region.huge ? "yes" : (configs[c].huge ? "n/a" : "no"))
+				<< std::right << std::fixed << std::setprecision(1)
+				<< std::setw(10) << best << std::endl;
+		}
+	}
+
+	if (saveFile && !save_baseline(saveFile, results)) {
+		std::cerr << "Unable to write baseline " << saveFile << std::endl;
+		return 2;
+	}
+	if (failed) return 3;
+	if (regressions) {
+		std::cerr << regressions << " checker(s) slower than the baseline by "
+			"more than x" << tolerance << std::endl;
+		return 4;
+	}
+	return 0;
+}
@@ -0,0 +1,312 @@
+/**
+ * @file   check.hpp
+ * @brief  Types and helpers shared by all the format checkers.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_CHECK_HPP_
+#define _RIPPER6_CHECK_HPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <algorithm> // std::max
+#include "byteorder.hpp"
+
+struct check {
+	enum MatchCategory {
+		Unknown = 0,
+		Audio,
+		Image,
+		Music,
+		Video,
+		Other
+	};
+};
+
+/// Every kind of file the checkers can report.
+/**
+ * These are stored in each Match instead of strings, so that finding a match
+ * never allocates memory.  format_info() gives the details of each one.
+ *
+ * Formats described at run time, such as user signatures, are added with
+ * add_user_format() and numbered from FormatCount up.
+ */
+enum FormatId {
+	FormatUnknown = 0,
+	FormatCdfm,
+	FormatCmf,
+	FormatIbk,
+	FormatXmi,
+	FormatLbm,
+	FormatAiff,
+	FormatIff,
+	FormatMidi,
+	FormatAvi,
+	FormatDsm,
+	FormatRmi,
+	FormatWav,
+	FormatRiff,
+	FormatS3m,
+	FormatTbsa,
+	FormatVoc,
+	FormatCount
+};
+
+/// Fixed details of one FormatId.
+struct FormatInfo {
+	check::MatchCategory cat;
+	const char *ext;      ///< Filename extension, without the dot
+	const char *desc;     ///< Human readable name
+};
+
+/// Formats added with add_user_format(), numbered from FormatCount.
+inline std::deque<FormatInfo>& user_formats()
+{
+	static std::deque<FormatInfo> list;
+	return list;
+}
+
+/// Add a format at run time.
+/**
+ * This must be done before the search starts, as the list is not locked.
+ *
+ * @return The new format's FormatId.
+ */
+inline FormatId add_user_format(check::MatchCategory cat, const std::string& ext,
+	const std::string& desc)
+{
+	// Never moved once added, so FormatInfo can point at them
+	static std::deque<std::string> strings;
+	strings.push_back(ext);
+	const char *e = strings.back().c_str();
+	strings.push_back(desc);
+	FormatInfo f = {cat, e, strings.back().c_str()};
+	user_formats().push_back(f);
+	return (FormatId)(FormatCount + user_formats().size() - 1);
+}
+
+/// Number of formats, including those added with add_user_format().
+inline unsigned int format_count()
+{
+	return FormatCount + user_formats().size();
+}
+
+/// Look up the details of a format.
+inline const FormatInfo& format_info(FormatId id)
+{
+	static const FormatInfo info[FormatCount] = {
+		{check::Unknown, "bin",  "Unknown"},
+		{check::Music,   "670",  "Renaissance CDFM"},
+		{check::Music,   "cmf",  "Creative Music File"},
+		{check::Music,   "ibk",  "OPL2 Instrument Bank"},
+		{check::Music,   "xmi",  "Miles eXtended MIDI"},
+		{check::Image,   "lbm",  "InterLeaved BitMap"},
+		{check::Audio,   "aiff", "Audio Interchange File Format"},
+		{check::Other,   "iff",  "Unknown IFF"},
+		{check::Music,   "mid",  "Standard MIDI"},
+		{check::Video,   "avi",  "Microsoft AVI"},
+		{check::Music,   "dsm",  "DSIK DSMF module"},
+		{check::Music,   "rmi",  "RIFF MIDI"},
+		{check::Audio,   "wav",  "Microsoft Wave"},
+		{check::Other,   "riff", "Unknown RIFF"},
+		{check::Music,   "s3m",  "ScreamTracker 3"},
+		{check::Music,   "bsa",  "The Bone Shaker Architect"},
+		{check::Audio,   "voc",  "Creative Voice File"},
+	};
+	if ((id >= FormatCount) && (id < format_count())) {
+		return user_formats()[id - FormatCount];
+	}
+	return info[id < FormatCount ? id : FormatUnknown];
+}
+
+/// Maximum length of MatchMeta::title, excluding the terminating null.
+#define MATCH_TITLE_LEN 31
+
+/// Details read from inside a matched file, for the manifest.
+/**
+ * This is a fixed size so checkers can fill it in without allocating.  Each
+ * checker fills in whichever fields make sense for its format, and the rest
+ * are left as zero.
+ */
+struct MatchMeta {
+	uint32_t sampleRate;    ///< Audio: samples per second
+	uint16_t channels;      ///< Audio: number of channels
+	uint16_t bits;          ///< Audio: bits per sample
+	uint16_t tracks;        ///< Music: number of tracks or songs
+	uint16_t patterns;      ///< Music: number of patterns
+	uint16_t instruments;   ///< Music: number of instruments
+	uint16_t width;         ///< Image: width in pixels
+	uint16_t height;        ///< Image: height in pixels
+	char title[MATCH_TITLE_LEN + 1]; ///< Title stored in the file, if any
+
+	/// Store a title, which need not be null terminated in the file.
+	/**
+	 * Trailing spaces and nulls are removed, and anything unprintable is
+	 * replaced with '?'.
+	 */
+	void setTitle(const uint8_t *text, unsigned int len)
+	{
+		if (len > MATCH_TITLE_LEN) len = MATCH_TITLE_LEN;
+		unsigned int end = 0;
+		for (unsigned int i = 0; i < len; i++) {
+			if (text[i] == 0) break;
+			this->title[i] = ((text[i] < 0x20) || (text[i] > 0x7E)) ? '?' : text[i];
+			if (text[i] != ' ') end = i + 1;
+		}
+		this->title[end] = 0;
+	}
+};
+
+/// A file found by a checker.
+struct Match {
+	unsigned long len;
+	FormatId format;
+	MatchMeta meta;
+
+	/// Set the format of the match and clear any metadata from a previous one.
+	void found(FormatId format)
+	{
+		this->format = format;
+		memset(&this->meta, 0, sizeof(this->meta));
+	}
+
+	check::MatchCategory cat() const
+	{
+		return format_info(this->format).cat;
+	}
+
+	const char *ext() const
+	{
+		return format_info(this->format).ext;
+	}
+
+	const char *desc() const
+	{
+		return format_info(this->format).desc;
+	}
+};
+
+/// Magic bytes that appear at a fixed offset in every file of a format.
+/**
+ * This allows the prefilter to skip calling a checker at any offset that
+ * does not contain the first of these bytes.  A checker that has a signature
+ * must always reject content without it.
+ *
+ * A format with no fixed bytes may still have a header that starts with
+ * small counts, in which case each byte can be given as a range instead.
+ */
+struct Signature {
+	unsigned int offset;  ///< Offset of the magic bytes from the candidate
+	unsigned int len;     ///< Number of magic bytes, 0 for no signature
+	const uint8_t *magic; ///< The magic bytes themselves, or the lowest values
+	const uint8_t *upper; ///< Highest value of each byte, or NULL if exact
+};
+
+/// Bytes of zeroes that always follow the data given to a CheckFunction.
+/**
+ * A checker may read this far past len without checking len first, so it
+ * only needs to check the length of the file it has found against len once,
+ * at the end, instead of before every read.  Reads that can go further than
+ * this past len, such as those through an offset read from the file, must
+ * still be checked.
+ */
+#define CHECK_PADDING 65536
+
+/// Check for this format
+/**
+ * @param content
+ *   The block to look at.  Do not scan the block, simply look at a
+ *   fixed offset.  This function will be called repeatedly, once at each
+ *   byte offset.  If a match is found, then you can scan around to find
+ *   the start of the file, looking back at most getMinHead() bytes before
+ *   this pointer, and forward at most len bytes, plus CHECK_PADDING bytes of
+ *   zeroes after that.  The match itself must not be longer than len.
+ *
+ * @param len
+ *   Maximum distance to search past *content.  Will always be >=
+ *   getMinTail().
+ *
+ * @param mc
+ *   Details about any match, if the function returns true.  Ignored if the
+ *   return value is false.
+ *
+ * @return false if content does not point to an instance of this file
+ *   format, true if it does and mc has been filled in with details about
+ *   the match.
+ */
+typedef bool (*CheckFunction)(const uint8_t *content, unsigned long len, Match *mc);
+
+inline uint16_t as_u16le(const uint8_t *content)
+{
+	return le16toh(*((uint16_t *)content));
+}
+
+inline uint32_t as_u32le(const uint8_t *content)
+{
+	return le32toh(*((uint32_t *)content));
+}
+
+inline uint16_t as_u16be(const uint8_t *content)
+{
+	return be16toh(*((uint16_t *)content));
+}
+
+inline uint32_t as_u32be(const uint8_t *content)
+{
+	return be32toh(*((uint32_t *)content));
+}
+
+/// Require the string, which can contain embedded nulls, be at the given offset
+/**
+ * @param c
+ *   Pointer to the content to compare, e.g. content + 5.
+ *
+ * @param v
+ *   String that must exist, e.g. "\x00\x11\x22"
+ *
+ * @post Returns from the check function if there was no match.  Execution only
+ *   continues beyond the macro if the string matched.
+ */
+#define REQUIRE(c, v) { \
+	const uint8_t *t = c; \
+	const uint8_t *vp = (const uint8_t *)v; \
+	unsigned long l = sizeof(v) - 1; \
+	while (l--) { \
+		if (*t++ != *vp++) return false; \
+	} \
+}
+
+/// Require the byte at the given offset be within the given range.
+/**
+ * @param i
+ *   Offset into content, e.g. 0.
+ *
+ * @param min
+ *   Minimum allowed value, e.g. 0.
+ *
+ * @param max
+ *   Maximum allowed value, e.g. 255.
+ *
+ * @post Returns from the check function if the value is outside the given
+ *   range.  Execution only continues beyond the macro if the value was in range.
+ */
+#define REQUIRE_RANGE(i, min, max) \
+	if ((i < min) || (i > max)) return false;
+
+#endif // _RIPPER6_CHECK_HPP_
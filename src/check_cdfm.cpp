@@ -24,6 +24,14 @@
 /// Maximum file size
 #define CDFM_MAX_FILESIZE 512 * 1024
 
+/// Limits in use, which a profile can change.
+static unsigned long cdfm_max_sample_len = CDFM_MAX_SAMPLE_LEN;
+static unsigned long cdfm_max_filesize = CDFM_MAX_FILESIZE;
+
+/// There is no magic, but the speed and order count below are small, which
+/// lets the prefilter rule out most offsets.
+FORMAT_RANGE(cdfm_range, 0, "\x01\x01", "\x20\x80");
+
 bool check_cdfm(const uint8_t *content, unsigned long len, Match *mc)
 {
 	// Too short
@@ -70,7 +78,7 @@ bool check_cdfm(const uint8_t *content, unsigned long len, Match *mc)
 		const uint8_t *inst = instDig + 16 * i;
 		REQUIRE(inst, "\x00\x00\x00\x00"); // address
 		uint32_t lenSample = as_u32le(inst + 4);
-		if (lenSample > CDFM_MAX_SAMPLE_LEN) return false;
+		if (lenSample > cdfm_max_sample_len) return false;
 		uint32_t loopStart = as_u32le(inst + 8);
 		if (loopStart > lenSample) return false;
 		totalSize += lenSample;
@@ -129,11 +137,12 @@ bool check_cdfm(const uint8_t *content, unsigned long len, Match *mc)
 		}
 	}
 
-	if (totalSize > CDFM_MAX_FILESIZE) return false;
+	if (totalSize > cdfm_max_filesize) return false;
+	if (totalSize > len) return false;
 
 	mc->len = totalSize;
-	mc->cat = check::Music;
-	mc->ext = "670";
-	mc->desc = "Renaissance CDFM";
+	mc->found(FormatCdfm);
+	mc->meta.patterns = numPatterns;
+	mc->meta.instruments = numDigInst + numOPLInst;
 	return true;
 }
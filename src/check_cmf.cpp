@@ -21,12 +21,16 @@
 /// Maximum size of a CMF file (16-bit pointer)
 #define CMF_MAX_SIZE (65536 + 256*1024)
 
+/// Limit in use, which a profile can change.
+static unsigned long cmf_max_size = CMF_MAX_SIZE;
+
+FORMAT_MAGIC(cmf_magic, 0, "CTMF");
+typedef Format<cmf_magic, NoLength> fmt_cmf;
+
 bool check_cmf(const uint8_t *content, unsigned long len, Match *mc)
 {
-	// Too short
-	if (len < 37) return false;
-
-	REQUIRE(content, "CTMF");
+	unsigned long lenHeader;
+	if (!fmt_cmf::header(content, len, &lenHeader)) return false;
 
 	// Only known versions are 1.0 and 1.1
 	unsigned long version = as_u16le(content + 4);
@@ -49,10 +53,12 @@ bool check_cmf(const uint8_t *content, unsigned long len, Match *mc)
 	size = std::max(size, offTag3);
 	if (len < size) return false;
 
-	// Parse the music to find the end of the file
+	// Parse the music to find the end of the file.  The byte after the last
+	// one may be in the padding.
 	unsigned long endMusic = 0;
 	const uint8_t *music = content + offMusic;
-	for (unsigned long i = 0; i < CMF_MAX_SIZE; i++) {
+	const uint8_t *endScan = content + std::min(len, offMusic + cmf_max_size);
+	for (; music < endScan; music++) {
 		if (*music == 0xFF) {
 			// Found a meta event
 			if (music[1] == 0x2F) {
@@ -61,14 +67,13 @@ bool check_cmf(const uint8_t *content, unsigned long len, Match *mc)
 				break;
 			}
 		}
-		music++;
 	}
 	if (endMusic == 0) return false; // couldn't find end-of-track marker
 	size = std::max(size, endMusic);
+	if (size > len) return false;
 
 	mc->len = size;
-	mc->cat = check::Music;
-	mc->ext = "cmf";
-	mc->desc = "Creative Music File";
+	mc->found(FormatCmf);
+	mc->meta.instruments = numInst;
 	return true;
 }
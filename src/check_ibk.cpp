@@ -21,22 +21,29 @@
 #define IBK_COUNT 128
 #define IBK_LEN (4 + 16*IBK_COUNT + 9*IBK_COUNT)
 
-bool check_ibk(const uint8_t *content, unsigned long len, Match *mc)
-{
-	REQUIRE(content, "IBK\x1A");
-	if (IBK_LEN > len) return false;
+FORMAT_MAGIC(ibk_magic, 0, "IBK\x1A");
+
+struct fmt_ibk: Format<ibk_magic, FixedLength<IBK_LEN> > {
+	static bool validate(const uint8_t *content, unsigned long lenTotal)
+	{
+		// Make sure the unused bytes in each instrument are zero
+		content += 4;
+		for (unsigned int i = 0; i < IBK_COUNT; i++) {
+			content += 11; // skip over OPL data
+			REQUIRE(content, "\0\0\0\0\0");
+			content += 5;
+		}
+		return true;
+	}
 
-	// Make sure the unused bytes in each instrument are zero
-	content += 4;
-	for (unsigned int i = 0; i < IBK_COUNT; i++) {
-		content += 11; // skip over OPL data
-		REQUIRE(content, "\0\0\0\0\0");
-		content += 5;
+	static void describe(Match *mc)
+	{
+		mc->found(FormatIbk);
+		mc->meta.instruments = IBK_COUNT;
 	}
+};
 
-	mc->len = IBK_LEN;
-	mc->cat = check::Music;
-	mc->ext = "ibk";
-	mc->desc = "OPL2 Instrument Bank";
-	return true;
+bool check_ibk(const uint8_t *content, unsigned long len, Match *mc)
+{
+	return check_format<fmt_ibk>(content, len, mc);
 }
@@ -18,55 +18,157 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-bool check_iff(const uint8_t *content, unsigned long len, Match *mc)
+/// Ignore files >16MB as they are probably false positives
+#define IFF_MAX_LEN 16777216
+
+/// Limit in use, which a profile can change.
+static unsigned long iff_max_len = IFF_MAX_LEN;
+
+FORMAT_MAGIC(iff_magic, 0, "FORM");
+
+/// Chunk sizes must be a multiple of two, and exclude the 8-byte header
+typedef Format<iff_magic, LengthField<4, 4, BigEndian>, 8, 2, &iff_max_len> fmt_iff;
+
+/// Make sure every chunk is valid and the listed chunks appear in order.
+/**
+ * @param first
+ *   Top-level chunk that must appear, e.g. "BMHD".
+ *
+ * @param minLen
+ *   Minimum length of the first chunk.
+ *
+ * @param second
+ *   Top-level chunk that must appear after the first one, e.g. "BODY", or
+ *   NULL if only the first chunk is required.
+ *
+ * @param firstData
+ *   If not NULL, set to the data of the first chunk, which is at least
+ *   minLen bytes long.
+ */
+static bool iff_chunks_valid(const uint8_t *chunks, unsigned long len,
+	const char *first, unsigned long minLen, const char *second,
+	const uint8_t **firstData)
 {
-	REQUIRE(content, "FORM");
-	uint32_t lenChunk = as_u32be(content + 4);
+	bool haveFirst = false;
+	bool haveSecond = false;
+	ChunkWalker<IffChunks> w(chunks, len, true);
+	while (w.next()) {
+		if (w.depth != 0) continue;
+		if (chunk_id_is(w.id, first)) {
+			if (w.len < minLen) return false;
+			if (firstData && !haveFirst) *firstData = w.data;
+			haveFirst = true;
+		} else if (second && chunk_id_is(w.id, second)) {
+			if (!haveFirst) return false;
+			haveSecond = true;
+		}
+	}
+	if (!second) haveSecond = haveFirst;
+	return !w.failed() && haveSecond;
+}
 
-	// Ignore files >16MB as they are probably false positives
-	if (lenChunk > 16777216) return false;
+/// Whole part of the 80-bit float AIFF uses for the sample rate.
+static uint32_t iff_extended_to_u32(const uint8_t *content)
+{
+	unsigned int exponent = as_u16be(content) & 0x7FFF;
+	uint32_t mantissa = as_u32be(content + 2); // top 32 of the 64 bits
+	if (content[0] & 0x80) return 0; // negative
+	if (exponent < 16383) return 0;
+	unsigned int shift = exponent - 16383;
+	if (shift > 31) return 0;
+	return mantissa >> (31 - shift);
+}
 
-	// Chunk sizes must be a multiple of two
-	if (lenChunk % 2) lenChunk++;
+/// Check the CAT chunk of XMIDI songs that follows FORM XDIR.
+/**
+ * @param songs
+ *   Set to the number of songs if the chunk is valid.
+ *
+ * @return Length of the CAT chunk including its header and padding, or 0 if
+ *   it is not valid.
+ */
+static unsigned long iff_xmid_cat(const uint8_t *content, unsigned long len,
+	unsigned int *songs)
+{
+	if (!chunk_id_is(content, "CAT ")) return 0;
+	if (!chunk_id_is(content + 8, "XMID")) return 0;
+	unsigned long lenCat = as_u32be(content + 4);
+	if (lenCat > iff_max_len) return 0;
+	if (lenCat % 2) lenCat++;
+	lenCat += 8;
+	if (lenCat > len) return 0;
 
-	lenChunk += 8; // include header
-	if (lenChunk > len) return false;
+	// Every song is a FORM XMID with an EVNT chunk
+	*songs = 0;
+	bool haveEvents = true;
+	ChunkWalker<IffChunks> w(content + 12, lenCat - 12, true);
+	while (w.next()) {
+		if (w.depth == 0) {
+			if (!chunk_id_is(w.id, "FORM") || !chunk_id_is(w.data, "XMID")) return 0;
+			if (!haveEvents) return 0;
+			haveEvents = false;
+			(*songs)++;
+		} else if (chunk_id_is(w.id, "EVNT")) {
+			haveEvents = true;
+		}
+	}
+	if (w.failed() || !haveEvents || (*songs == 0)) return 0;
+	return lenCat;
+}
 
-	std::string type((const char *)content + 8, 4);
+bool check_iff(const uint8_t *content, unsigned long len, Match *mc)
+{
+	unsigned long lenChunk;
+	if (!fmt_iff::header(content, len, &lenChunk)) return false;
 
-	mc->len = lenChunk;
-	if (type.compare("XDIR") == 0) {
-		// This format has a second IFF appended
-		uint32_t lenChunk2 = as_u32be(content + lenChunk + 4);
+	// Need room for the type field
+	if (lenChunk < 12) return false;
 
-		// Chunk sizes must be a multiple of two
-		if (lenChunk2 % 2) lenChunk2++;
+	const uint8_t *type = content + 8;
 
-		lenChunk2 += 8; // include header
-		if (lenChunk2 > len) return false;
+	// The chunks that follow the type field
+	const uint8_t *chunks = content + 12;
+	unsigned long lenChunks = lenChunk - 12;
+
+	mc->len = lenChunk;
+	if (chunk_id_is(type, "XDIR")) {
+		if (!iff_chunks_valid(chunks, lenChunks, "INFO", 2, NULL, NULL)) return false;
+
+		// This format has a second IFF appended, holding the songs
+		unsigned int songs;
+		unsigned long lenChunk2 = iff_xmid_cat(content + lenChunk, len - lenChunk,
+			&songs);
+		if (lenChunk2 == 0) return false;
 
 		mc->len += lenChunk2;
 
-		mc->cat = check::Music;
-		mc->ext = "xmi";
-		mc->desc = "Miles eXtended MIDI";
-	} else if (type.compare("ILBM") == 0) {
-		mc->cat = check::Image;
-		mc->ext = "lbm";
-		mc->desc = "InterLeaved BitMap";
-	} else if (type.compare("AIFF") == 0) {
-		mc->cat = check::Audio;
-		mc->ext = "aiff";
-		mc->desc = "Audio Interchange File Format";
+		mc->found(FormatXmi);
+		mc->meta.tracks = songs;
+	} else if (chunk_id_is(type, "ILBM")) {
+		const uint8_t *bmhd;
+		if (!iff_chunks_valid(chunks, lenChunks, "BMHD", 20, "BODY", &bmhd)) return false;
+
+		mc->found(FormatLbm);
+		mc->meta.width = as_u16be(bmhd);
+		mc->meta.height = as_u16be(bmhd + 2);
+	} else if (chunk_id_is(type, "AIFF")) {
+		const uint8_t *comm;
+		if (!iff_chunks_valid(chunks, lenChunks, "COMM", 18, "SSND", &comm)) return false;
+
+		mc->found(FormatAiff);
+		mc->meta.channels = as_u16be(comm);
+		mc->meta.bits = as_u16be(comm + 6);
+		mc->meta.sampleRate = iff_extended_to_u32(comm + 8);
 	} else {
 		// Exclude anything with control or extended characters in the type
 		// field.
-		for (unsigned int i = 0; i < 4; i++) {
-			if ((type[i] < 20) || (type[i] > 126)) return false;
-		}
-		mc->cat = check::Other;
-		mc->ext = "iff";
-		mc->desc = "Unknown IFF";
+		if (!chunk_id_valid(content + 8)) return false;
+
+		// Require at least one chunk, and all of them to be valid
+		if (lenChunks < 8) return false;
+		if (!chunk_tree_valid<IffChunks>(chunks, lenChunks)) return false;
+
+		mc->found(FormatIff);
 	}
 	return true;
 }
@@ -20,30 +20,47 @@
 
 #define MID_MAX_TRACKS 256
 
+/// Limit in use, which a profile can change.
+static unsigned long mid_max_tracks = MID_MAX_TRACKS;
+
+FORMAT_MAGIC(midi_magic, 0, "MThd");
+typedef Format<midi_magic, LengthField<4, 4, BigEndian>, 8> fmt_midi;
+
 bool check_midi(const uint8_t *content, unsigned long len, Match *mc)
 {
-	REQUIRE(content, "MThd");
-	uint32_t lenMThd = as_u32be(content + 4);
-	if (lenMThd > len) return false;
+	unsigned long lenTotal;
+	if (!fmt_midi::header(content, len, &lenTotal)) return false;
+
+	// Need room for the format, track count and timing
+	if (lenTotal < 8 + 6) return false;
+
+	unsigned int format = as_u16be(content + 8);
+	if (format > 2) return false;
 
 	unsigned int numTracks = as_u16be(content + 10);
-	if (numTracks > MID_MAX_TRACKS) return false;
-
-	const uint8_t *end = content + len;
-
-	unsigned long lenTotal = 8 + lenMThd;
-	const uint8_t *track = content + lenTotal;
-	for (unsigned int i = 0; i < numTracks; i++) {
-		REQUIRE(track, "MTrk");
-		uint32_t lenMTrk = 8 + as_u32be(track + 4);
-		track += lenMTrk;
-		lenTotal += lenMTrk;
-		if (track > end) return false;
+	REQUIRE_RANGE(numTracks, 1, mid_max_tracks);
+
+	// Format 0 files only ever have a single track
+	if ((format == 0) && (numTracks != 1)) return false;
+
+	// Walk the chunks after the header until all the tracks have been seen.
+	// The spec allows other chunk types in between, but skipping them would
+	// let a bogus header walk through the rest of the input, so like every
+	// real player we expect only tracks.
+	unsigned int tracks = 0;
+	ChunkWalker<MidiChunks> w(content + lenTotal, len - lenTotal, false);
+	while ((tracks < numTracks) && w.next()) {
+		if (!chunk_id_is(w.id, "MTrk")) return false;
+		// Every track must finish with an end-of-track event
+		if (w.len < 4) return false;
+		REQUIRE(w.data + w.len - 3, "\xFF\x2F\x00");
+		tracks++;
 	}
+	if (tracks < numTracks) return false;
+	lenTotal = (w.data + w.len) - content;
 
 	mc->len = lenTotal;
-	mc->cat = check::Music;
-	mc->ext = "mid";
-	mc->desc = "Standard MIDI";
+	mc->found(FormatMidi);
+	mc->meta.tracks = numTracks;
 	return true;
 }
@@ -18,52 +18,140 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/// Ignore files >16MB as they are probably false positives
+#define RIFF_MAX_LEN 16777216
+
+/// Limit in use, which a profile can change.
+static unsigned long riff_max_len = RIFF_MAX_LEN;
+
+FORMAT_MAGIC(riff_magic, 0, "RIFF");
+
+/// Chunk sizes must be a multiple of two, and exclude the 8-byte header
+typedef Format<riff_magic, LengthField<4, 4, LittleEndian>, 8, 2> fmt_riff;
+
+/// Make sure a RIFF WAVE has a sensible format chunk before its sample data.
+/**
+ * @param meta
+ *   Set to the sample format if the file is valid.
+ */
+static bool riff_wave_valid(const uint8_t *chunks, unsigned long len,
+	MatchMeta *meta)
+{
+	bool haveFormat = false;
+	bool haveData = false;
+	ChunkWalker<RiffChunks> w(chunks, len, true);
+	while (w.next()) {
+		if (w.depth != 0) continue;
+		if (chunk_id_is(w.id, "fmt ")) {
+			if (w.len < 14) return false;
+			// Format 0 is unknown/invalid
+			if (as_u16le(w.data) == 0) return false;
+			unsigned int channels = as_u16le(w.data + 2);
+			REQUIRE_RANGE(channels, 1, 64);
+			unsigned long rate = as_u32le(w.data + 4);
+			REQUIRE_RANGE(rate, 1, 1000000);
+			meta->channels = channels;
+			meta->sampleRate = rate;
+			if (w.len >= 16) meta->bits = as_u16le(w.data + 14);
+			haveFormat = true;
+		} else if (chunk_id_is(w.id, "data")) {
+			// Sample data is meaningless without the format chunk first
+			if (!haveFormat) return false;
+			haveData = true;
+		}
+	}
+	return !w.failed() && haveData;
+}
+
+/// Make sure the first top-level chunk has the given ID, and all are valid.
+/**
+ * @param first
+ *   Required ID of the first chunk, e.g. "SONG".
+ *
+ * @param firstType
+ *   Required type if the first chunk is a LIST, or NULL.
+ */
+static bool riff_first_chunk(const uint8_t *chunks, unsigned long len,
+	const char *first, const char *firstType)
+{
+	ChunkWalker<RiffChunks> w(chunks, len, false);
+	if (!w.next()) return false;
+	if (!chunk_id_is(w.id, first)) return false;
+	if (firstType && !chunk_id_is(w.data, firstType)) return false;
+	return chunk_tree_valid<RiffChunks>(chunks, len);
+}
+
+/// Make sure the RIFF has a data chunk holding a Standard MIDI file.
+/**
+ * @param meta
+ *   Set to the number of tracks if the file is valid.
+ */
+static bool riff_rmid_valid(const uint8_t *chunks, unsigned long len,
+	MatchMeta *meta)
+{
+	ChunkWalker<RiffChunks> w(chunks, len, false);
+	while (w.next()) {
+		if (chunk_id_is(w.id, "data")) {
+			if ((w.len < 4) || !chunk_id_is(w.data, "MThd")) return false;
+			if (w.len >= 12) meta->tracks = as_u16be(w.data + 10);
+			return true;
+		}
+	}
+	return false;
+}
+
 bool check_riff(const uint8_t *content, unsigned long len, Match *mc)
 {
-	REQUIRE(content, "RIFF");
-	uint32_t lenChunk = as_u32le(content + 4);
-	if (lenChunk + 8 > len) return false;
-	std::string type((const char *)content + 8, 4);
-
-	// Chunk sizes must be a multiple of two
-	if (lenChunk % 2) lenChunk++;
-
-	mc->len = lenChunk + 8;
-	if (type.compare("AVI ") == 0) {
-		mc->cat = check::Video;
-		mc->ext = "avi";
-		mc->desc = "Microsoft AVI";
-	} else if (type.compare("DSMF") == 0) {
-		// Ignore files >16MB as they are probably false positives
-		if (lenChunk > 16777216) return false;
-
-		mc->cat = check::Music;
-		mc->ext = "dsm";
-		mc->desc = "DSIK DSMF module";
-	} else if (type.compare("RMID") == 0) {
-		// Ignore files >16MB as they are probably false positives
-		if (lenChunk > 16777216) return false;
-
-		mc->cat = check::Music;
-		mc->ext = "rmi";
-		mc->desc = "RIFF MIDI";
-	} else if (type.compare("WAVE") == 0) {
-		mc->cat = check::Audio;
-		mc->ext = "wav";
-		mc->desc = "Microsoft Wave";
+	unsigned long lenTotal;
+	if (!fmt_riff::header(content, len, &lenTotal)) return false;
+
+	// Need room for the type field
+	if (lenTotal < 12) return false;
+
+	const uint8_t *type = content + 8;
+	unsigned long lenChunk = lenTotal - 8;
+
+	// The chunks that follow the type field
+	const uint8_t *chunks = content + 12;
+	unsigned long lenChunks = lenTotal - 12;
+
+	mc->len = lenTotal;
+	MatchMeta meta;
+	memset(&meta, 0, sizeof(meta));
+	if (chunk_id_is(type, "AVI ")) {
+		// The header list must come first
+		if (!riff_first_chunk(chunks, lenChunks, "LIST", "hdrl")) return false;
+
+		mc->found(FormatAvi);
+	} else if (chunk_id_is(type, "DSMF")) {
+		if (lenChunk > riff_max_len) return false;
+		if (!riff_first_chunk(chunks, lenChunks, "SONG", NULL)) return false;
+
+		mc->found(FormatDsm);
+	} else if (chunk_id_is(type, "RMID")) {
+		if (lenChunk > riff_max_len) return false;
+		if (!riff_rmid_valid(chunks, lenChunks, &meta)) return false;
+
+		mc->found(FormatRmi);
+		mc->meta = meta;
+	} else if (chunk_id_is(type, "WAVE")) {
+		if (!riff_wave_valid(chunks, lenChunks, &meta)) return false;
+
+		mc->found(FormatWav);
+		mc->meta = meta;
 	} else {
-		// Ignore files >16MB as they are probably false positives
-		if (lenChunk > 16777216) return false;
+		if (lenChunk > riff_max_len) return false;
 
 		// Exclude anything with control or extended characters in the type
 		// field.  The spec says this isn't allowed but then goes on to explain
 		// how to include newlines and other control characters in this field(!)
-		for (unsigned int i = 0; i < 4; i++) {
-			if ((type[i] < 20) || (type[i] > 126)) return false;
-		}
-		mc->cat = check::Other;
-		mc->ext = "riff";
-		mc->desc = "Unknown RIFF";
+		if (!chunk_id_valid(content + 8)) return false;
+
+		// Require at least one chunk, and all of them to be valid
+		if (lenChunks < 8) return false;
+		if (!chunk_tree_valid<RiffChunks>(chunks, lenChunks)) return false;
+
+		mc->found(FormatRiff);
 	}
 	return true;
 }
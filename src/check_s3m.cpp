@@ -18,18 +18,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+FORMAT_MAGIC(s3m_magic, 0x2c, "SCRM");
+typedef Format<s3m_magic, NoLength> fmt_s3m;
+
 bool check_s3m(const uint8_t *content, unsigned long len, Match *mc)
 {
-	// Too short
-	if (len < 0x60) return false;
-
-	REQUIRE(content + 0x2c, "SCRM");
+	unsigned long lenHeader;
+	if (!fmt_s3m::header(content, len, &lenHeader)) return false;
 	if (content[28] != 0x1A) return false;
 
 	unsigned int orderCount = as_u16le(content + 32);
 	unsigned int instCount = as_u16le(content + 34);
 	unsigned int patternCount = as_u16le(content + 36);
 
+	// The header and pointer tables must be there in full, as they can be
+	// longer than the padding
+	if (0x60 + orderCount + (instCount + patternCount) * 2 > len) return false;
+
 	unsigned long size = 0x60 + orderCount;
 
 	const uint8_t *ptr = content + size;
@@ -69,10 +74,12 @@ bool check_s3m(const uint8_t *content, unsigned long len, Match *mc)
 		unsigned long endPattern = offPattern + lenPattern + 2;
 		if (size < endPattern) size = endPattern;
 	}
+	if (size > len) return false;
 
 	mc->len = size;
-	mc->cat = check::Music;
-	mc->ext = "s3m";
-	mc->desc = "ScreamTracker 3";
+	mc->found(FormatS3m);
+	mc->meta.setTitle(content, 28);
+	mc->meta.patterns = patternCount;
+	mc->meta.instruments = instCount;
 	return true;
 }
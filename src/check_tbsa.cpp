@@ -18,9 +18,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+FORMAT_MAGIC(tbsa_magic, 0, "TBSA0.01");
+typedef Format<tbsa_magic, NoLength> fmt_tbsa;
+
 bool check_tbsa(const uint8_t *content, unsigned long len, Match *mc)
 {
-	REQUIRE(content, "TBSA0.01");
+	unsigned long lenHeader;
+	if (!fmt_tbsa::header(content, len, &lenHeader)) return false;
 
 	unsigned long maxPointer = 0;
 
@@ -75,9 +79,9 @@ bool check_tbsa(const uint8_t *content, unsigned long len, Match *mc)
 		if (!patsegEnd) return false;
 	}
 
+	if (maxPointer > len) return false;
+
 	mc->len = maxPointer;
-	mc->cat = check::Music;
-	mc->ext = "bsa";
-	mc->desc = "The Bone Shaker Architect";
+	mc->found(FormatTbsa);
 	return true;
 }
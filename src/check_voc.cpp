@@ -20,17 +20,25 @@
 
 #define VOC_MAX_BLOCKS 512
 
+/// Limit in use, which a profile can change.
+static unsigned long voc_max_blocks = VOC_MAX_BLOCKS;
+
+FORMAT_MAGIC(voc_magic, 0, "Creative Voice File\x1A");
+typedef Format<voc_magic, NoLength> fmt_voc;
+
 bool check_voc(const uint8_t *content, unsigned long len, Match *mc)
 {
-	REQUIRE(content, "Creative Voice File\x1A");
+	unsigned long lenMagic;
+	if (!fmt_voc::header(content, len, &lenMagic)) return false;
 	unsigned int lenHeader = as_u16le(content + 20);
 	unsigned int version = as_u16le(content + 22);
 	unsigned int checksum = as_u16le(content + 24);
 	if (((0x1233 - version) & 0xFFFF) != checksum) return false;
 
 	unsigned long size = lenHeader;
+	unsigned long rate = 0;
 	bool finished = false;
-	for (unsigned int i = 0; i < VOC_MAX_BLOCKS; i++) {
+	for (unsigned int i = 0; i < voc_max_blocks; i++) {
 		if (size >= len) return false;
 		unsigned int type = content[size];
 		size++;
@@ -41,16 +49,24 @@ bool check_voc(const uint8_t *content, unsigned long len, Match *mc)
 		}
 		// Read the 24-bit length value
 		unsigned int hdr = as_u32le(content + size - 1);
-		unsigned int len = hdr >> 8;
+		unsigned int lenBlock = hdr >> 8;
 		size += 3;
 		if (type > 9) return false; // unknown block type
-		size += len;
+		if ((type == 1) && !rate && (lenBlock >= 2)) {
+			// Sound data, starting with the sample rate as a time constant.  If
+			// this is past the end, the next block will be too, and the file
+			// is rejected.
+			rate = 1000000 / (256 - content[size]);
+		}
+		size += lenBlock;
 	}
 	if (!finished) return false;
 
 	mc->len = size;
-	mc->cat = check::Audio;
-	mc->ext = "voc";
-	mc->desc = "Creative Voice File";
+	mc->found(FormatVoc);
+	if (rate) {
+		mc->meta.sampleRate = rate;
+		mc->meta.channels = 1;
+	}
 	return true;
 }
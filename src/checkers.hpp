@@ -0,0 +1,70 @@
+/**
+ * @file   checkers.hpp
+ * @brief  List of all the format checkers compiled into Ripper6.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_CHECKERS_HPP_
+#define _RIPPER6_CHECKERS_HPP_
+
+#include <vector>
+#include "check.hpp"
+#include "format.hpp"
+#include "chunk.hpp"
+
+#include "check_cdfm.cpp"
+#include "check_cmf.cpp"
+#include "check_ibk.cpp"
+#include "check_iff.cpp"
+#include "check_midi.cpp"
+#include "check_riff.cpp"
+#include "check_s3m.cpp"
+#include "check_tbsa.cpp"
+#include "check_voc.cpp"
+
+/// Name and entry point of a format checker.
+struct Checker {
+	const char *name;  ///< Short name, used on the command line and in reports
+	CheckFunction fn;  ///< Function to call at each offset
+	Signature sig;     ///< Magic bytes the prefilter looks for
+
+	/// For a checker that looks for several formats, the signature of each,
+	/// used by the prefilter instead of sig.  NULL for most checkers.
+	const std::vector<Signature> *sigs;
+};
+
+/// All the checkers, in the order they are tried at each offset.
+/**
+ * When more than one checker would match at the same offset, the one earlier
+ * in this list wins.
+ */
+static const Checker checkers[] = {
+	{"cdfm", check_cdfm, SIGNATURE(cdfm_range), NULL},
+	{"cmf", check_cmf, SIGNATURE(cmf_magic), NULL},
+	{"ibk", check_ibk, SIGNATURE(ibk_magic), NULL},
+	{"iff", check_iff, SIGNATURE(iff_magic), NULL},
+	{"midi", check_midi, SIGNATURE(midi_magic), NULL},
+	{"riff", check_riff, SIGNATURE(riff_magic), NULL},
+	{"s3m", check_s3m, SIGNATURE(s3m_magic), NULL},
+	{"tbsa", check_tbsa, SIGNATURE(tbsa_magic), NULL},
+	{"voc", check_voc, SIGNATURE(voc_magic), NULL},
+};
+
+/// Number of entries in checkers[].
+static const unsigned int numCheckers = sizeof(checkers) / sizeof(checkers[0]);
+
+#endif // _RIPPER6_CHECKERS_HPP_
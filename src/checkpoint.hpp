@@ -0,0 +1,172 @@
+/**
+ * @file   checkpoint.hpp
+ * @brief  Saved scan position, so an interrupted scan can be resumed.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_CHECKPOINT_HPP_
+#define _RIPPER6_CHECKPOINT_HPP_
+
+#include <fstream>
+#include <sstream>
+#include "platform.hpp"
+
+/// Version written to and expected in checkpoint files.
+#define CHECKPOINT_VERSION 1
+
+/// Default number of seconds between checkpoints.
+#define CHECKPOINT_DEFAULT_INTERVAL 60
+
+/// How far a scan has got.
+/**
+ * Everything needed to carry on a scan so that it produces the same output
+ * as if it had never stopped.  Every match before offset has been written to
+ * disk in full, and the next match will be numbered matchCount.
+ *
+ * The size and modification time of the input, and the range being scanned,
+ * are kept so a checkpoint is not accidentally used with a different file or
+ * shard.  So are the settings that change what is found and how it is saved,
+ * such as the checkers in use, so the search is not carried on with
+ * different ones.
+ */
+struct Checkpoint {
+	unsigned long long size;        ///< Length of the input file
+	long long mtime;                ///< Modification time of the input file
+	unsigned long long offset;      ///< Where to carry on searching
+	unsigned long long matchCount;  ///< Number of matches saved so far
+	unsigned long long rangeStart;  ///< First offset of the range being scanned
+	unsigned long long rangeLen;    ///< Length of the range being scanned
+	unsigned long long manifest;    ///< Length of the manifest so far, if any
+	std::string config;             ///< Settings in use, one per line
+
+	Checkpoint()
+		:	size(0),
+			mtime(0),
+			offset(0),
+			matchCount(0),
+			rangeStart(0),
+			rangeLen(0),
+			manifest(0)
+	{
+	}
+
+	/// Read a checkpoint written by save().
+	/**
+	 * @param error
+	 *   On failure, set to a description of the problem.
+	 *
+	 * @return false if the file could not be read or is not a checkpoint.
+	 */
+	bool load(const std::string& filename, std::string *error)
+	{
+		std::ifstream f(filename.c_str());
+		if (!f) {
+			*error = "Unable to read checkpoint " + filename;
+			return false;
+		}
+		int version = 0;
+		bool haveOffset = false;
+		std::string line;
+		while (std::getline(f, line)) {
+			if (line.empty() || (line[0] == '#')) continue;
+			std::istringstream ss(line);
+			std::string key;
+			ss >> key;
+			if (key == "version") ss >> version;
+			else if (key == "size") ss >> this->size;
+			else if (key == "mtime") ss >> this->mtime;
+			else if (key == "offset") haveOffset = !!(ss >> this->offset);
+			else if (key == "matches") ss >> this->matchCount;
+			else if (key == "range") ss >> this->rangeStart >> this->rangeLen;
+			else if (key == "manifest") ss >> this->manifest;
+			else if ((key == "checkers") || (key == "limit") || (key == "signature")
+				|| (key == "layout") || (key == "compress")
+			) {
+				this->config += line + "\n";
+			}
+		}
+		if ((version != CHECKPOINT_VERSION) || !haveOffset) {
+			*error = filename + " is not a valid checkpoint";
+			return false;
+		}
+		return true;
+	}
+
+	/// Write the checkpoint, replacing any earlier one.
+	/**
+	 * The new checkpoint is written to a temporary file, flushed to disk and
+	 * then renamed over the old one, so a crash at any point leaves either the
+	 * old or the new checkpoint intact, never a partial one.
+	 *
+	 * @param error
+	 *   On failure, set to a description of the problem.
+	 *
+	 * @return false if the file could not be written.
+	 */
+	bool save(const std::string& filename, std::string *error) const
+	{
+		std::ostringstream ss;
+		ss << "# ripper6 checkpoint\n"
+			"version " << CHECKPOINT_VERSION << "\n"
+			"size " << this->size << "\n"
+			"mtime " << this->mtime << "\n"
+			"offset " << this->offset << "\n"
+			"matches " << this->matchCount << "\n"
+			"range " << this->rangeStart << ' ' << this->rangeLen << "\n"
+			"manifest " << this->manifest << "\n"
+			<< this->config;
+		std::string data = ss.str();
+		std::string temp = filename + ".tmp";
+
+#ifdef _WIN32
+		HANDLE h = CreateFile(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, NULL, NULL);
+		if (h == INVALID_HANDLE_VALUE) {
+			*error = "Unable to create checkpoint: " + GetLastErrorAsString();
+			return false;
+		}
+		DWORD written;
+		bool ok = WriteFile(h, data.data(), data.length(), &written, NULL)
+			&& (written == data.length()) && FlushFileBuffers(h);
+		CloseHandle(h);
+		if (ok) {
+			ok = MoveFileEx(temp.c_str(), filename.c_str(),
+				MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+		}
+		if (!ok) {
+			*error = "Unable to write checkpoint: " + GetLastErrorAsString();
+			return false;
+		}
+#else
+		int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			*error = std::string("Unable to create checkpoint: ") + strerror(errno);
+			return false;
+		}
+		bool ok = (::write(fd, data.data(), data.length()) == (ssize_t)data.length())
+			&& (fsync(fd) == 0);
+		ok = (close(fd) == 0) && ok;
+		if (ok) ok = rename(temp.c_str(), filename.c_str()) == 0;
+		if (!ok) {
+			*error = std::string("Unable to write checkpoint: ") + strerror(errno);
+			return false;
+		}
+#endif
+		return true;
+	}
+};
+
+#endif // _RIPPER6_CHECKPOINT_HPP_
@@ -0,0 +1,221 @@
+/**
+ * @file   chunk.hpp
+ * @brief  Walker for RIFF, IFF and MIDI style chunk trees.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_CHUNK_HPP_
+#define _RIPPER6_CHUNK_HPP_
+
+#include "format.hpp"
+
+/// Deepest level of nested container chunks to follow.
+#define CHUNK_MAX_DEPTH 8
+
+/// Compare a four-character chunk ID.
+inline bool chunk_id_is(const uint8_t *id, const char *v)
+{
+	return (id[0] == (uint8_t)v[0]) && (id[1] == (uint8_t)v[1])
+		&& (id[2] == (uint8_t)v[2]) && (id[3] == (uint8_t)v[3]);
+}
+
+/// Make sure a chunk ID or form type is printable ASCII.
+/**
+ * The RIFF spec allows control characters in IDs but no real files use them,
+ * and rejecting them removes a lot of false positives.
+ */
+inline bool chunk_id_valid(const uint8_t *id)
+{
+	for (unsigned int i = 0; i < 4; i++) {
+		if ((id[i] < 0x20) || (id[i] > 0x7E)) return false;
+	}
+	return true;
+}
+
+/// Chunk layout used by RIFF files.
+struct RiffChunks {
+	static const Endian endian = LittleEndian;
+	static const unsigned int align = 2;
+	static bool container(const uint8_t *id)
+	{
+		return chunk_id_is(id, "LIST");
+	}
+};
+
+/// Chunk layout used by IFF files.
+struct IffChunks {
+	static const Endian endian = BigEndian;
+	static const unsigned int align = 2;
+	static bool container(const uint8_t *id)
+	{
+		return chunk_id_is(id, "FORM") || chunk_id_is(id, "LIST")
+			|| chunk_id_is(id, "CAT ") || chunk_id_is(id, "PROP");
+	}
+};
+
+/// Chunk layout used by Standard MIDI files, which have no padding.
+struct MidiChunks {
+	static const Endian endian = BigEndian;
+	static const unsigned int align = 1;
+	static bool container(const uint8_t *id)
+	{
+		return false;
+	}
+};
+
+/// Visit each chunk in a list, and optionally the chunks nested inside them.
+/**
+ * Each chunk is a four byte ID, a four byte length, the data and an optional
+ * pad byte.  Container chunks (e.g. RIFF's LIST) begin with a four byte type
+ * and then hold another list of chunks.
+ *
+ * The walk is iterative and keeps its own fixed-size stack, so it never
+ * allocates and cannot run away on maliciously nested data.  Every chunk
+ * must fit inside its parent and have a printable ID, otherwise the walk
+ * stops and failed() returns true.
+ *
+ * @code
+ * ChunkWalker<RiffChunks> w(content + 12, lenChunk - 4, true);
+ * while (w.next()) {
+ *   if ((w.depth == 0) && chunk_id_is(w.id, "data")) ...
+ * }
+ * if (w.failed()) return false;
+ * @endcode
+ *
+ * @param T
+ *   RiffChunks, IffChunks or MidiChunks.
+ */
+template <class T>
+class ChunkWalker
+{
+	public:
+		const uint8_t *id;   ///< ID of the current chunk
+		const uint8_t *data; ///< Content of the current chunk
+		unsigned long len;   ///< Length of data, excluding any pad byte
+		unsigned int depth;  ///< Nesting level, 0 for the list given to the constructor
+		bool container;      ///< True if data begins with a type then more chunks
+
+		/// Prepare to walk a list of chunks.
+		/**
+		 * @param content
+		 *   First chunk header.
+		 *
+		 * @param len
+		 *   Length of the list.  No chunk may extend beyond this.
+		 *
+		 * @param recurse
+		 *   true to also visit the chunks inside container chunks, false to
+		 *   only visit the chunks at the top level.
+		 */
+		ChunkWalker(const uint8_t *content, unsigned long len, bool recurse)
+			:	id(NULL),
+				data(NULL),
+				len(0),
+				depth(0),
+				container(false),
+				levels(1),
+				recurse(recurse),
+				descend(false),
+				error(false)
+		{
+			this->stack[0].pos = content;
+			this->stack[0].end = content + len;
+		}
+
+		/// Advance to the next chunk, in depth-first order.
+		/**
+		 * @return true if there is another chunk, false at the end of the list
+		 *   or if the chunk is invalid, in which case failed() will be true.
+		 */
+		bool next()
+		{
+			if (this->error) return false;
+			if (this->descend) {
+				this->descend = false;
+				if (this->levels == CHUNK_MAX_DEPTH) return this->fail();
+				Level& n = this->stack[this->levels++];
+				n.pos = this->data + 4;
+				n.end = this->data + this->len;
+			}
+			for (;;) {
+				Level& l = this->stack[this->levels - 1];
+				unsigned long remaining = l.end - l.pos;
+				if (remaining < 8) {
+					// Anything left over is too short to be a chunk, so treat it as
+					// padding and carry on with the parent list.
+					if (this->levels == 1) return false;
+					this->levels--;
+					continue;
+				}
+				this->id = l.pos;
+				if (!chunk_id_valid(this->id)) return this->fail();
+				this->len = T::endian == LittleEndian
+					? as_u32le(l.pos + 4) : as_u32be(l.pos + 4);
+				if (this->len > remaining - 8) return this->fail();
+				this->data = l.pos + 8;
+				unsigned long lenPadded = this->len;
+				if (lenPadded % T::align) lenPadded += T::align - lenPadded % T::align;
+				// The pad byte after the last chunk is often missing
+				if (lenPadded > remaining - 8) lenPadded = remaining - 8;
+				l.pos += 8 + lenPadded;
+				this->depth = this->levels - 1;
+
+				this->container = T::container(this->id);
+				if (this->container) {
+					if (this->len < 4) return this->fail();
+					if (!chunk_id_valid(this->data)) return this->fail();
+					this->descend = this->recurse;
+				}
+				return true;
+			}
+		}
+
+		/// Was the walk stopped by an invalid chunk?
+		bool failed() const
+		{
+			return this->error;
+		}
+
+	private:
+		/// Position within one list of chunks
+		struct Level {
+			const uint8_t *pos;
+			const uint8_t *end;
+		};
+		Level stack[CHUNK_MAX_DEPTH];
+		unsigned int levels;  ///< Number of entries in use in stack
+		bool recurse;         ///< Follow container chunks?
+		bool descend;         ///< Enter the current chunk on the next call?
+		bool error;           ///< Invalid chunk found
+
+		bool fail()
+		{
+			this->error = true;
+			return false;
+		}
+};
+
+/// Check that every chunk in a list, and within its containers, is valid.
+template <class T>
+bool chunk_tree_valid(const uint8_t *content, unsigned long len)
+{
+	ChunkWalker<T> w(content, len, true);
+	while (w.next());
+	return !w.failed();
+}
+
+#endif // _RIPPER6_CHUNK_HPP_
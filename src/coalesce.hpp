@@ -0,0 +1,299 @@
+/**
+ * @file   coalesce.hpp
+ * @brief  Read many small files into one buffer, to search them together.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_COALESCE_HPP_
+#define _RIPPER6_COALESCE_HPP_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <vector>
+#include "platform.hpp"
+#include "check.hpp"
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+/// Default amount of small files read into the buffer at once, in MB.
+#define COALESCE_DEFAULT_BATCH 16
+
+/// Most files in one batch, each of which needs CHECK_PADDING after it.
+#define COALESCE_MAX_FILES 2048
+
+/// Largest file read into the buffer.  Anything bigger is mapped on its own,
+/// as an InputFile.
+#define COALESCE_SMALL_FILE (1024 * 1024)
+
+/// A file to search, found by list_files().
+struct SourceFile {
+	std::string path;
+	unsigned long long size;
+};
+
+/// Device and inode number of a directory, or the Windows equivalent.
+typedef std::pair<unsigned long long, unsigned long long> DirectoryId;
+
+/// Find every file to search.
+/**
+ * @param paths
+ *   Files and directories.  Directories are searched recursively, with the
+ *   files in each one taken in order of name.
+ *
+ * @param files
+ *   The files found are added to the end.
+ *
+ * @param error
+ *   On failure, set to a description of the problem.
+ *
+ * @param seen
+ *   Directories already searched.  Any directory reached a second time,
+ *   such as through a symlink to one of its parents, is skipped, so a loop
+ *   is only followed once.
+ *
+ * @return false if one of the paths could not be read.
+ */
+inline bool list_files(const std::vector<std::string>& paths,
+	std::vector<SourceFile> *files, std::string *error,
+	std::set<DirectoryId> *seen)
+{
+	for (std::vector<std::string>::const_iterator
+		p = paths.begin(); p != paths.end(); p++
+	) {
+		SourceFile f;
+		f.path = *p;
+		std::vector<std::string> names;
+#ifdef _WIN32
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		if (!GetFileAttributesEx(p->c_str(), GetFileExInfoStandard, &attr)) {
+			*error = "Unable to open " + *p + ": " + GetLastErrorAsString();
+			return false;
+		}
+		bool isDir = attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
+		std::string dir = *p + "\\";
+		if (isDir) {
+			// Opening a directory needs FILE_FLAG_BACKUP_SEMANTICS
+			HANDLE hDir = CreateFile(p->c_str(), 0, FILE_SHARE_READ
+				| FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+				FILE_FLAG_BACKUP_SEMANTICS, NULL);
+			BY_HANDLE_FILE_INFORMATION info;
+			bool known = (hDir != INVALID_HANDLE_VALUE)
+				&& GetFileInformationByHandle(hDir, &info);
+			if (hDir != INVALID_HANDLE_VALUE) CloseHandle(hDir);
+			if (known && !seen->insert(DirectoryId(info.dwVolumeSerialNumber,
+				((unsigned long long)info.nFileIndexHigh << 32) | info.nFileIndexLow)).second
+			) {
+				continue;
+			}
+			WIN32_FIND_DATA fd;
+			HANDLE h = FindFirstFile((dir + "*").c_str(), &fd);
+			if (h != INVALID_HANDLE_VALUE) {
+				do {
+					names.push_back(fd.cFileName);
+				} while (FindNextFile(h, &fd));
+				FindClose(h);
+			}
+		}
+		f.size = ((unsigned long long)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+#else
+		struct stat s;
+		if (stat(p->c_str(), &s) < 0) {
+			*error = "Unable to open " + *p + ": " + strerror(errno);
+			return false;
+		}
+		bool isDir = S_ISDIR(s.st_mode);
+		std::string dir = *p + "/";
+		if (isDir) {
+			if (!seen->insert(DirectoryId(s.st_dev, s.st_ino)).second) continue;
+			DIR *d = opendir(p->c_str());
+			if (!d) {
+				*error = "Unable to read directory " + *p + ": " + strerror(errno);
+				return false;
+			}
+			while (struct dirent *e = readdir(d)) names.push_back(e->d_name);
+			closedir(d);
+		} else if (!S_ISREG(s.st_mode)) {
+			// Skip devices, pipes and the like, which only turn up in a directory
+			continue;
+		}
+		f.size = s.st_size;
+#endif
+		if (isDir) {
+			std::sort(names.begin(), names.end());
+			std::vector<std::string> children;
+			for (std::vector<std::string>::const_iterator
+				n = names.begin(); n != names.end(); n++
+			) {
+				if ((*n == ".") || (*n == "..")) continue;
+				children.push_back(dir + *n);
+			}
+			if (!list_files(children, files, error, seen)) return false;
+		} else {
+			files->push_back(f);
+		}
+	}
+	return true;
+}
+
+/// Find every file to search, see above.
+inline bool list_files(const std::vector<std::string>& paths,
+	std::vector<SourceFile> *files, std::string *error)
+{
+	std::set<DirectoryId> seen;
+	return list_files(paths, files, error, &seen);
+}
+
+/// Small files read one after the other into a single buffer.
+/**
+ * Opening, mapping and unmapping a file takes about as long as searching a
+ * few kilobytes of it, so for a directory of tiny files most of the time
+ * would go on that.  Instead they are read into one buffer with a single
+ * read each, and searched together.
+ *
+ * Each file is searched on its own, as the data given to the checkers for
+ * it ends where the file does, so no match can run on into the next one.
+ * Each is also followed by CHECK_PADDING bytes of zeroes, as the checkers
+ * expect.  Only the files are cleared again afterwards, so the padding
+ * between them stays zero without being written.
+ *
+ * The padding is far bigger than a tiny file, so room for it is reserved on
+ * top of the size asked for, for up to COALESCE_MAX_FILES files.  The buffer
+ * comes from calloc(), which for a block this size gets fresh pages from the
+ * system, so padding that is only ever read costs address space but not
+ * memory.
+ */
+class FileBatch
+{
+	public:
+		/// A file in the batch.
+		struct Entry {
+			std::string path;
+			unsigned long long start;  ///< Offset in the buffer
+			unsigned long len;
+		};
+
+		/**
+		 * @param capacity
+		 *   Bytes of files to hold, not counting the padding.  It is made big
+		 *   enough for any small file.
+		 */
+		FileBatch(unsigned long long capacity)
+			:	capacity(std::max<unsigned long long>(capacity, COALESCE_SMALL_FILE)),
+				size(this->capacity + COALESCE_MAX_FILES * CHECK_PADDING),
+				buf((uint8_t *)calloc(this->size, 1)),
+				used(0)
+		{
+		}
+
+		~FileBatch()
+		{
+			free(this->buf);
+		}
+
+		FileBatch(const FileBatch&) = delete;
+		FileBatch& operator= (const FileBatch&) = delete;
+
+		/// Could the buffer be allocated?
+		bool valid() const
+		{
+			return this->buf != NULL;
+		}
+
+		/// Is there room for another file of this size?
+		bool fits(unsigned long long size) const
+		{
+			return (this->list.size() < COALESCE_MAX_FILES)
+				&& (this->bytes() + size <= this->capacity);
+		}
+
+		/// Read a file into the buffer, which must fit.
+		/**
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the file could not be read.
+		 */
+		bool add(const SourceFile& f, std::string *error)
+		{
+			FILE *in = fopen(f.path.c_str(), "rb");
+			if (!in) {
+				*error = "Unable to open " + f.path + ": " + strerror(errno);
+				return false;
+			}
+			Entry e;
+			e.path = f.path;
+			e.start = this->used;
+			// The file may have changed size since it was listed
+			e.len = fread(&this->buf[e.start], 1, f.size, in);
+			bool failed = ferror(in);
+			int err = errno;
+			fclose(in);
+			if (failed) {
+				*error = "Unable to read " + f.path + ": " + strerror(err);
+				memset(&this->buf[e.start], 0, e.len);
+				return false;
+			}
+			this->used += e.len + CHECK_PADDING;
+			this->list.push_back(e);
+			return true;
+		}
+
+		/// The files in the batch, in the order they were added.
+		const std::vector<Entry>& files() const
+		{
+			return this->list;
+		}
+
+		/// Start of a file's content.
+		const uint8_t *data(const Entry& e) const
+		{
+			return &this->buf[e.start];
+		}
+
+		/// Bytes of files in the batch.
+		unsigned long long bytes() const
+		{
+			return this->used - this->list.size() * CHECK_PADDING;
+		}
+
+		/// Empty the batch, so it can be filled again.
+		/**
+		 * Nothing may still be reading the files, such as an OutputWriter.
+		 */
+		void clear()
+		{
+			for (std::vector<Entry>::const_iterator
+				e = this->list.begin(); e != this->list.end(); e++
+			) {
+				memset(&this->buf[e->start], 0, e->len);
+			}
+			this->list.clear();
+			this->used = 0;
+		}
+
+	private:
+		unsigned long long capacity;  ///< Bytes of files that will fit
+		unsigned long long size;      ///< Length of buf
+		uint8_t *buf;                 ///< Files and padding, otherwise zero
+		unsigned long long used;      ///< Bytes of buf in use
+		std::vector<Entry> list;
+};
+
+#endif // _RIPPER6_COALESCE_HPP_
@@ -0,0 +1,256 @@
+/**
+ * @file   compress.hpp
+ * @brief  Compress matches as they are saved.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_COMPRESS_HPP_
+#define _RIPPER6_COMPRESS_HPP_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <cstdio>
+#include <vector>
+#include "platform.hpp"
+#include "trace.hpp"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/// Size of the buffer compressed data is written out from.
+#define COMPRESS_BUFFER (256 * 1024)
+
+/// Level meaning the library's own default.
+#define COMPRESS_DEFAULT_LEVEL -1
+
+/// How matches are compressed when they are saved.
+enum Compression {
+	CompressNone,
+	CompressGzip,   ///< .gz, with zlib
+	CompressZstd    ///< .zst, with libzstd
+};
+
+/// Look up a method by the name given to --compress.
+/**
+ * @return false if the name is unknown, or ripper6 was built without the
+ *   library for it.
+ */
+inline bool compression_from_name(const std::string& name, Compression *method)
+{
+#ifdef HAVE_ZLIB
+	if ((name == "gzip") || (name == "gz")) {
+		*method = CompressGzip;
+		return true;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if ((name == "zstd") || (name == "zst")) {
+		*method = CompressZstd;
+		return true;
+	}
+#endif
+	if (name == "none") {
+		*method = CompressNone;
+		return true;
+	}
+	return false;
+}
+
+/// Names of the methods this build supports, for the usage message.
+inline std::string compression_names()
+{
+	std::string names = "none";
+#ifdef HAVE_ZLIB
+	names += ", gzip";
+#endif
+#ifdef HAVE_ZSTD
+	names += ", zstd";
+#endif
+	return names;
+}
+
+/// Name of a method, as given to --compress.
+inline const char *compression_name(Compression method)
+{
+	switch (method) {
+		case CompressGzip: return "gzip";
+		case CompressZstd: return "zstd";
+		default: return "none";
+	}
+}
+
+/// Added to the name of each file saved with a method.
+inline const char *compression_suffix(Compression method)
+{
+	switch (method) {
+		case CompressGzip: return ".gz";
+		case CompressZstd: return ".zst";
+		default: return "";
+	}
+}
+
+/// Suffix a saved file has been given by its compression, if any.
+/**
+ * This lets a file be renamed without losing it, such as when ripper6-merge
+ * renumbers the matches.
+ */
+inline std::string compressed_suffix(const std::string& filename)
+{
+	static const Compression methods[] = {CompressGzip, CompressZstd};
+	for (unsigned int i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		std::string s = compression_suffix(methods[i]);
+		if ((filename.length() > s.length())
+			&& (filename.compare(filename.length() - s.length(), s.length(), s) == 0)
+		) {
+			return s;
+		}
+	}
+	return std::string();
+}
+
+/// Save a block of data to a new file, compressing it on the way.
+/**
+ * The data is read where it is, so a match in the memory-mapped input is
+ * compressed straight from the page cache, and only COMPRESS_BUFFER bytes of
+ * the compressed form are held at a time.
+ *
+ * @param filename
+ *   File to create, including the suffix for the method.  It is overwritten
+ *   if it already exists.
+ *
+ * @param method
+ *   How to compress the data, which must not be CompressNone.
+ *
+ * @param level
+ *   Compression level, or COMPRESS_DEFAULT_LEVEL.
+ *
+ * @param error
+ *   On failure, set to a description of the problem.
+ *
+ * @param dir
+ *   Handle to the directory filename is relative to.  On Windows this is
+ *   ignored and filename must be the full path.
+ *
+ * @return 0 on success, or the program exit code to use on failure.
+ */
+inline int write_compressed(const std::string& filename, const uint8_t *data,
+	unsigned long len, Compression method, int level, std::string *error,
+	int dir)
+{
+	TraceSpan span("compress", len);
+#ifdef _WIN32
+	FILE *f = fopen(filename.c_str(), "wb");
+#else
+	int fd = openat(dir, filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	FILE *f = (fd < 0) ? NULL : fdopen(fd, "wb");
+	if ((fd >= 0) && !f) close(fd);
+#endif
+	if (!f) {
+		*error = std::string("Unable to open output file: ") + strerror(errno);
+		return 5;
+	}
+	std::vector<uint8_t> buf(COMPRESS_BUFFER);
+	std::string problem;
+
+	switch (method) {
+#ifdef HAVE_ZLIB
+		case CompressGzip: {
+			z_stream zs;
+			memset(&zs, 0, sizeof(zs));
+			// 16 more window bits asks for a gzip header rather than zlib's own
+			if (deflateInit2(&zs, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+				Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK
+			) {
+				problem = "Unable to start zlib";
+				break;
+			}
+			unsigned long fed = 0;
+			int r;
+			do {
+				// avail_in is only 32 bits wide
+				if ((zs.avail_in == 0) && (fed < len)) {
+					unsigned long n = std::min<unsigned long>(len - fed, 1 << 30);
+					zs.next_in = (Bytef *)data + fed;
+					zs.avail_in = n;
+					fed += n;
+				}
+				zs.next_out = &buf[0];
+				zs.avail_out = buf.size();
+				r = deflate(&zs, fed == len ? Z_FINISH : Z_NO_FLUSH);
+				if ((r != Z_OK) && (r != Z_STREAM_END) && (r != Z_BUF_ERROR)) {
+					problem = "zlib failed";
+					break;
+				}
+				unsigned long out = buf.size() - zs.avail_out;
+				if (fwrite(&buf[0], 1, out, f) != out) {
+					problem = std::string("Unable to write output file: ")
+						+ strerror(errno);
+					break;
+				}
+			} while (r != Z_STREAM_END);
+			deflateEnd(&zs);
+			break;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case CompressZstd: {
+			ZSTD_CCtx *cctx = ZSTD_createCCtx();
+			if (!cctx) {
+				problem = "Unable to start zstd";
+				break;
+			}
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+				level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+			ZSTD_inBuffer in = {data, len, 0};
+			size_t r;
+			do {
+				ZSTD_outBuffer out = {&buf[0], buf.size(), 0};
+				r = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+				if (ZSTD_isError(r)) {
+					problem = std::string("zstd failed: ") + ZSTD_getErrorName(r);
+					break;
+				}
+				if (fwrite(&buf[0], 1, out.pos, f) != out.pos) {
+					problem = std::string("Unable to write output file: ")
+						+ strerror(errno);
+					break;
+				}
+			} while (r != 0);
+			ZSTD_freeCCtx(cctx);
+			break;
+		}
+#endif
+		default:
+			problem = "Compression method is not available";
+			break;
+	}
+
+	if ((fclose(f) != 0) && problem.empty()) {
+		problem = std::string("Unable to write output file: ") + strerror(errno);
+	}
+	if (!problem.empty()) {
+		*error = problem;
+		return 6;
+	}
+	return 0;
+}
+
+#endif // _RIPPER6_COMPRESS_HPP_
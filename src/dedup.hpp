@@ -0,0 +1,349 @@
+/**
+ * @file   dedup.hpp
+ * @brief  Skip content that has already been searched in another file.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_DEDUP_HPP_
+#define _RIPPER6_DEDUP_HPP_
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "platform.hpp"
+#include "manifest.hpp"
+#include "profile.hpp"
+#include "signature.hpp"
+
+/// Version written to and expected in chunk store files.
+#define DEDUP_VERSION 1
+
+/// Smallest chunk, except at the end of a file.
+#define DEDUP_MIN_CHUNK (256 * 1024)
+
+/// Largest chunk, cut even if the content has no boundary in it.
+#define DEDUP_MAX_CHUNK (4 * 1024 * 1024)
+
+/// Bits of the rolling hash that must be zero for a boundary.  Each offset is
+/// a boundary with a chance of one in 2^20, for chunks of about 1MB.
+#define DEDUP_BOUNDARY_MASK (0xFFFFFULL << 44)
+
+/// Default part of a reused chunk searched again before its end, in kB.
+#define DEDUP_DEFAULT_WINDOW 64
+
+/// Split content into chunks at boundaries chosen by the content itself.
+/**
+ * A boundary goes wherever a hash of the 64 bytes before it has the bits in
+ * DEDUP_BOUNDARY_MASK clear.  This is a gear hash, which shifts the old bytes
+ * out as it goes, so where a boundary falls only depends on the bytes just
+ * before it.  Inserting or removing data in one copy of a file therefore
+ * only changes the chunks around the edit, and the chunks after it line up
+ * with those of the other copy again.
+ *
+ * @param ends
+ *   Set to the offset after the end of each chunk, in order.  The last one is
+ *   size.
+ */
+inline void find_chunks(const uint8_t *content, unsigned long long size,
+	std::vector<unsigned long long> *ends)
+{
+	static uint64_t gear[256];
+	static bool ready = false;
+	if (!ready) {
+		// Any fixed random values will do, these are from splitmix64
+		uint64_t x = 0;
+		for (unsigned int i = 0; i < 256; i++) {
+			uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			gear[i] = z ^ (z >> 31);
+		}
+		ready = true;
+	}
+
+	ends->clear();
+	unsigned long long start = 0;
+	while (start < size) {
+		unsigned long long end = std::min<unsigned long long>(
+			start + DEDUP_MAX_CHUNK, size);
+		unsigned long long pos = start + DEDUP_MIN_CHUNK;
+		if (pos < end) {
+			// Only the last 64 bytes affect the hash, so start just before
+			// the first place a boundary may go
+			uint64_t h = 0;
+			for (unsigned long long i = pos - 64; i < pos; i++) {
+				h = (h << 1) + gear[content[i]];
+			}
+			while ((pos < end) && (h & DEDUP_BOUNDARY_MASK)) {
+				h = (h << 1) + gear[content[pos++]];
+			}
+		}
+		end = std::min(pos, end);
+		ends->push_back(end);
+		start = end;
+	}
+}
+
+/// 64-bit hash identifying the content of a chunk.
+/**
+ * This is MurmurHash3's mixing, a word at a time, which is fast enough not to
+ * matter next to the search.  Chunks are also told apart by length.
+ */
+inline uint64_t chunk_hash(const uint8_t *content, unsigned long len)
+{
+	static const uint64_t c1 = 0x87C37B91114253D5ULL, c2 = 0x4CF5AD432745937FULL;
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+	unsigned long i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, content + i, 8);
+		w *= c1;
+		w = (w << 31) | (w >> 33);
+		w *= c2;
+		h ^= w;
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+	}
+	uint64_t w = 0;
+	for (unsigned int b = 0; i < len; i++, b += 8) w |= (uint64_t)content[i] << b;
+	h ^= w * c1;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/// Settings that change what the checkers find, which a store is only valid
+/// for.
+/**
+ * @param active
+ *   Checkers being searched with, in priority order.
+ *
+ * @return One line per setting.
+ */
+inline std::string dedup_config(const std::vector<Checker>& active)
+{
+	std::ostringstream ss;
+	ss << "checkers";
+	for (std::vector<Checker>::const_iterator
+		c = active.begin(); c != active.end(); c++
+	) {
+		ss << ' ' << c->name;
+	}
+	ss << "\n";
+	const std::vector<CheckerLimit>& limits = checker_limits();
+	for (std::vector<CheckerLimit>::const_iterator
+		l = limits.begin(); l != limits.end(); l++
+	) {
+		ss << "limit " << l->name << ' ' << *l->value << "\n";
+	}
+	const std::vector<std::string>& specs = UserSignatures::instance().specs();
+	for (std::vector<std::string>::const_iterator
+		s = specs.begin(); s != specs.end(); s++
+	) {
+		ss << "signature " << *s << "\n";
+	}
+	return ss.str();
+}
+
+/// The matches found in every chunk searched so far, kept between runs.
+/**
+ * A chunk is only recorded when the search started at the beginning of it,
+ * rather than part way in because the match before it ran over the boundary.
+ * Every match that starts in the chunk is listed, with its offset from the
+ * start of the chunk, including one at the end that runs on into the next
+ * chunk.
+ *
+ * The store is a text file like a manifest:
+ *
+ * @code
+ * # ripper6 chunk store
+ * version 1
+ * checkers cdfm cmf ibk iff midi riff s3m tbsa voc
+ * limit cdfm.max-sample 1048576
+ * chunk 3f1d2c0b9a8e7f60 1048576
+ * match 8192 4122 wav
+ * meta rate=22050 channels=1 bits=8
+ * @endcode
+ *
+ * The checkers, limits and signatures in use are kept with it, as the
+ * results would be wrong with different ones.
+ */
+class ChunkStore
+{
+	public:
+		ChunkStore()
+			:	loaded(0)
+		{
+		}
+
+		/// Read a store, or start an empty one if the file does not exist.
+		/**
+		 * @param config
+		 *   Value from dedup_config() that the store must have been made with.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the file could not be read, or was made with
+		 *   different settings.
+		 */
+		bool load(const std::string& filename, const std::string& config,
+			std::string *error)
+		{
+			this->config = config;
+			std::ifstream f(filename.c_str());
+			if (!f) return true;
+			int version = 0;
+			std::string fileConfig, line;
+			std::vector<ManifestEntry> *chunk = NULL;
+			while (std::getline(f, line)) {
+				if (line.empty() || (line[0] == '#')) continue;
+				std::istringstream ss(line);
+				std::string key;
+				ss >> key;
+				if (key == "version") {
+					ss >> version;
+				} else if ((key == "checkers") || (key == "limit")
+					|| (key == "signature")
+				) {
+					fileConfig += line + "\n";
+				} else if (key == "chunk") {
+					uint64_t hash;
+					unsigned long len;
+					if (!(ss >> std::hex >> hash >> std::dec >> len)) {
+						*error = filename + " has an invalid line: " + line;
+						return false;
+					}
+					chunk = &this->chunks[Key(hash, len)];
+					chunk->clear();
+				} else if ((key == "match") && chunk) {
+					ManifestEntry m;
+					std::string ext;
+					if (!(ss >> m.offset >> m.len >> ext)) {
+						*error = filename + " has an invalid line: " + line;
+						return false;
+					}
+					m.format = format_from_ext(ext);
+					chunk->push_back(m);
+				} else if ((key == "meta") && chunk && !chunk->empty()) {
+					read_meta(ss, &chunk->back().meta);
+				}
+			}
+			if (version != DEDUP_VERSION) {
+				*error = filename + " is not a valid chunk store";
+				return false;
+			}
+			if (fileConfig != config) {
+				*error = "Chunk store " + filename + " was made with different "
+					"formats, limits or signatures";
+				return false;
+			}
+			this->loaded = this->chunks.size();
+			return true;
+		}
+
+		/// Matches recorded for a chunk.
+		/**
+		 * @return NULL if the chunk has not been seen before.
+		 */
+		const std::vector<ManifestEntry> *find(uint64_t hash,
+			unsigned long len) const
+		{
+			std::map<Key, std::vector<ManifestEntry> >::const_iterator
+				i = this->chunks.find(Key(hash, len));
+			return i == this->chunks.end() ? NULL : &i->second;
+		}
+
+		/// Record the matches in a chunk.
+		/**
+		 * @param matches
+		 *   Matches starting in the chunk, with offsets from its start.
+		 */
+		void add(uint64_t hash, unsigned long len,
+			const std::vector<ManifestEntry>& matches)
+		{
+			this->chunks[Key(hash, len)] = matches;
+		}
+
+		/// Number of chunks in the file when it was loaded.
+		unsigned long long sizeLoaded() const
+		{
+			return this->loaded;
+		}
+
+		/// Write the store, replacing the old one.
+		/**
+		 * It is written to a temporary file and renamed over the old one, so
+		 * an interruption cannot leave it half written.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the file could not be written.
+		 */
+		bool save(const std::string& filename, std::string *error) const
+		{
+			std::string temp = filename + ".tmp";
+			{
+				std::ofstream f(temp.c_str(), std::ios::binary | std::ios::trunc);
+				f << "# ripper6 chunk store\n"
+					"version " << DEDUP_VERSION << "\n" << this->config;
+				for (std::map<Key, std::vector<ManifestEntry> >::const_iterator
+					c = this->chunks.begin(); c != this->chunks.end(); c++
+				) {
+					f << "chunk " << std::hex << std::setw(16) << std::setfill('0')
+						<< c->first.first << std::dec << ' ' << c->first.second << "\n";
+					for (std::vector<ManifestEntry>::const_iterator
+						m = c->second.begin(); m != c->second.end(); m++
+					) {
+						f << "match " << m->offset << ' ' << m->len << ' ' << m->ext()
+							<< "\n";
+						std::ostringstream meta;
+						if (write_meta(meta, m->meta)) f << "meta " << meta.str() << "\n";
+					}
+				}
+				f.flush();
+				if (!f) {
+					*error = "Unable to write chunk store " + temp;
+					return false;
+				}
+			}
+#ifdef _WIN32
+			bool ok = MoveFileEx(temp.c_str(), filename.c_str(),
+				MOVEFILE_REPLACE_EXISTING);
+#else
+			bool ok = rename(temp.c_str(), filename.c_str()) == 0;
+#endif
+			if (!ok) {
+				*error = "Unable to replace chunk store " + filename;
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		typedef std::pair<uint64_t, unsigned long> Key;  ///< Hash and length
+		std::map<Key, std::vector<ManifestEntry> > chunks;
+		std::string config;            ///< Settings the store is valid for
+		unsigned long long loaded;      ///< Chunks read by load()
+};
+
+#endif // _RIPPER6_DEDUP_HPP_
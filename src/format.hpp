@@ -0,0 +1,266 @@
+/**
+ * @file   format.hpp
+ * @brief  Compile-time descriptions of simple file formats.
+ *
+ * Many formats are nothing more than some magic bytes at a fixed offset,
+ * followed by a length field giving the size of the rest of the file.  Rather
+ * than hand-writing the bounds checks for each of these, the layout can be
+ * described with the templates in this file and the checks are generated
+ * from it.  The magic bytes also become the format's Signature, which the
+ * prefilter uses to skip the checker at offsets where it cannot match.
+ *
+ * A complete format looks like this:
+ *
+ *   FORMAT_MAGIC(ibk_magic, 0, "IBK\x1A");
+ *   struct fmt_ibk: Format<ibk_magic, FixedLength<IBK_LEN> > {
+ *     static void describe(Match *mc) { ... }
+ *   };
+ *   bool check_ibk(const uint8_t *content, unsigned long len, Match *mc)
+ *   {
+ *     return check_format<fmt_ibk>(content, len, mc);
+ *   }
+ *
+ * Formats that need further checks can supply their own validate() function,
+ * and formats that need more than this can call Format::header() directly
+ * and carry on from there.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_FORMAT_HPP_
+#define _RIPPER6_FORMAT_HPP_
+
+#include "check.hpp"
+
+/// Declare the magic bytes for a format.
+/**
+ * @param name
+ *   Name of the type to declare, e.g. riff_magic.
+ *
+ * @param off
+ *   Offset of the magic bytes from the start of the file.
+ *
+ * @param str
+ *   The magic bytes themselves, which can contain embedded nulls.
+ */
+#define FORMAT_MAGIC(name, off, str) \
+	struct name { \
+		static const unsigned int offset = off; \
+		static const unsigned int len = sizeof(str) - 1; \
+		static const char *bytes() { return str; } \
+		static const char *upper() { return str; } \
+	}
+
+/// Declare the range of values the first bytes of a format can have.
+/**
+ * This is for formats without magic bytes, whose header instead starts with
+ * fields that only have a few valid values.  It can be given to SIGNATURE()
+ * and StaticChecker, so the prefilter can skip offsets where these bytes are
+ * out of range, but not to Format, which needs exact magic bytes.
+ *
+ * @param name
+ *   Name of the type to declare, e.g. cdfm_range.
+ *
+ * @param off
+ *   Offset of the first byte from the start of the file.
+ *
+ * @param low
+ *   Lowest valid value of each byte.
+ *
+ * @param high
+ *   Highest valid value of each byte, the same length as low.
+ */
+#define FORMAT_RANGE(name, off, low, high) \
+	struct name { \
+		static_assert(sizeof(low) == sizeof(high), "Range ends must be the same length"); \
+		static const unsigned int offset = off; \
+		static const unsigned int len = sizeof(low) - 1; \
+		static const char *bytes() { return low; } \
+		static const char *upper() { return high; } \
+	}
+
+/// Signature entry for Checker, from a type declared with FORMAT_MAGIC or
+/// FORMAT_RANGE.
+#define SIGNATURE(magic) { magic::offset, magic::len, \
+	(const uint8_t *)magic::bytes(), (const uint8_t *)magic::upper() }
+
+/// Signature entry for Checker, for formats without any magic bytes.
+#define NO_SIGNATURE { 0, 0, NULL, NULL }
+
+/// Byte order of a length field.
+enum Endian {
+	LittleEndian,
+	BigEndian
+};
+
+/// Length of the file is stored in the file header.
+/**
+ * @param Offset
+ *   Offset of the length field from the start of the file.
+ *
+ * @param Width
+ *   Size of the length field in bytes: 1, 2 or 4.
+ *
+ * @param E
+ *   Byte order of the length field.
+ */
+template <unsigned int Offset, unsigned int Width, Endian E>
+struct LengthField {
+	static const unsigned long end = Offset + Width;
+
+	static unsigned long read(const uint8_t *content)
+	{
+		const uint8_t *p = content + Offset;
+		switch (Width) {
+			case 1: return *p;
+			case 2: return E == LittleEndian ? as_u16le(p) : as_u16be(p);
+			default: return E == LittleEndian ? as_u32le(p) : as_u32be(p);
+		}
+	}
+};
+
+/// All files of this format are the same size.
+template <unsigned long Len>
+struct FixedLength {
+	static const unsigned long end = 0;
+
+	static unsigned long read(const uint8_t *content)
+	{
+		return Len;
+	}
+};
+
+/// The length of the file is not in the header, so the checker must find it.
+/**
+ * Format::header() will report the length of the magic and nothing more.
+ */
+struct NoLength {
+	static const unsigned long end = 0;
+
+	static unsigned long read(const uint8_t *content)
+	{
+		return 0;
+	}
+};
+
+/// Description of a format, from which the checks are generated.
+/**
+ * @param M
+ *   Magic bytes, declared with FORMAT_MAGIC.
+ *
+ * @param L
+ *   Where the length comes from: LengthField, FixedLength or NoLength.
+ *
+ * @param Bias
+ *   Number added to the length field to get the length of the whole file,
+ *   e.g. 8 for a RIFF header as the length excludes the header itself.
+ *
+ * @param Align
+ *   The length field is rounded up to a multiple of this before Bias is added,
+ *   e.g. 2 for chunk formats where odd-sized chunks have a pad byte.  The
+ *   padding may be missing at the end of the input, as it often is.
+ *
+ * @param MaxLen
+ *   Variable holding the largest value to accept in the length field, or
+ *   NULL for no limit.  Larger values are treated as false positives.  This
+ *   is read at run time so a profile can change it.
+ */
+template <class M, class L, unsigned long Bias = 0, unsigned int Align = 1,
+	const unsigned long *MaxLen = nullptr>
+struct Format {
+	typedef M magic;
+
+	/// Number of bytes that must be available to read the magic and length.
+	static const unsigned long lenHead =
+		(M::offset + M::len > L::end) ? M::offset + M::len : L::end;
+
+	static_assert(lenHead <= CHECK_PADDING,
+		"The header must fit in the padding, as it is read before len is checked");
+
+	/// Check the magic bytes and length field.
+	/**
+	 * @param content
+	 *   Candidate offset, as passed to the CheckFunction.
+	 *
+	 * @param len
+	 *   Bytes available at content, as passed to the CheckFunction.
+	 *
+	 * @param lenTotal
+	 *   On return, length of the file including the header, which is
+	 *   guaranteed to be no more than len.  If the format has no length field
+	 *   this is the length of the magic bytes.
+	 *
+	 * @return true if the header is valid, false if not.
+	 */
+	static bool header(const uint8_t *content, unsigned long len,
+		unsigned long *lenTotal)
+	{
+		// Nothing is compared with len until the end, as the padding makes it
+		// safe to read the header even if it is cut off
+		const uint8_t *t = content + M::offset;
+		const uint8_t *vp = (const uint8_t *)M::bytes();
+		for (unsigned int i = 0; i < M::len; i++) {
+			if (t[i] != vp[i]) return false;
+		}
+
+		unsigned long long lenField = L::read(content);
+		if (MaxLen && (lenField > *MaxLen)) return false;
+		unsigned long long lenPadded = lenField;
+		if (lenPadded % Align) lenPadded += Align - lenPadded % Align;
+		lenField += Bias;
+		lenPadded += Bias;
+		if (lenField < lenHead) lenField = lenHead;
+		if (lenField > len) return false;
+		// Only the data itself has to be there, not the padding after it
+		*lenTotal = std::min<unsigned long long>(std::max(lenPadded, lenField), len);
+		return true;
+	}
+
+	/// Further checks once the header is known to be valid.
+	/**
+	 * Formats can hide this with their own function to reject files that
+	 * have a valid header but invalid content.
+	 *
+	 * @param content
+	 *   Start of the file.
+	 *
+	 * @param lenTotal
+	 *   Length of the file as returned by header().
+	 */
+	static bool validate(const uint8_t *content, unsigned long lenTotal)
+	{
+		return true;
+	}
+};
+
+/// CheckFunction generated entirely from a format description.
+/**
+ * @param F
+ *   Type derived from Format, which must also supply a static
+ *   describe(Match *) function that calls Match::found() with its FormatId.
+ */
+template <class F>
+bool check_format(const uint8_t *content, unsigned long len, Match *mc)
+{
+	unsigned long lenTotal;
+	if (!F::header(content, len, &lenTotal)) return false;
+	if (!F::validate(content, lenTotal)) return false;
+	mc->len = lenTotal;
+	F::describe(mc);
+	return true;
+}
+
+#endif // _RIPPER6_FORMAT_HPP_
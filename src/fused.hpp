@@ -0,0 +1,206 @@
+/**
+ * @file   fused.hpp
+ * @brief  Scan loop with every checker inlined, generated at compile time.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_FUSED_HPP_
+#define _RIPPER6_FUSED_HPP_
+
+#include "checkers.hpp"
+#include "prefilter.hpp"
+
+/// Magic for checkers without a signature, which are tried at every offset.
+FORMAT_MAGIC(no_magic, 0, "");
+
+/// A checker known at compile time.
+/**
+ * @param Fn
+ *   The CheckFunction.
+ *
+ * @param M
+ *   Magic bytes declared with FORMAT_MAGIC or FORMAT_RANGE, whose first byte
+ *   is tested before Fn is called, the same as the Prefilter does.
+ */
+template <CheckFunction Fn, class M = no_magic>
+struct StaticChecker {
+	static_assert(M::offset < CHECK_PADDING, "Magic must be within the padding");
+
+	static inline bool check(const uint8_t *content, unsigned long len, Match *mc)
+	{
+		// Past the end this reads the padding, and the checker rejects it.
+		// For exact magic the range is one value, so this is a comparison.
+		if (M::len && ((uint8_t)(content[M::offset] - (uint8_t)M::bytes()[0])
+			> (uint8_t)(M::upper()[0] - M::bytes()[0]))
+		) {
+			return false;
+		}
+		return Fn(content, len, mc);
+	}
+
+	static CheckFunction function()
+	{
+		return Fn;
+	}
+};
+
+/// A list of StaticChecker types, in priority order.
+/**
+ * Each checker is a template parameter rather than a function pointer, so
+ * the calls are all inlined into one loop, and the compiler can share the
+ * loads of bytes that several checkers look at.
+ */
+template <class... C>
+struct FusedList;
+
+/// End of the list.
+template <>
+struct FusedList<> {
+	static const unsigned int count = 0;
+
+	template <bool Masked>
+	static inline int match(const uint8_t *content, unsigned long len,
+		Match *mc, CheckerSet mask, unsigned int index)
+	{
+		return -1;
+	}
+
+	static bool sameAs(const Checker *list)
+	{
+		return true;
+	}
+};
+
+template <class First, class... Rest>
+struct FusedList<First, Rest...> {
+	static const unsigned int count = 1 + sizeof...(Rest);
+
+	/// Find the first checker in the list that matches at this offset.
+	/**
+	 * @param Masked
+	 *   false to try every checker, true to skip those not in mask.
+	 *
+	 * @param mask
+	 *   Checkers to try, bit 0 being the first in the list.
+	 *
+	 * @param index
+	 *   Position of First in the whole list.
+	 *
+	 * @return Index of the matching checker in the list, or -1.
+	 */
+	template <bool Masked>
+	static inline int match(const uint8_t *content, unsigned long len,
+		Match *mc, CheckerSet mask, unsigned int index)
+	{
+		if ((!Masked || (mask & ((CheckerSet)1 << index)))
+			&& First::check(content, len, mc)
+		) {
+			return index;
+		}
+		return FusedList<Rest...>::template match<Masked>(content, len, mc, mask,
+			index + 1);
+	}
+
+	/// Scan a range of offsets for the first match.
+	/**
+	 * @param content
+	 *   The input.
+	 *
+	 * @param size
+	 *   Length of the input.  Matches may extend past end, up to here.
+	 *
+	 * @param pos
+	 *   Offset to start at.  Set to the offset of the match, or to end.
+	 *
+	 * @param end
+	 *   Offset to stop scanning at.
+	 *
+	 * @param mc
+	 *   Details of the match, if any.
+	 *
+	 * @param mask
+	 *   Checkers to try if Masked is true.
+	 *
+	 * @return Index of the matching checker in the list, or -1 if there was
+	 *   no match before end.
+	 */
+	template <bool Masked>
+	static int scan(const uint8_t *content, unsigned long long size,
+		unsigned long long *pos, unsigned long long end, Match *mc,
+		CheckerSet mask)
+	{
+		for (unsigned long long p = *pos; p < end; p++) {
+			int c = match<Masked>(content + p, size - p, mc, mask, 0);
+			if (c >= 0) {
+				*pos = p;
+				return c;
+			}
+		}
+		*pos = end;
+		return -1;
+	}
+
+	/// Make sure the list holds the same functions, in the same order, as
+	/// a table of count Checkers.
+	static bool sameAs(const Checker *list)
+	{
+		if (list[0].fn != First::function()) return false;
+		return FusedList<Rest...>::sameAs(list + 1);
+	}
+};
+
+/// Every checker, in the same order as checkers[].
+typedef FusedList<
+	StaticChecker<check_cdfm, cdfm_range>,
+	StaticChecker<check_cmf, cmf_magic>,
+	StaticChecker<check_ibk, ibk_magic>,
+	StaticChecker<check_iff, iff_magic>,
+	StaticChecker<check_midi, midi_magic>,
+	StaticChecker<check_riff, riff_magic>,
+	StaticChecker<check_s3m, s3m_magic>,
+	StaticChecker<check_tbsa, tbsa_magic>,
+	StaticChecker<check_voc, voc_magic>
+> AllCheckers;
+
+static_assert(AllCheckers::count == sizeof(checkers) / sizeof(checkers[0]),
+	"AllCheckers must list every entry in checkers[]");
+static_assert(AllCheckers::count <= PREFILTER_MAX_CHECKERS,
+	"Too many checkers for a CheckerSet");
+
+/// Scan loop generated by FusedList::scan().
+typedef int (*FusedScan)(const uint8_t *content, unsigned long long size,
+	unsigned long long *pos, unsigned long long end, Match *mc, CheckerSet mask);
+
+/// Pick the scan loop for the checkers selected on the command line.
+/**
+ * @param mask
+ *   Checkers to use, bit n being checkers[n].
+ *
+ * @return Loop to call with mask, or NULL if the loop does not match the
+ *   checker table and the Scanner must call the checkers itself.
+ */
+inline FusedScan select_fused(CheckerSet mask)
+{
+	static const bool valid = AllCheckers::sameAs(checkers);
+	if (!valid || !mask) return NULL;
+	CheckerSet all = ((CheckerSet)1 << (AllCheckers::count - 1) << 1) - 1;
+	// With every checker there is no need to test the mask at all
+	if (mask == all) return &AllCheckers::scan<false>;
+	return &AllCheckers::scan<true>;
+}
+
+#endif // _RIPPER6_FUSED_HPP_
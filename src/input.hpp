@@ -0,0 +1,494 @@
+/**
+ * @file   input.hpp
+ * @brief  Access to the file being searched.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_INPUT_HPP_
+#define _RIPPER6_INPUT_HPP_
+
+#include <algorithm>
+#include <vector>
+#include "platform.hpp"
+#include "check.hpp"
+#include "ratelimit.hpp"
+
+/// Default amount of the file to keep in memory behind the scan, in bytes.
+#define INPUT_DEFAULT_BEHIND (64 * 1024 * 1024)
+
+/// Smallest amount of the file to give back to the kernel at once.
+#define INPUT_RELEASE_MIN (1024 * 1024)
+
+/// Smallest amount of the file to count against the read limit at once, so
+/// the scan is not stopped for very short sleeps.
+#define INPUT_THROTTLE_STEP (256 * 1024)
+
+/// A file mapped into memory so the checkers can read it directly.
+/**
+ * The file may also be split into several parts, e.g. disk.001, disk.002,
+ * which are mapped one after the other so the checkers see them as a single
+ * file, and find matches that cross from one part into the next.
+ *
+ * The mapping is always followed by CHECK_PADDING bytes of zeroes, which the
+ * checkers are allowed to read.  These come from anonymous memory mapped
+ * straight after the file, which costs nothing until it is read, and then
+ * only a shared page of zeroes.
+ */
+class InputFile
+{
+	public:
+		InputFile()
+			:	content(NULL),
+				lenFile(0),
+				lenMap(0),
+				modified(0),
+				windowed(false),
+				ahead(0),
+				behind(0),
+				readTo(0),
+				releasedTo(0),
+				limits(NULL),
+				throttledTo(0)
+#ifdef _WIN32
+				,
+				hFile(INVALID_HANDLE_VALUE),
+				hMap(NULL),
+				tail(NULL)
+#endif
+		{
+		}
+
+		~InputFile()
+		{
+			this->close();
+		}
+
+		/// Open and map the file.
+		/**
+		 * @param filename
+		 *   File to open.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return 0 on success, or the program exit code to use on failure.
+		 */
+		int open(const char *filename, std::string *error)
+		{
+			return this->open(std::vector<std::string>(1, filename), error);
+		}
+
+		/// Open the parts of a split file and map them as one.
+		/**
+		 * Each part is mapped directly after the one before, so no data is
+		 * copied as long as every part but the last is a whole number of
+		 * pages long, as the parts from most splitting tools are.  A part
+		 * that starts partway through a page cannot be mapped there, so it is
+		 * read into memory instead.
+		 *
+		 * @param filenames
+		 *   Parts to open, in order.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return 0 on success, or the program exit code to use on failure.
+		 */
+		int open(const std::vector<std::string>& filenames, std::string *error)
+		{
+#ifdef _WIN32
+			if (filenames.size() != 1) {
+				*error = "Searching a file split into parts is not supported on "
+					"Windows";
+				return 2;
+			}
+			const char *filename = filenames[0].c_str();
+			this->hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
+			if (this->hFile == INVALID_HANDLE_VALUE) {
+				*error = std::string("Unable to open ") + filename + ": " + GetLastErrorAsString();
+				return 2;
+			}
+			this->lenFile = GetFileSize(this->hFile, NULL);
+			FILETIME ft;
+			if (GetFileTime(this->hFile, NULL, NULL, &ft)) {
+				this->modified = ((long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+			}
+			if (this->lenFile == 0) return 0;
+
+			// A view can only be followed by other memory on the next allocation
+			// boundary, so only whole allocation units of the file are mapped.
+			// The rest is read into memory placed after them, along with the
+			// padding.
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			this->lenMap = this->lenFile & ~((unsigned long)si.dwAllocationGranularity - 1);
+			unsigned long lenTail = this->lenFile - this->lenMap;
+			if (this->lenMap) {
+				this->hMap = CreateFileMapping(this->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (this->hMap == NULL) {
+					*error = "Unable to memory map input file: " + GetLastErrorAsString();
+					return 3;
+				}
+			}
+			for (unsigned int attempt = 0; (attempt < 8) && !this->content; attempt++) {
+				// Find a free area big enough, then release it to map into.  This
+				// fails if another thread takes it in between, so try again then.
+				uint8_t *at = (uint8_t *)VirtualAlloc(NULL,
+					this->lenMap + lenTail + CHECK_PADDING, MEM_RESERVE, PAGE_NOACCESS);
+				if (at == NULL) {
+					*error = "Unable to reserve memory for the input: "
+						+ GetLastErrorAsString();
+					return 3;
+				}
+				VirtualFree(at, 0, MEM_RELEASE);
+				if (this->lenMap
+					&& !MapViewOfFileEx(this->hMap, FILE_MAP_READ, 0, 0, this->lenMap, at)
+				) {
+					continue;
+				}
+				this->tail = (uint8_t *)VirtualAlloc(at + this->lenMap,
+					lenTail + CHECK_PADDING, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+				if (this->tail == NULL) {
+					if (this->lenMap) UnmapViewOfFile(at);
+					continue;
+				}
+				this->content = at;
+			}
+			if (this->content == NULL) {
+				*error = "Unable to memory map input file view: " + GetLastErrorAsString();
+				return 4;
+			}
+			LARGE_INTEGER off;
+			off.QuadPart = this->lenMap;
+			DWORD got = 0;
+			if (lenTail && (!SetFilePointerEx(this->hFile, off, NULL, FILE_BEGIN)
+				|| !ReadFile(this->hFile, this->tail, lenTail, &got, NULL)
+				|| (got != lenTail))
+			) {
+				*error = "Unable to read input file: " + GetLastErrorAsString();
+				return 4;
+			}
+			DWORD oldProtect;
+			VirtualProtect(this->tail, lenTail + CHECK_PADDING, PAGE_READONLY,
+				&oldProtect);
+#else
+			for (std::vector<std::string>::const_iterator
+				i = filenames.begin(); i != filenames.end(); i++
+			) {
+				Part p;
+				p.fd = ::open(i->c_str(), O_RDONLY);
+				if (p.fd < 0) {
+					*error = "Unable to open " + *i + ": " + strerror(errno);
+					return 2;
+				}
+				p.start = this->lenFile;
+				p.copied = false;
+				this->parts.push_back(p);
+
+				struct stat s;
+				if (fstat(p.fd, &s) < 0) {
+					*error = "Unable to stat " + *i + ": " + strerror(errno);
+					return 2;
+				}
+				this->parts.back().len = s.st_size;
+				this->lenFile += s.st_size;
+				// A change to any part makes the whole file different
+				this->modified = std::max<long long>(this->modified, s.st_mtime);
+			}
+			if (this->lenFile == 0) return 0;
+
+			// Reserve enough zeroes for every part and the padding, then map
+			// each part over its own piece of it.  The rest of the last page
+			// of the file is zeroed by the kernel.
+			static const unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+			this->lenMap = ((this->lenFile + pageSize - 1) & ~(pageSize - 1))
+				+ CHECK_PADDING;
+			this->content = (uint8_t *)mmap(0, this->lenMap, PROT_READ,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (this->content == MAP_FAILED) {
+				this->content = NULL;
+				*error = std::string("Unable to reserve memory for the input: ")
+					+ strerror(errno);
+				return 3;
+			}
+			for (unsigned int i = 0; i < this->parts.size(); i++) {
+				if (!this->mapPart(&this->parts[i])) {
+					*error = "Unable to map " + filenames[i] + ": " + strerror(errno);
+					return 4;
+				}
+			}
+#endif
+			return 0;
+		}
+
+		/// Unmap and close the file.
+		void close()
+		{
+#ifdef _WIN32
+			if (this->content && this->lenMap) UnmapViewOfFile(this->content);
+			if (this->tail) VirtualFree(this->tail, 0, MEM_RELEASE);
+			if (this->hMap) CloseHandle(this->hMap);
+			if (this->hFile != INVALID_HANDLE_VALUE) CloseHandle(this->hFile);
+			this->hMap = NULL;
+			this->hFile = INVALID_HANDLE_VALUE;
+			this->tail = NULL;
+#else
+			// This unmaps every part, and the padding, at once
+			if (this->content) munmap(this->content, this->lenMap);
+			for (std::vector<Part>::iterator
+				i = this->parts.begin(); i != this->parts.end(); i++
+			) {
+				::close(i->fd);
+			}
+			this->parts.clear();
+#endif
+			this->content = NULL;
+		}
+
+		/// Ask for the mapping to use huge pages, to save on TLB misses.
+		/**
+		 * MAP_HUGETLB only works for anonymous memory and hugetlbfs, so for a
+		 * normal file this relies on transparent huge pages, which Linux only
+		 * supports for file mappings in some configurations.
+		 *
+		 * @return false if huge pages are not available.
+		 */
+		bool adviseHugePages()
+		{
+#ifdef MADV_HUGEPAGE
+			if (!this->content) return false;
+			return madvise(this->content, this->lenFile, MADV_HUGEPAGE) == 0;
+#else
+			return false;
+#endif
+		}
+
+		/// Keep only part of the file in memory as the scan moves through it.
+		/**
+		 * Normally the whole file can end up in the page cache, pushing out
+		 * everything else on the machine even though the file is only read
+		 * once.  Once a window is set, advance() asks the kernel to read ahead
+		 * of the scan and to drop what is well behind it.
+		 *
+		 * Everything is still mapped, so the data behind the window can still
+		 * be read, it just has to come from disk again.
+		 *
+		 * @param ahead
+		 *   Bytes to read in ahead of the scan, or 0 to leave it to the kernel.
+		 *
+		 * @param behind
+		 *   Bytes to keep behind the scan, for checkers that look back before
+		 *   the candidate offset and for matches still waiting to be saved.
+		 */
+		void setWindow(unsigned long long ahead, unsigned long long behind)
+		{
+			this->windowed = true;
+			this->ahead = ahead;
+			this->behind = behind;
+#ifdef MADV_SEQUENTIAL
+			if (this->content) {
+				madvise(this->content, this->lenFile, MADV_SEQUENTIAL);
+			}
+#endif
+		}
+
+		/// Hold the scan to a read limit.
+		/**
+		 * From now on advance() counts the data the scan has moved past
+		 * against limits->read, waiting when it is going too fast.  As the
+		 * file is read by touching the memory it is mapped to, this limits the
+		 * scan rather than the disk, which is the same thing when the file is
+		 * not already cached.
+		 *
+		 * @param limits
+		 *   Limits to follow, which must stay valid while the scan runs.
+		 *
+		 * @param from
+		 *   Offset the scan starts from.
+		 */
+		void setLimits(IoLimits *limits, unsigned long long from)
+		{
+			this->limits = limits;
+			this->throttledTo = from;
+		}
+
+		/// Tell the input how far the scan has got.
+		/**
+		 * This is cheap enough to call often, as it only does anything once
+		 * the scan has moved on by a quarter of the window, or by
+		 * INPUT_THROTTLE_STEP when there is a read limit.
+		 *
+		 * @param offset
+		 *   Lowest offset the scan will look at from now on, other than going
+		 *   back to look at the data kept behind it.
+		 */
+		void advance(unsigned long long offset)
+		{
+			if (this->limits) {
+				this->limits->poll();
+				if (offset >= this->throttledTo + INPUT_THROTTLE_STEP) {
+					this->limits->read.take(offset - this->throttledTo);
+					this->throttledTo = offset;
+				}
+			}
+			if (!this->windowed || !this->content) return;
+			if (this->ahead && (offset + this->ahead / 2 > this->readTo)) {
+				unsigned long long from = std::max(offset, this->readTo);
+				unsigned long long to = std::min<unsigned long long>(
+					offset + this->ahead, this->lenFile);
+				if (to > from) this->hint(from, to - from, true);
+				this->readTo = to;
+			}
+			unsigned long long step = std::max<unsigned long long>(
+				this->behind / 4, INPUT_RELEASE_MIN);
+			if (offset > this->releasedTo + this->behind + step) {
+				unsigned long long to = offset - this->behind;
+				this->hint(this->releasedTo, to - this->releasedTo, false);
+				this->releasedTo = to;
+			}
+		}
+
+		/// Start of the file's content.
+		const uint8_t *data() const
+		{
+			return this->content;
+		}
+
+		/// Length of the file, in bytes.
+		unsigned long size() const
+		{
+			return this->lenFile;
+		}
+
+		/// Last modification time, in an OS-specific unit.
+		/**
+		 * This is only useful for comparing against another value from the same
+		 * machine, to see whether the file has changed.
+		 */
+		long long mtime() const
+		{
+			return this->modified;
+		}
+
+	private:
+		uint8_t *content;
+		unsigned long lenFile;
+		unsigned long lenMap;           ///< Bytes mapped, or on Windows in the view
+		long long modified;
+		bool windowed;                  ///< setWindow() has been called
+		unsigned long long ahead;       ///< Bytes to read ahead of the scan
+		unsigned long long behind;      ///< Bytes to keep behind the scan
+		unsigned long long readTo;      ///< End of the last read-ahead request
+		unsigned long long releasedTo;  ///< End of the memory given back
+		IoLimits *limits;               ///< Limits to follow, or NULL
+		unsigned long long throttledTo; ///< End of the data counted so far
+
+		/// Tell the kernel part of the file will be needed soon, or not again.
+		void hint(unsigned long long offset, unsigned long long len, bool need)
+		{
+#ifndef _WIN32
+			static const unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+			// madvise() needs a page-aligned start.  Dropped pages must be
+			// entirely within the range, so round its end down too.
+			unsigned long long end = offset + len;
+			offset &= ~(pageSize - 1);
+			if (!need) end &= ~(pageSize - 1);
+			if (end <= offset) return;
+			len = end - offset;
+			if (need) {
+#ifdef MADV_WILLNEED
+				madvise(this->content + offset, len, MADV_WILLNEED);
+#endif
+				return;
+			}
+			for (std::vector<Part>::const_iterator
+				i = this->parts.begin(); i != this->parts.end(); i++
+			) {
+				// Memory holding a copied part is the only copy of it
+				if (i->copied) continue;
+				unsigned long long from = std::max(offset, i->start);
+				unsigned long long to = std::min(end, i->start + i->len);
+				if (to <= from) continue;
+#ifdef MADV_DONTNEED
+				// Unmap the pages first, as the page cache keeps mapped pages.  A
+				// page shared with a copied part is left alone.
+				unsigned long long pageEnd = to & ~(pageSize - 1);
+				if (pageEnd > from) {
+					madvise(this->content + from, pageEnd - from, MADV_DONTNEED);
+				}
+#endif
+#ifdef POSIX_FADV_DONTNEED
+				posix_fadvise(i->fd, from - i->start, to - from, POSIX_FADV_DONTNEED);
+#endif
+			}
+#endif
+		}
+#ifdef _WIN32
+		HANDLE hFile;
+		HANDLE hMap;
+		uint8_t *tail;                  ///< Copy of the end of the file
+#else
+		/// One of the files making up the input.
+		struct Part {
+			int fd;
+			unsigned long long start;  ///< Offset of the part within the input
+			unsigned long long len;
+			bool copied;               ///< Read into memory instead of mapped
+		};
+		std::vector<Part> parts;
+
+		/// Map one part of a split file over its piece of the reserved memory.
+		/**
+		 * @return false on failure, with errno set.
+		 */
+		bool mapPart(Part *p)
+		{
+			static const unsigned long long pageSize = sysconf(_SC_PAGESIZE);
+			if (p->len == 0) return true;
+			uint8_t *at = this->content + p->start;
+			if ((p->start & (pageSize - 1)) == 0) {
+				return mmap(at, p->len, PROT_READ, MAP_SHARED | MAP_FIXED, p->fd, 0)
+					!= MAP_FAILED;
+			}
+
+			// The part starts partway through a page, so give it memory of its
+			// own, keeping the end of the previous part in its first page
+			p->copied = true;
+			uint8_t *page = this->content + (p->start & ~(pageSize - 1));
+			std::vector<uint8_t> before(page, at);
+			unsigned long long len = at - page + p->len;
+			if (mmap(page, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED
+			) {
+				return false;
+			}
+			std::copy(before.begin(), before.end(), page);
+			for (unsigned long long done = 0; done < p->len; ) {
+				ssize_t got = pread(p->fd, at + done, p->len - done, done);
+				if (got < 0) return false;
+				if (got == 0) {
+					errno = EIO;
+					return false;
+				}
+				done += got;
+			}
+			return mprotect(page, len, PROT_READ) == 0;
+		}
+#endif
+};
+
+#endif // _RIPPER6_INPUT_HPP_
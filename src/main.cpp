@@ -18,301 +18,1556 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifdef _WIN32
-#define NOMINMAX
-#include <Windows.h>
-#include <stdint.h>
-#include <algorithm> // std::max
-#else
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <string.h>
-#include <unistd.h>
-#endif
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
-#include "byteorder.hpp"
-
-struct check {
-	enum MatchCategory {
-		Unknown = 0,
-		Audio,
-		Image,
-		Music,
-		Video,
-		Other
-	};
-};
-struct Match {
-	unsigned long len;
-	check::MatchCategory cat;
-	std::string ext;
-	std::string desc;
+#include "platform.hpp"
+#include "checkers.hpp"
+#include "checkpoint.hpp"
+#include "coalesce.hpp"
+#include "dedup.hpp"
+#include "input.hpp"
+#include "manifest.hpp"
+#include "outdir.hpp"
+#include "parallel.hpp"
+#include "perf.hpp"
+#include "process.hpp"
+#include "profile.hpp"
+#include "ratelimit.hpp"
+#include "scanner.hpp"
+#include "signature.hpp"
+#include "stitch.hpp"
+#include "survey.hpp"
+#include "trace.hpp"
+#include "watch.hpp"
+#include "writer.hpp"
+
+/// Default part of a file searched again when more is written to it, in MB.
+#define WATCH_DEFAULT_OVERLAP 16
+
+/// Set by SIGINT or SIGTERM to stop the scan at the next checkpoint.
+static volatile sig_atomic_t stopRequested = 0;
+
+static void request_stop(int)
+{
+	stopRequested = 1;
+}
+
+#ifdef SIGHUP
+/// Set by SIGHUP to read --limits again.
+static void request_reload(int)
+{
+	IoLimits::reloadRequested() = 1;
+}
+#endif
+
+/// Where matches go once they have been found.
+struct Output {
+	OutputWriter *writer;
+	OutputDir *dir;
+	ManifestWriter *manifest;       ///< NULL if no manifest is being written
+	bool byOffset;                  ///< Name files by offset, for shards
+	unsigned long long matchCount;  ///< Number of matches so far
+	std::string source;             ///< Input to name in messages, if any
+
+	/// Report a match and queue it to be saved.
+	/**
+	 * @param data
+	 *   Content of the match, which must stay valid until the writer has
+	 *   saved it.
+	 *
+	 * @param m
+	 *   The match.  The filename is filled in.
+	 *
+	 * @return false if this or an earlier match could not be saved.
+	 */
+	bool save(const uint8_t *data, ManifestEntry& m)
+	{
+		std::string name = (this->byOffset
+			? shard_filename(m.offset, m.ext())
+			: match_filename(this->matchCount, m.ext())) + this->writer->suffix();
+		OutputDir::Target target;
+		std::string error;
+		if (!this->dir->locate(m.cat(), name, &target, &error)) {
+			this->writer->fail(5, error);
+			return false;
+		}
+		m.filename = target.path;
+		// Written all at once, so lines from different threads do not mix
+		std::ostringstream msg;
+		msg << "\033[2K\rFound match " << std::hex << m.len
+			<< "@" << m.offset << std::dec;
+		if (!this->source.empty()) msg << " in " << this->source;
+		msg << ": writing " << m.filename << " [";
+		switch (m.cat()) {
+			case check::Unknown: msg << "?"; break;
+			case check::Audio: msg << "audio"; break;
+			case check::Image: msg << "image"; break;
+			case check::Music: msg << "music"; break;
+			case check::Video: msg << "video"; break;
+			case check::Other: msg << "other"; break;
+		}
+		msg << "; " << m.desc() << "]\n";
+		std::cout << msg.str() << std::flush;
+
+		if (!this->writer->write(target.name, data, m.len,
+			target.dir)
+		) {
+			return false;
+		}
+		if (this->manifest) this->manifest->add(m);
+		this->matchCount++;
+		return true;
+	}
 };
 
-/// Check for this format
+/// Settings that change what a search saves, which a checkpoint is only
+/// valid for.
 /**
- * @param content
- *   The block to look at.  Do not scan the block, simply look at a
- *   fixed offset.  This function will be called repeatedly, once at each
- *   byte offset.  If a match is found, then you can scan around to find
- *   the start of the file, looking back at most getMinHead() bytes before
- *   this pointer, and forward at most len bytes.
- *
- * @param len
- *   Maximum distance to search past *content.  Will always be >=
- *   getMinTail().
- *
- * @param mc
- *   Details about any match, if the function returns true.  Ignored if the
- *   return value is false.
- *
- * @return false if content does not point to an instance of this file
- *   format, true if it does and mc has been filled in with details about
- *   the match.
+ * @return One line per setting, for Checkpoint::config.
  */
-typedef bool (*CheckFunction)(const uint8_t *content, unsigned long len, Match *mc);
-
-inline uint16_t as_u16le(const uint8_t *content)
+static std::string checkpoint_config(const std::vector<Checker>& active,
+	OutputDir::Layout layout, Compression compression, int compressLevel)
 {
-	return le16toh(*((uint16_t *)content));
+	std::ostringstream ss;
+	ss << dedup_config(active) << "layout ";
+	switch (layout) {
+		case OutputDir::Flat: ss << "flat"; break;
+		case OutputDir::Category: ss << "category"; break;
+		case OutputDir::Hash: ss << "hash"; break;
+	}
+	ss << "\ncompress " << compression_name(compression);
+	if (compression != CompressNone) ss << ' ' << compressLevel;
+	ss << "\n";
+	return ss.str();
 }
 
-inline uint32_t as_u32le(const uint8_t *content)
+/// Wait for the matches so far to be saved, then record the position.
+/**
+ * @param ret
+ *   Set to the exit code if the checkpoint could not be written.  Left alone
+ *   if a match could not be saved, as OutputWriter::finish() reports that.
+ *
+ * @return false if the scan should stop because of an error.
+ */
+static bool save_checkpoint(const char *filename, Checkpoint *state,
+	unsigned long long offset, Output& output, int *ret, std::string *error)
 {
-	return le32toh(*((uint32_t *)content));
+	TraceSpan span("checkpoint");
+	// Everything before this offset must be on disk before the checkpoint
+	// says so.
+	if (!output.writer->flush()) return false;
+	state->offset = offset;
+	state->matchCount = output.matchCount;
+	if (output.manifest && !(state->manifest = output.manifest->position())) {
+		*error = "Unable to write manifest";
+		*ret = 8;
+		return false;
+	}
+	if (!state->save(filename, error)) {
+		*ret = 8;
+		return false;
+	}
+	return true;
 }
 
-inline uint16_t as_u16be(const uint8_t *content)
+/// Searches the files in a directory as they are written.
+/**
+ * Each file gets its own output directory, named after it, so the numbering
+ * of one file's matches carries on when more is written to it.  Only the
+ * new part of the file is searched then, along with the overlap before it,
+ * which is where a match that was cut off by the old end of the file would
+ * start.  Offsets inside a match already saved are not searched again, so
+ * nothing is saved twice.
+ */
+class DirScanner
 {
-	return be16toh(*((uint16_t *)content));
+	public:
+		/// Prepare to search files.
+		/**
+		 * @param dir
+		 *   Directory the files are in.
+		 *
+		 * @param scanner
+		 *   Scanner to copy for each worker thread.
+		 *
+		 * @param outputRoot
+		 *   Directory to create each file's output directory in, or "" for
+		 *   the current directory.
+		 *
+		 * @param layout
+		 *   Layout of each file's output directory.
+		 *
+		 * @param overlap
+		 *   Bytes before the old end of a file to search again once more has
+		 *   been written to it.
+		 */
+		DirScanner(const std::string& dir, const Scanner& scanner,
+			const std::string& outputRoot, OutputDir::Layout layout,
+			unsigned long long overlap)
+			:	dir(dir),
+				scanner(scanner),
+				layout(layout),
+				overlap(overlap),
+				stopping(false)
+		{
+			if (!this->dir.empty() && (this->dir[this->dir.length() - 1] != '/')) {
+				this->dir += '/';
+			}
+			if (!outputRoot.empty()) this->outputPrefix = outputRoot + '/';
+		}
+
+		/// Watch the directory until SIGINT or SIGTERM.
+		/**
+		 * @param numWorkers
+		 *   Number of files to search at once.
+		 *
+		 * @return The program exit code.
+		 */
+		int run(unsigned int numWorkers)
+		{
+			DirWatcher watcher;
+			std::string error;
+			if (!watcher.open(this->dir, &error)) {
+				std::cerr << error << std::endl;
+				return 2;
+			}
+			if (!this->outputPrefix.empty()) {
+				// Create the output directory now, to report any problem early
+				OutputDir root;
+				int ret = root.open(this->outputPrefix, OutputDir::Flat, &error);
+				if (ret) {
+					std::cerr << error << std::endl;
+					return ret;
+				}
+			}
+			std::cout << "Watching " << this->dir << " for new files, press "
+				"Ctrl+C to stop." << std::endl;
+
+			std::vector<std::thread> workers;
+			for (unsigned int i = 0; i < (numWorkers ? numWorkers : 1); i++) {
+				workers.push_back(std::thread(&DirScanner::work, this));
+			}
+			int ret = 0;
+			while (!stopRequested) {
+				std::vector<std::string> names;
+				if (!watcher.wait(&names, 500)) {
+					std::cerr << "No longer able to watch " << this->dir << std::endl;
+					ret = 2;
+					break;
+				}
+				for (std::vector<std::string>::const_iterator
+					n = names.begin(); n != names.end(); n++
+				) {
+					this->queueFile(*n);
+				}
+			}
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->stopping = true;
+				this->wake.notify_all();
+			}
+			for (std::vector<std::thread>::iterator
+				t = workers.begin(); t != workers.end(); t++
+			) {
+				t->join();
+			}
+			return ret;
+		}
+
+	private:
+		/// What has been done with one file.
+		struct File {
+			OutputDir out;                  ///< Where its matches are saved
+			bool outOpen;                   ///< out has been opened
+			unsigned long long size;        ///< Length searched so far
+			unsigned long long resumeAt;    ///< End of the last match
+			unsigned long long matchCount;  ///< Number of matches saved
+			bool queued;                    ///< Waiting for a worker
+			bool busy;                      ///< Being searched now
+			bool again;                     ///< Written to while busy
+
+			File()
+				:	outOpen(false),
+					size(0),
+					resumeAt(0),
+					matchCount(0),
+					queued(false),
+					busy(false),
+					again(false)
+			{
+			}
+		};
+
+		std::string dir;           ///< Watched directory, ending with '/'
+		Scanner scanner;           ///< Copied by each worker
+		std::string outputPrefix;  ///< Where output directories go
+		OutputDir::Layout layout;
+		unsigned long long overlap;
+		std::mutex mutex;
+		std::condition_variable wake;   ///< Signalled when a file is queued
+		std::deque<std::string> queue;  ///< Files waiting to be searched
+		std::map<std::string, std::unique_ptr<File> > files;
+		bool stopping;
+
+		/// Add a file to the queue, unless it is already waiting.
+		void queueFile(const std::string& name)
+		{
+#ifndef _WIN32
+			struct stat s;
+			if ((stat((this->dir + name).c_str(), &s) < 0) || !S_ISREG(s.st_mode)) {
+				return;
+			}
+#endif
+			std::unique_lock<std::mutex> lock(this->mutex);
+			std::unique_ptr<File>& f = this->files[name];
+			if (!f) f.reset(new File());
+			if (f->busy) {
+				// Search it again once the current search finishes
+				f->again = true;
+			} else if (!f->queued) {
+				f->queued = true;
+				this->queue.push_back(name);
+				this->wake.notify_one();
+			}
+		}
+
+		/// Worker thread.
+		void work()
+		{
+			Scanner local(this->scanner);
+			std::unique_lock<std::mutex> lock(this->mutex);
+			for (;;) {
+				while (this->queue.empty() && !this->stopping) this->wake.wait(lock);
+				if (this->stopping) break;
+				std::string name = this->queue.front();
+				this->queue.pop_front();
+				File& f = *this->files[name];
+				f.queued = false;
+				f.busy = true;
+
+				lock.unlock();
+				this->search(name, f, local);
+				lock.lock();
+
+				f.busy = false;
+				if (f.again) {
+					f.again = false;
+					f.queued = true;
+					this->queue.push_back(name);
+				}
+			}
+		}
+
+		/// Search the part of a file not yet searched.
+		/**
+		 * The File is only used by the thread calling this, while it is busy.
+		 */
+		void search(const std::string& name, File& f, Scanner& scanner)
+		{
+			InputFile input;
+			std::string error;
+			if (input.open((this->dir + name).c_str(), &error)) {
+				std::cerr << error << std::endl;
+				return;
+			}
+			unsigned long long size = input.size();
+			if (size == f.size) return;
+			if (size < f.size) {
+				// Replaced with a shorter file, so start again, but keep the
+				// numbering going so the earlier files are not overwritten
+				f.size = 0;
+				f.resumeAt = 0;
+			}
+			if (!f.outOpen) {
+				int ret = f.out.open(this->outputPrefix + name + ".ripped",
+					this->layout, &error);
+				if (ret) {
+					std::cerr << error << std::endl;
+					return;
+				}
+				f.outOpen = true;
+			}
+
+			unsigned long long start = 0;
+			if (f.size) {
+				start = f.size > this->overlap ? f.size - this->overlap : 0;
+				if (start < f.resumeAt) start = f.resumeAt;
+			}
+
+			// Save each match before going on, as the worker pool is already
+			// keeping the disk busy
+			OutputWriter writer(0, 1);
+			Output output;
+			output.writer = &writer;
+			output.dir = &f.out;
+			output.manifest = NULL;
+			output.byOffset = false;
+			output.matchCount = f.matchCount;
+			output.source = name;
+
+			const uint8_t *content = input.data();
+			Match match;
+			unsigned long long pos = start;
+			while (pos < size) {
+				if (scanner.next(content, size, &pos, size, &match) < 0) break;
+				ManifestEntry m(pos, match);
+				if (!output.save(content + pos, m)) break;
+				pos += match.len;
+				f.resumeAt = pos;
+			}
+			if (writer.finish(&error)) {
+				std::cerr << "\033[2K\r" << error << std::endl;
+			}
+			std::ostringstream msg;
+			msg << "\033[2K\rSearched " << size - start << " bytes of " << name
+				<< ", " << output.matchCount - f.matchCount << " new matches.\n";
+			std::cout << msg.str() << std::flush;
+			f.size = size;
+			f.matchCount = output.matchCount;
+		}
+};
+
+/// Search the memory of a running process.
+/**
+ * Each readable region is copied out in batches of PROCESS_BATCH_SIZE, plus
+ * PROCESS_OVERLAP more so that a match starting near the end of a batch can
+ * still be read in full.  The next batch carries on from the end of the
+ * batch or the match, whichever is later.  Matches are named by address
+ * rather than by offset.
+ *
+ * @return The program exit code.
+ */
+static int scan_process(unsigned long pid, Scanner& scanner, Output& output)
+{
+	ProcessMemory mem;
+	std::string error;
+	if (!mem.open(pid, &error)) {
+		std::cerr << error << std::endl;
+		return 2;
+	}
+	std::vector<uint8_t> buf;
+	unsigned long long total = 0, unreadable = 0;
+	bool failed = false;
+	Match match;
+	const std::vector<MemoryRegion>& regions = mem.regions();
+	for (std::vector<MemoryRegion>::const_iterator
+		r = regions.begin(); !failed && (r != regions.end()); r++
+	) {
+		std::ostringstream source;
+		source << "pid " << pid;
+		if (!r->name.empty()) source << " " << r->name;
+		output.source = source.str();
+
+		for (unsigned long long addr = r->start; addr < r->end; ) {
+			std::cout << "\rSearching... " << std::hex << addr << std::dec
+				<< std::flush;
+			unsigned long want = std::min<unsigned long long>(r->end - addr,
+				PROCESS_BATCH_SIZE + PROCESS_OVERLAP);
+			if (buf.size() < want + CHECK_PADDING) buf.resize(want + CHECK_PADDING);
+			unsigned long got = mem.read(addr, &buf[0], want);
+			if (got == 0) {
+				unreadable += r->end - addr;
+				break;
+			}
+			// The checkers may read the padding, which must be zero
+			std::fill(buf.begin() + got, buf.begin() + got + CHECK_PADDING, 0);
+			// Only search the overlap if there is nothing after it
+			unsigned long long end = std::min<unsigned long long>(got,
+				PROCESS_BATCH_SIZE);
+			if (got < want || addr + got == r->end) end = got;
+
+			unsigned long long pos = 0;
+			while (pos < end) {
+				if (scanner.next(&buf[0], got, &pos, end, &match) < 0) break;
+				ManifestEntry m(addr + pos, match);
+				if (!output.save(&buf[pos], m)) {
+					failed = true;
+					break;
+				}
+				pos += match.len;
+			}
+			// The buffer is about to be reused
+			if (!output.writer->flush()) failed = true;
+			if (failed) break;
+
+			total += end;
+			addr += std::max(pos, end);
+			if (got < want) {
+				unreadable += r->end - addr;
+				break;
+			}
+		}
+	}
+	int ret = output.writer->finish(&error);
+	if (ret) {
+		std::cerr << "\033[2K\r" << error << std::endl;
+		return ret;
+	}
+	std::cout << "\033[2K\rComplete.  " << total << " bytes of memory in "
+		<< regions.size() << " regions";
+	if (unreadable) std::cout << ", " << unreadable << " bytes unreadable";
+	std::cout << "." << std::endl;
+	return 0;
 }
 
-inline uint32_t as_u32be(const uint8_t *content)
+/// Search the matches in one file, or one file in a batch.
+/**
+ * @param content
+ *   Start of the file, followed by CHECK_PADDING bytes of zeroes.
+ *
+ * @return false if a match could not be saved.
+ */
+static bool scan_one(const uint8_t *content, unsigned long long size,
+	Scanner& scanner, Output& output)
 {
-	return be32toh(*((uint32_t *)content));
+	Match match;
+	unsigned long long pos = 0;
+	while (pos < size) {
+		if (scanner.next(content, size, &pos, size, &match) < 0) break;
+		ManifestEntry m(pos, match);
+		if (!output.save(content + pos, m)) return false;
+		pos += match.len;
+	}
+	return true;
 }
 
-/// Require the string, which can contain embedded nulls, be at the given offset
+/// Search each file on its own, rather than as parts of one image.
 /**
- * @param c
- *   Pointer to the content to compare, e.g. content + 5.
+ * Files up to COALESCE_SMALL_FILE are read into a FileBatch and searched
+ * from there, and each batch is searched before the next is read.  Larger
+ * files are mapped one at a time.  Matches are numbered across all the
+ * files, with their offset in the file they came from.
+ *
+ * @param batchSize
+ *   Bytes of small files to search at once.
  *
- * @param v
- *   String that must exist, e.g. "\x00\x11\x22"
+ * @param limits
+ *   Read limit to follow, or NULL.
  *
- * @post Returns from the check function if there was no match.  Execution only
- *   continues beyond the macro if the string matched.
+ * @return The program exit code.
  */
-#define REQUIRE(c, v) { \
-	const uint8_t *t = c; \
-	const uint8_t *vp = (const uint8_t *)v; \
-	unsigned long l = sizeof(v) - 1; \
-	while (l--) { \
-		if (*t++ != *vp++) return false; \
-	} \
+static int scan_separate(const std::vector<std::string>& paths,
+	Scanner& scanner, Output& output, unsigned long long batchSize,
+	IoLimits *limits)
+{
+	std::vector<SourceFile> files;
+	std::string error;
+	if (!list_files(paths, &files, &error)) {
+		std::cerr << error << std::endl;
+		return 2;
+	}
+	FileBatch batch(batchSize);
+	if (!batch.valid()) {
+		std::cerr << "Unable to allocate memory for a batch of "
+			<< batchSize / 1048576 << " MB" << std::endl;
+		return 2;
+	}
+	unsigned long long total = 0, batches = 0, skipped = 0;
+	bool failed = false;
+	for (unsigned long i = 0; !failed && (i <= files.size()); i++) {
+		const SourceFile *f = (i < files.size()) ? &files[i] : NULL;
+		bool small = f && (f->size <= COALESCE_SMALL_FILE);
+		// Search the batch when it is full, or once there are no more files
+		if (!batch.files().empty() && (!small || !batch.fits(f->size))) {
+			std::cout << "\rSearching... " << i << " of " << files.size()
+				<< " files" << std::flush;
+			if (limits) {
+				limits->poll();
+				limits->read.take(batch.bytes());
+			}
+			for (std::vector<FileBatch::Entry>::const_iterator
+				e = batch.files().begin(); e != batch.files().end(); e++
+			) {
+				output.source = e->path;
+				if (!scan_one(batch.data(*e), e->len, scanner, output)) {
+					failed = true;
+					break;
+				}
+			}
+			// The buffer is about to be reused
+			if (!output.writer->flush()) failed = true;
+			total += batch.bytes();
+			batches++;
+			batch.clear();
+		}
+		if (!f || failed || (f->size == 0)) continue;
+
+		if (small) {
+			if (!batch.add(*f, &error)) {
+				std::cerr << "\033[2K\r" << error << std::endl;
+				skipped++;
+			}
+			continue;
+		}
+		InputFile input;
+		if (input.open(f->path.c_str(), &error)) {
+			std::cerr << "\033[2K\r" << error << std::endl;
+			skipped++;
+			continue;
+		}
+		std::cout << "\rSearching... " << i << " of " << files.size()
+			<< " files" << std::flush;
+		if (limits) {
+			limits->poll();
+			limits->read.take(input.size());
+		}
+		output.source = f->path;
+		if (!scan_one(input.data(), input.size(), scanner, output)) failed = true;
+		// The file is about to be unmapped
+		if (!output.writer->flush()) failed = true;
+		total += input.size();
+	}
+	int ret = output.writer->finish(&error);
+	if (ret) {
+		std::cerr << "\033[2K\r" << error << std::endl;
+		return ret;
+	}
+	std::cout << "\033[2K\rComplete.  " << total << " bytes in "
+		<< files.size() - skipped << " files, " << batches
+		<< " batches of small files";
+	if (skipped) std::cout << ", " << skipped << " files unreadable";
+	std::cout << "." << std::endl;
+	return 0;
 }
 
-/// Require the byte at the given offset be within the given range.
+/// Search a sample of the blocks of a file, and estimate what is in it.
 /**
- * @param i
- *   Offset into content, e.g. 0.
+ * Nothing is saved, the matches are only counted.
  *
- * @param min
- *   Minimum allowed value, e.g. 0.
+ * @return The program exit code.
+ */
+static int run_survey(InputFile& input, Scanner& scanner, Survey& survey,
+	unsigned long long blockSize, unsigned long long end)
+{
+	const uint8_t *content = input.data();
+	unsigned long long size = input.size();
+	const std::vector<unsigned long long>& blocks = survey.blocks();
+	std::chrono::steady_clock::time_point startTime =
+		std::chrono::steady_clock::now();
+	unsigned long long searched = 0;
+	Match match;
+	std::vector<ManifestEntry> found;
+	for (unsigned long i = 0; i < blocks.size(); i++) {
+		if (i % 64 == 0) {
+			std::cout << "\rSurveying... block " << i << " of " << blocks.size()
+				<< std::flush;
+		}
+		unsigned long long pos = blocks[i];
+		unsigned long long blockEnd = std::min(pos + blockSize, end);
+		input.advance(pos);
+		searched += blockEnd - pos;
+		found.clear();
+		while (pos < blockEnd) {
+			if (scanner.next(content, size, &pos, blockEnd, &match) < 0) break;
+			found.push_back(ManifestEntry(pos, match));
+			pos += match.len;
+		}
+		survey.add(found);
+	}
+	double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - startTime).count();
+
+	std::cout << "\033[2K\rSearched " << blocks.size() << " of "
+		<< survey.totalBlocks() << " blocks (" << searched << " bytes) in "
+		<< std::fixed << std::setprecision(2) << seconds << "s.\n\n";
+	survey.report(std::cout);
+	if (blocks.size() < survey.totalBlocks()) {
+		std::cout << "A full search would take about " << std::setprecision(1)
+			<< seconds * survey.totalBlocks() / blocks.size() << "s." << std::endl;
+	}
+	return 0;
+}
+
+/// How much of a file --dedup did not have to search.
+struct DedupStats {
+	unsigned long long chunks;      ///< Chunks in the file
+	unsigned long long reused;      ///< Chunks whose matches came from the store
+	unsigned long long searched;    ///< Offsets given to the Scanner
+
+	DedupStats()
+		:	chunks(0),
+			reused(0),
+			searched(0)
+	{
+	}
+};
+
+/// Search a file, reusing the matches found in chunks searched before.
+/**
+ * The file is split up with find_chunks().  A chunk that is already in the
+ * store, and that the search reaches the start of, is not searched again.
+ * The matches recorded for it are saved from this file instead, as the
+ * content is the same.  Only the matches near the end of the chunk can be
+ * different, as they may run on into the next chunk, which need not be the
+ * same one as before:
+ *
+ *  - A recorded match that ran on past the end of the chunk is looked for
+ *    again, and the rest of the chunk is searched as usual from there.
+ *
+ *  - Otherwise the last window bytes of the chunk after the recorded matches
+ *    are searched, for matches that now run on into the next chunk.
+ *
+ * So a match is only missed if it is longer than the window, starts before
+ * it, and only exists because of what follows the chunk in this file.
  *
- * @param max
- *   Maximum allowed value, e.g. 255.
+ * Every other chunk is searched as usual and added to the store, so repeated
+ * chunks in the same file are only searched once too.
  *
- * @post Returns from the check function if the value is outside the given
- *   range.  Execution only continues beyond the macro if the value was in range.
+ * @return false if a match could not be saved.
  */
-#define REQUIRE_RANGE(i, min, max) \
-	if ((i < min) || (i > max)) return false;
-
-#include "check_cdfm.cpp"
-#include "check_cmf.cpp"
-#include "check_ibk.cpp"
-#include "check_iff.cpp"
-#include "check_midi.cpp"
-#include "check_riff.cpp"
-#include "check_s3m.cpp"
-#include "check_tbsa.cpp"
-#include "check_voc.cpp"
-
-#ifdef _WIN32
-std::string GetLastErrorAsString()
+static bool scan_dedup(InputFile& input, Scanner& scanner, Output& output,
+	ChunkStore& store, unsigned long long window, DedupStats *stats)
 {
-	DWORD error = GetLastError();
-	if (error) {
-		LPVOID lpMsgBuf;
-		DWORD bufLen = FormatMessage(
-			FORMAT_MESSAGE_ALLOCATE_BUFFER |
-			FORMAT_MESSAGE_FROM_SYSTEM |
-			FORMAT_MESSAGE_IGNORE_INSERTS,
-			NULL,
-			error,
-			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-			(LPTSTR)&lpMsgBuf,
-			0,
-			NULL
-		);
-		if (bufLen) {
-			LPCSTR lpMsgStr = (LPCSTR)lpMsgBuf;
-			std::string result(lpMsgStr, lpMsgStr + bufLen);
-			LocalFree(lpMsgBuf);
-			return result;
+	const uint8_t *content = input.data();
+	unsigned long long size = input.size();
+	std::vector<unsigned long long> ends;
+	{
+		TraceSpan span("find chunks", size);
+		find_chunks(content, size, &ends);
+	}
+	stats->chunks = ends.size();
+
+	unsigned long long pos = 0, start = 0;
+	Match match;
+	for (std::vector<unsigned long long>::const_iterator
+		e = ends.begin(); e != ends.end(); start = *e++
+	) {
+		unsigned long long end = *e;
+		input.advance(start);
+		std::cout << "\rSearching... " << start << " bytes ("
+			<< start * 100 / size << "%)" << std::flush;
+		// The chunk may be inside a match that started before it
+		if (pos >= end) continue;
+
+		unsigned long len = end - start;
+		TraceSpan span("chunk", len);
+		uint64_t hash = chunk_hash(content + start, len);
+		bool record = false;
+		if (pos == start) {
+			const std::vector<ManifestEntry> *known = store.find(hash, len);
+			record = !known;
+			if (known) {
+				stats->reused++;
+				bool recheck = false;
+				for (std::vector<ManifestEntry>::const_iterator
+					k = known->begin(); k != known->end(); k++
+				) {
+					ManifestEntry m = *k;
+					m.offset += start;
+					if (k->offset + k->len > len) {
+						recheck = true;
+						pos = m.offset;
+						break;
+					}
+					if (!output.save(content + m.offset, m)) return false;
+					pos = m.offset + m.len;
+				}
+				if (!recheck && (end - pos > window)) pos = end - window;
+			}
+		}
+
+		std::vector<ManifestEntry> found;
+		stats->searched += end - pos;
+		while (pos < end) {
+			if (scanner.next(content, size, &pos, end, &match) < 0) break;
+			ManifestEntry m(pos, match);
+			if (!output.save(content + pos, m)) return false;
+			if (record) {
+				m.offset -= start;
+				m.filename.clear();
+				found.push_back(m);
+			}
+			pos += match.len;
 		}
+		if (record) store.add(hash, len, found);
 	}
-	return std::string();
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [options] <file> [<file>...]\n"
+		"\n"
+		"Several files are searched as one, for an image split into parts, "
+			"unless\n"
+		"--separate is given.\n"
+		"\n"
+		"Options:\n"
+		"  --writers N   Threads saving matches to disk, 0 to save inline "
+			"(default 1)\n"
+		"  --queue N     Matches waiting to be saved before the scan pauses "
+			"(default " << WRITER_DEFAULT_QUEUE << ")\n"
+		"  --compress M  Compress each match on the writer threads, with M one "
+			"of:\n"
+		"                " << compression_names() << " (default none)\n"
+		"  --compress-level N  Compression level (default: the library's)\n"
+		"  --read-limit MB  Search at most this many MB of the file per second\n"
+		"  --write-limit MB  Save at most this many MB of matches per second\n"
+		"  --write-files N  Save at most N matches per second\n"
+		"  --limits FILE  Read the limits from FILE, and again on SIGHUP (see "
+			"README)\n"
+		"  --formats LIST  Only look for these formats, separated by commas "
+			"(default all):\n"
+		"               ";
+	for (unsigned int c = 0; c < numCheckers; c++) {
+		std::cerr << ' ' << checkers[c].name;
+	}
+	std::cerr << "\n"
+		"  --profile FILE  Choose formats, their order and limits from FILE\n"
+		"  --signature SPEC  Also look for a format described by SPEC, e.g.\n"
+		"                ext=dat,magic=DATA\\x1A,len=4:4le,bias=8 (see README)\n"
+		"  --signatures FILE  Add the signatures in FILE, one per line\n"
+		"  --adaptive    Reorder the checkers as the scan runs, to try the "
+			"cheapest first\n"
+		"  --load-stats FILE  Start adaptive ordering from a previous run's "
+			"statistics\n"
+		"  --save-stats FILE  Save checker statistics for --load-stats (implies "
+			"--adaptive)\n"
+		"  --checkpoint FILE  Save the scan position to FILE periodically\n"
+		"  --checkpoint-interval SECONDS  Time between checkpoints (default "
+			<< CHECKPOINT_DEFAULT_INTERVAL << ")\n"
+		"  --resume      Carry on from the position saved in --checkpoint\n"
+		"  --range START:LEN  Only look for matches starting in this part of "
+			"the file\n"
+		"  --shard I/N   Only look in the Ith of N equal parts (0 <= I < N)\n"
+		"  --manifest FILE  List the matches in FILE, for ripper6-merge\n"
+		"  --output DIR  Save the matches in DIR (default: current directory)\n"
+		"  --layout L    Arrange the matches in DIR: flat (default), category "
+			"or hash\n"
+		"  --threads N   Threads searching the file (default 1)\n"
+		"  --separate    Search each file on its own, and every file in "
+			"directories\n"
+		"  --batch MB    Read this much of the small files, and at most "
+			<< COALESCE_MAX_FILES << " of them,\n"
+		"                at once and search them together, with --separate "
+			"(default " << COALESCE_DEFAULT_BATCH << ")\n"
+		"  --survey FRACTION  Only search this part of the file (e.g. 0.01 or 1%) "
+			"and\n"
+		"                estimate what the whole file holds\n"
+		"  --survey-block KB  Size of each block searched by --survey (default "
+			<< SURVEY_DEFAULT_BLOCK << ")\n"
+		"  --survey-seed N  Choose the same blocks as an earlier --survey\n"
+		"  --dedup FILE  Skip content already searched in another file, using "
+			"the chunk\n"
+		"                store in FILE\n"
+		"  --dedup-window KB  End of a reused chunk searched again (default "
+			<< DEDUP_DEFAULT_WINDOW << ")\n"
+		"  --watch DIR   Search files as they are written to DIR, instead of "
+			"<file>\n"
+		"  --pid N       Search the memory of process N, instead of <file>\n"
+		"  --watch-overlap MB  Part of a file searched again when it grows "
+			"(default "
+			<< WATCH_DEFAULT_OVERLAP << ")\n"
+		"  --perf        Count CPU events for each phase of the search\n"
+		"  --trace FILE  Save a timeline of each thread's work in FILE, for "
+			"chrome://tracing\n"
+		"  --no-numa     Do not bind search threads to NUMA nodes\n"
+		"  --huge-pages  Ask for the file to be mapped with huge pages\n"
+		"  --cache-window MB  Read this far ahead and drop what is behind, to "
+			"limit\n"
+		"                the file's use of the page cache\n"
+		"  --cache-behind MB  Part of the file to keep behind the search "
+			"(default "
+			<< INPUT_DEFAULT_BEHIND / 1048576 << ")\n"
+		<< std::flush;
 }
-#endif
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2) {
+	std::vector<std::string> parts;
+	unsigned int numWriters = 1;
+	unsigned int maxQueue = WRITER_DEFAULT_QUEUE;
+	Compression compression = CompressNone;
+	int compressLevel = COMPRESS_DEFAULT_LEVEL;
+	double readLimit = -1, writeLimit = -1, writeFiles = -1;
+	const char *limitsFile = NULL;
+	bool adaptive = false;
+	const char *loadStats = NULL;
+	const char *saveStats = NULL;
+	const char *checkpointFile = NULL;
+	unsigned long checkpointInterval = CHECKPOINT_DEFAULT_INTERVAL;
+	bool resume = false;
+	bool ranged = false;
+	unsigned long long rangeStart = 0, rangeLen = 0;
+	unsigned long shardIndex = 0, shardCount = 0;
+	const char *manifestFile = NULL;
+	std::vector<bool> formats;
+	const char *profileFile = NULL;
+	std::string outputRoot;
+	OutputDir::Layout layout = OutputDir::Flat;
+	const char *watchDir = NULL;
+	unsigned long pid = 0;
+	unsigned long long watchOverlap = WATCH_DEFAULT_OVERLAP * 1048576ULL;
+	unsigned int numThreads = 1;
+	double surveyFraction = 0;
+	unsigned long long surveyBlock = SURVEY_DEFAULT_BLOCK * 1024ULL;
+	unsigned long long surveySeed = std::random_device()();
+	const char *dedupFile = NULL;
+	unsigned long long dedupWindow = DEDUP_DEFAULT_WINDOW * 1024ULL;
+	bool numa = true;
+	bool perf = false;
+	const char *traceFile = NULL;
+	bool separate = false;
+	unsigned long long batchSize = COALESCE_DEFAULT_BATCH * 1048576ULL;
+	bool hugePages = false;
+	bool cacheWindow = false;
+	unsigned long long cacheAhead = 0;
+	unsigned long long cacheBehind = INPUT_DEFAULT_BEHIND;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if ((arg == "--writers") && hasValue) {
+			numWriters = strtoul(argv[++i], NULL, 0);
+		} else if ((arg == "--queue") && hasValue) {
+			maxQueue = strtoul(argv[++i], NULL, 0);
+		} else if ((arg == "--compress") && hasValue) {
+			if (!compression_from_name(argv[++i], &compression)) {
+				std::cerr << "Unknown compression method " << argv[i]
+					<< ", this build supports " << compression_names() << "."
+					<< std::endl;
+				return 1;
+			}
+		} else if ((arg == "--read-limit") && hasValue) {
+			readLimit = strtod(argv[++i], NULL) * 1048576;
+		} else if ((arg == "--write-limit") && hasValue) {
+			writeLimit = strtod(argv[++i], NULL) * 1048576;
+		} else if ((arg == "--write-files") && hasValue) {
+			writeFiles = strtod(argv[++i], NULL);
+		} else if ((arg == "--limits") && hasValue) {
+			limitsFile = argv[++i];
+		} else if ((arg == "--compress-level") && hasValue) {
+			compressLevel = strtol(argv[++i], NULL, 0);
+			if (compressLevel < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--formats") && hasValue) {
+			std::string error;
+			if (!parse_formats(argv[++i], &formats, &error)) {
+				std::cerr << error << std::endl;
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--profile") && hasValue) {
+			profileFile = argv[++i];
+		} else if ((arg == "--signature") && hasValue) {
+			std::string error;
+			if (!UserSignatures::instance().add(argv[++i], &error)) {
+				std::cerr << error << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--signatures") && hasValue) {
+			std::string error;
+			if (!UserSignatures::instance().load(argv[++i], &error)) {
+				std::cerr << error << std::endl;
+				return 1;
+			}
+		} else if (arg == "--adaptive") {
+			adaptive = true;
+		} else if ((arg == "--load-stats") && hasValue) {
+			loadStats = argv[++i];
+			adaptive = true;
+		} else if ((arg == "--save-stats") && hasValue) {
+			saveStats = argv[++i];
+			// The statistics are only collected in adaptive mode
+			adaptive = true;
+		} else if ((arg == "--checkpoint") && hasValue) {
+			checkpointFile = argv[++i];
+		} else if ((arg == "--checkpoint-interval") && hasValue) {
+			checkpointInterval = strtoul(argv[++i], NULL, 0);
+		} else if (arg == "--resume") {
+			resume = true;
+		} else if ((arg == "--range") && hasValue) {
+			char *sep;
+			rangeStart = strtoull(argv[++i], &sep, 0);
+			if (*sep != ':') {
+				usage(argv[0]);
+				return 1;
+			}
+			rangeLen = strtoull(sep + 1, NULL, 0);
+			ranged = true;
+		} else if ((arg == "--shard") && hasValue) {
+			char *sep;
+			shardIndex = strtoul(argv[++i], &sep, 0);
+			if (*sep == '/') shardCount = strtoul(sep + 1, NULL, 0);
+			if (shardIndex >= shardCount) {
+				usage(argv[0]);
+				return 1;
+			}
+			ranged = true;
+		} else if ((arg == "--manifest") && hasValue) {
+			manifestFile = argv[++i];
+		} else if ((arg == "--output") && hasValue) {
+			outputRoot = argv[++i];
+		} else if ((arg == "--layout") && hasValue) {
+			if (!OutputDir::parseLayout(argv[++i], &layout)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--pid") && hasValue) {
+			pid = strtoul(argv[++i], NULL, 0);
+			if (pid == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--watch") && hasValue) {
+			watchDir = argv[++i];
+		} else if ((arg == "--watch-overlap") && hasValue) {
+			watchOverlap = strtoull(argv[++i], NULL, 0) * 1048576;
+		} else if ((arg == "--threads") && hasValue) {
+			numThreads = strtoul(argv[++i], NULL, 0);
+		} else if ((arg == "--survey") && hasValue) {
+			char *end;
+			surveyFraction = strtod(argv[++i], &end);
+			if (*end == '%') surveyFraction /= 100;
+			if (!(surveyFraction > 0) || (surveyFraction > 1)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--survey-block") && hasValue) {
+			surveyBlock = strtoull(argv[++i], NULL, 0) * 1024;
+			if (surveyBlock == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--survey-seed") && hasValue) {
+			surveySeed = strtoull(argv[++i], NULL, 0);
+		} else if ((arg == "--dedup") && hasValue) {
+			dedupFile = argv[++i];
+		} else if ((arg == "--dedup-window") && hasValue) {
+			dedupWindow = strtoull(argv[++i], NULL, 0) * 1024;
+		} else if (arg == "--perf") {
+			perf = true;
+		} else if ((arg == "--trace") && hasValue) {
+			traceFile = argv[++i];
+		} else if (arg == "--separate") {
+			separate = true;
+		} else if ((arg == "--batch") && hasValue) {
+			batchSize = strtoull(argv[++i], NULL, 0) * 1048576;
+		} else if (arg == "--no-numa") {
+			numa = false;
+		} else if (arg == "--huge-pages") {
+			hugePages = true;
+		} else if ((arg == "--cache-window") && hasValue) {
+			cacheAhead = strtoull(argv[++i], NULL, 0) * 1048576;
+			cacheWindow = true;
+		} else if ((arg == "--cache-behind") && hasValue) {
+			cacheBehind = strtoull(argv[++i], NULL, 0) * 1048576;
+			cacheWindow = true;
+		} else if (arg.compare(0, 2, "--") == 0) {
+			usage(argv[0]);
+			return 1;
+		} else {
+			parts.push_back(arg);
+		}
+	}
+	if (watchDir && (compression != CompressNone)) {
+		std::cerr << "--compress cannot be used with --watch." << std::endl;
+		return 1;
+	}
+	IoLimits limits;
+	bool limited = limitsFile || (readLimit >= 0) || (writeLimit >= 0)
+		|| (writeFiles >= 0);
+	if (watchDir && limited) {
+		std::cerr << "The read and write limits cannot be used with --watch."
+			<< std::endl;
+		return 1;
+	}
+	if (limitsFile) {
+		std::string error;
+		if (!limits.load(limitsFile, &error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		}
+		limits.filename = limitsFile;
+#ifdef SIGHUP
+		signal(SIGHUP, request_reload);
+#endif
+	}
+	// Given on the command line, these win over the file until it is reread
+	if (readLimit >= 0) limits.read.setRate(readLimit);
+	if (writeLimit >= 0) limits.write.setRate(writeLimit);
+	if (writeFiles >= 0) limits.files.setRate(writeFiles);
+	if ((compression == CompressGzip) && (compressLevel > 9)) {
+		std::cerr << "The gzip compression level must be from 0 to 9."
+			<< std::endl;
+		return 1;
+	}
+	if ((watchDir || pid) && (!parts.empty() || checkpointFile || manifestFile
+		|| ranged || (watchDir && pid))
+	) {
+		std::cerr << "--watch and --pid cannot be used with a file to search, "
+			"each other, --checkpoint, --manifest, --range or --shard."
+			<< std::endl;
+		return 1;
+	}
+	if (parts.empty() && !watchDir && !pid) {
 		std::cerr << "Must specify file to search." << std::endl;
 		return 1;
 	}
-#ifdef _WIN32
-	HANDLE hFile = CreateFile(argv[1], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, NULL, NULL);
-	if (hFile == INVALID_HANDLE_VALUE) {
-		std::cerr << "Unable to open " << argv[1] << ": " << GetLastErrorAsString() << std::endl;
-		return 2;
+	if (perf && ((numThreads > 1) || watchDir || pid)) {
+		std::cerr << "--perf can only be used with a single search thread, "
+			"and not with --watch or --pid." << std::endl;
+		return 1;
 	}
-	HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-	if (hMap == NULL) {
-		std::cerr << "Unable to memory map input file: " << GetLastErrorAsString() << std::endl;
-		return 3;
-	}
-	unsigned long lenFile = GetFileSize(hFile, NULL);
-	uint8_t *content = (uint8_t *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
-	if (content == NULL) {
-		std::cerr << "Unable to memory map input file view: " << GetLastErrorAsString() << std::endl;
-		return 4;
-	}
-#else
-	int fd = open(argv[1], O_RDONLY);
-	if (fd < 0) {
-		std::cerr << "Unable to open " << argv[1] << ": " << strerror(errno) << std::endl;
-		return 2;
+	if (dedupFile && ((numThreads > 1) || watchDir || pid || checkpointFile
+		|| ranged || perf)
+	) {
+		std::cerr << "--dedup can only be used with a single search thread, "
+			"and not with --watch, --pid, --checkpoint, --range, --shard or --perf."
+			<< std::endl;
+		return 1;
+	}
+	if ((surveyFraction > 0) && ((numThreads > 1) || watchDir || pid
+		|| checkpointFile || manifestFile || dedupFile || perf)
+	) {
+		std::cerr << "--survey can only be used with a single search thread, "
+			"and not with --watch, --pid, --checkpoint, --manifest, --dedup or "
+			"--perf." << std::endl;
+		return 1;
+	}
+	if (traceFile && (watchDir || pid || (surveyFraction > 0))) {
+		std::cerr << "--trace cannot be used with --watch, --pid or --survey."
+			<< std::endl;
+		return 1;
+	}
+	if (separate && (watchDir || pid || checkpointFile || manifestFile || ranged
+		|| (numThreads > 1) || dedupFile || (surveyFraction > 0) || perf
+		|| traceFile)
+	) {
+		std::cerr << "--separate can only be used with a single search thread, "
+			"and not with --watch, --pid, --checkpoint, --manifest, --range, "
+			"--shard, --dedup, --survey, --perf or --trace." << std::endl;
+		return 1;
+	}
+	if (resume && !checkpointFile) {
+		std::cerr << "--resume needs --checkpoint." << std::endl;
+		return 1;
 	}
 
-	struct stat s;
-	fstat(fd, &s);
-	unsigned long lenFile = s.st_size;
-	uint8_t *content = (uint8_t *)mmap(0, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (content == MAP_FAILED) {
-		std::cerr << "Unable to mmap() file: " << strerror(errno) << std::endl;
-		return 4;
+	Profile profile;
+	if (profileFile) {
+		std::string error;
+		if (!profile.load(profileFile, &error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		}
 	}
-#endif
-	unsigned long matchCount = 0;
-
-	std::vector<CheckFunction> checkFunctions;
-	checkFunctions.push_back(check_cdfm);
-	checkFunctions.push_back(check_cmf);
-	checkFunctions.push_back(check_ibk);
-	checkFunctions.push_back(check_iff);
-	checkFunctions.push_back(check_midi);
-	checkFunctions.push_back(check_riff);
-	checkFunctions.push_back(check_s3m);
-	checkFunctions.push_back(check_tbsa);
-	checkFunctions.push_back(check_voc);
-
-	uint8_t *cp = content;
-	uint8_t *end = content + lenFile;
-	unsigned long lenRemaining = lenFile;
-	Match match;
-	while (cp < end) {
-		if ((unsigned long)cp % 4096 == 0) {
-			unsigned long offset = cp - content;
-			std::cout << "\rSearching... " << offset << " bytes ("
-				<< offset * 100 / lenFile << "%)" << std::flush;
+	std::vector<Checker> active = profile.active(formats);
+	if (!UserSignatures::instance().empty()) {
+		active.push_back(UserSignatures::instance().checker());
+	}
+	if (active.empty()) {
+		std::cerr << "No formats to search for." << std::endl;
+		return 1;
+	}
+	Scanner scanner(active);
+	scanner.setAdaptive(adaptive);
+	if (loadStats && !scanner.loadStats(loadStats)) {
+		std::cerr << "Unable to read checker statistics from " << loadStats
+			<< std::endl;
+		return 1;
+	}
+
+	if (watchDir) {
+		signal(SIGINT, request_stop);
+		signal(SIGTERM, request_stop);
+		DirScanner watch(watchDir, scanner, outputRoot, layout, watchOverlap);
+		return watch.run(numThreads);
+	}
+	if (pid) {
+		OutputDir dir;
+		std::string error;
+		int ret = dir.open(outputRoot, layout, &error);
+		if (ret) {
+			std::cerr << error << std::endl;
+			return ret;
 		}
-		for (std::vector<CheckFunction>::iterator
-			c = checkFunctions.begin(); c != checkFunctions.end(); c++
+		OutputWriter writer(numWriters, maxQueue);
+		writer.setCompression(compression, compressLevel);
+		if (limited) writer.setLimits(&limits);
+		Output output;
+		output.writer = &writer;
+		output.dir = &dir;
+		output.manifest = NULL;
+		output.byOffset = false;
+		output.matchCount = 0;
+		return scan_process(pid, scanner, output);
+	}
+	if (separate) {
+		OutputDir dir;
+		std::string error;
+		int ret = dir.open(outputRoot, layout, &error);
+		if (ret) {
+			std::cerr << error << std::endl;
+			return ret;
+		}
+		OutputWriter writer(numWriters, maxQueue);
+		writer.setCompression(compression, compressLevel);
+		if (limited) writer.setLimits(&limits);
+		Output output;
+		output.writer = &writer;
+		output.dir = &dir;
+		output.manifest = NULL;
+		output.byOffset = false;
+		output.matchCount = 0;
+		return scan_separate(parts, scanner, output, batchSize,
+			limited ? &limits : NULL);
+	}
+
+	// Started before the input is opened, so mapping it is on the timeline.
+	// Every thread that records into it has finished by the time it is
+	// written at the end.
+	std::unique_ptr<TraceLog> trace;
+	if (traceFile) {
+		trace.reset(new TraceLog());
+		TraceLog::current() = trace.get();
+		trace_thread(TRACE_MAIN_TRACK, "main");
+	}
+
+	InputFile input;
+	std::string error;
+	int ret;
+	{
+		TraceSpan span("open input");
+		ret = input.open(parts, &error);
+	}
+	if (ret) {
+		std::cerr << error << std::endl;
+		return ret;
+	}
+	std::string filename = parts[0];
+	if (parts.size() > 1) filename += " and the parts after it";
+	const uint8_t *content = input.data();
+	unsigned long lenFile = input.size();
+	if (hugePages && !input.adviseHugePages()) {
+		std::cerr << "Huge pages are not available for " << filename
+			<< ", using normal pages." << std::endl;
+	}
+	if (cacheWindow) input.setWindow(cacheAhead, cacheBehind);
+
+	if (shardCount) {
+		rangeStart = (unsigned long long)lenFile * shardIndex / shardCount;
+		rangeLen = (unsigned long long)lenFile * (shardIndex + 1) / shardCount
+			- rangeStart;
+	} else if (!ranged) {
+		rangeLen = lenFile;
+	}
+	// Matches starting in the range may still extend beyond it
+	if (rangeStart > lenFile) rangeStart = lenFile;
+	if (rangeLen > lenFile - rangeStart) rangeLen = lenFile - rangeStart;
+	unsigned long rangeEnd = rangeStart + rangeLen;
+
+	if (surveyFraction > 0) {
+		Survey survey(rangeStart, rangeLen, surveyBlock, surveyFraction,
+			surveySeed);
+		std::cout << "Surveying " << filename << " with seed " << surveySeed
+			<< "." << std::endl;
+		return run_survey(input, scanner, survey, surveyBlock, rangeEnd);
+	}
+
+	Checkpoint state;
+	std::string config = checkpoint_config(active, layout, compression,
+		compressLevel);
+	if (resume) {
+		std::ifstream exists(checkpointFile);
+		if (!exists) {
+			std::cout << "No checkpoint found, starting from the beginning."
+				<< std::endl;
+		} else if (!state.load(checkpointFile, &error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		} else if ((state.size != lenFile) || (state.mtime != input.mtime())
+			|| (state.offset > lenFile)
 		) {
-			if ((*c)(cp, lenRemaining, &match)) {
-				std::stringstream ss;
-				ss << std::setw(4) << std::setfill('0') << matchCount << '.' << match.ext;
-				std::cout << "\033[2K\rFound match " << std::hex << match.len
-					<< "@" << (cp - content) << std::dec << ": writing " << ss.str()
-					<< " [";
-				switch (match.cat) {
-					case check::Unknown: std::cout << "?"; break;
-					case check::Audio: std::cout << "audio"; break;
-					case check::Image: std::cout << "image"; break;
-					case check::Music: std::cout << "music"; break;
-					case check::Video: std::cout << "video"; break;
-					case check::Other: std::cout << "other"; break;
-				}
-				std::cout << "; " << match.desc << "]" << std::endl;
+			std::cerr << "Checkpoint " << checkpointFile << " was saved for a "
+				"different version of " << filename << std::endl;
+			return 1;
+		} else if ((state.rangeStart != rangeStart) || (state.rangeLen != rangeLen)
+			|| (manifestFile && !state.manifest)
+		) {
+			std::cerr << "Checkpoint " << checkpointFile << " was saved with "
+				"different --range, --shard or --manifest options" << std::endl;
+			return 1;
+		} else if (state.config != config) {
+			std::cerr << "Checkpoint " << checkpointFile << " was saved with "
+				"different --formats, --profile, --signature, --layout or --compress "
+				"options" << std::endl;
+			return 1;
+		} else {
+			std::cout << "Resuming at offset " << state.offset << " with "
+				<< state.matchCount << " matches already saved." << std::endl;
+		}
+	}
+	state.size = lenFile;
+	state.mtime = input.mtime();
+	state.rangeStart = rangeStart;
+	state.rangeLen = rangeLen;
+	state.config = config;
+	if (state.offset < rangeStart) state.offset = rangeStart;
 
-#ifdef _WIN32
-				HANDLE hFileMatch = CreateFile(ss.str().c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, NULL, NULL);
-				if (hFileMatch == NULL) {
-					std::cerr << "Unable to create output file: " << GetLastErrorAsString() << std::endl;
-					return 5;
-				}
-				SetFilePointer(hFileMatch, match.len, 0, FILE_BEGIN);
-				SetEndOfFile(hFileMatch);
-				HANDLE hMapMatch = CreateFileMapping(hFileMatch, NULL, PAGE_READWRITE, 0, 0, NULL);
-				if (hMapMatch == NULL) {
-					std::cerr << "Unable to memory map output file: " << GetLastErrorAsString() << std::endl;
-					return 6;
-				}
-				uint8_t *matchContent = (uint8_t *)MapViewOfFile(hMapMatch, FILE_MAP_WRITE, 0, 0, 0);
-				if (matchContent == NULL) {
-					std::cerr << "Unable to memory map output file view: " << GetLastErrorAsString() << std::endl;
-					return 7;
+	ManifestWriter manifest;
+	if (manifestFile) {
+		Manifest m;
+		m.size = lenFile;
+		m.start = rangeStart;
+		m.len = rangeLen;
+		m.config = dedup_config(active);
+		m.compression = compression_name(compression);
+		m.compressLevel = compressLevel;
+		if (!manifest.open(manifestFile, m, state.manifest, &error)) {
+			std::cerr << error << std::endl;
+			return 1;
+		}
+	}
+	if (checkpointFile) {
+		signal(SIGINT, request_stop);
+		signal(SIGTERM, request_stop);
+	}
+	std::chrono::steady_clock::time_point nextCheckpoint =
+		std::chrono::steady_clock::now() + std::chrono::seconds(checkpointInterval);
+
+	ChunkStore store;
+	if (dedupFile && !store.load(dedupFile, dedup_config(active), &error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+
+	OutputDir dir;
+	ret = dir.open(outputRoot, layout, &error);
+	if (ret) {
+		std::cerr << error << std::endl;
+		return ret;
+	}
+	OutputWriter writer(numWriters, maxQueue);
+	writer.setCompression(compression, compressLevel);
+	if (limited) {
+		writer.setLimits(&limits);
+		input.setLimits(&limits, state.offset);
+	}
+
+	Output output;
+	output.writer = &writer;
+	output.dir = &dir;
+	output.manifest = manifestFile ? &manifest : NULL;
+	output.byOffset = ranged;
+	output.matchCount = state.matchCount;
+
+	PerfCounters counters;
+	if (perf && !counters.open(&error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+	PerfSample extraction;
+	unsigned long long extracted = 0;
+	PerfSample searchStart = counters.read();
+
+	bool interrupted = false;
+	unsigned long long searchStartOffset = state.offset, searchEndOffset = rangeEnd;
+	DedupStats dedupStats;
+	if (dedupFile) {
+		// Whether it fails or not, the reason is reported by finish() below
+		scan_dedup(input, scanner, output, store, dedupWindow, &dedupStats);
+	} else if (numThreads <= 1) {
+		unsigned long long pos = state.offset;
+		Match match;
+		TraceProgress progress("search", pos);
+		while (pos < rangeEnd) {
+			if (pos % 4096 == 0) {
+				unsigned long offset = pos;
+				progress.advance(offset);
+				input.advance(offset);
+				std::cout << "\rSearching... " << offset << " bytes ("
+					<< (offset - rangeStart) * 100 / rangeLen << "%)" << std::flush;
+				if (checkpointFile && (stopRequested
+					|| (std::chrono::steady_clock::now() >= nextCheckpoint))
+				) {
+					if (!save_checkpoint(checkpointFile, &state, offset, output, &ret,
+						&error)) break;
+					if (stopRequested) {
+						interrupted = true;
+						break;
+					}
+					nextCheckpoint = std::chrono::steady_clock::now()
+						+ std::chrono::seconds(checkpointInterval);
 				}
-#else
-				int fdmatch = open(ss.str().c_str(), O_RDWR | O_CREAT, 0644);
-				if (fdmatch < 0) {
-					std::cerr << "Unable to open output file: " << strerror(errno) << std::endl;
-					return 5;
+			}
+			// Search up to the next progress update
+			unsigned long long stop = std::min<unsigned long long>(
+				(pos | 4095) + 1, rangeEnd);
+			if (scanner.next(content, lenFile, &pos, stop, &match) < 0) continue;
+			ManifestEntry m(pos, match);
+			PerfSample before;
+			if (perf) before = counters.read();
+			bool saved;
+			{
+				TraceSpan span("save", match.len);
+				saved = output.save(content + pos, m);
+			}
+			if (perf) {
+				extraction += counters.read() - before;
+				extracted += match.len;
+			}
+			if (!saved) {
+				// The reason is reported by finish() below
+				break;
+			}
+			pos += match.len;
+		}
+		searchEndOffset = std::min<unsigned long long>(pos, rangeEnd);
+		progress.finish(searchEndOffset);
+	} else {
+		// Each thread scans a piece of a window, then the pieces are joined
+		// back together in order.  The next window starts wherever the single
+		// scan would have carried on, so only the pieces need stitching.
+		ParallelScanner parallel(scanner, numThreads, numa);
+		if (parallel.nodesUsed()) {
+			std::cout << "Spreading " << numThreads << " threads over "
+				<< parallel.nodesUsed() << " NUMA nodes." << std::endl;
+		}
+		unsigned long long window = (unsigned long long)numThreads
+			* PARALLEL_PIECE_SIZE;
+		Stitcher stitcher(&scanner, content, lenFile, state.offset);
+		std::vector<Manifest> parts;
+		bool failed = false;
+		while (!failed && (stitcher.position() < rangeEnd)) {
+			unsigned long long offset = stitcher.position();
+			std::cout << "\rSearching... " << offset << " bytes ("
+				<< (offset - rangeStart) * 100 / rangeLen << "%)" << std::flush;
+			if (checkpointFile && (stopRequested
+				|| (std::chrono::steady_clock::now() >= nextCheckpoint))
+			) {
+				if (!save_checkpoint(checkpointFile, &state, offset, output, &ret,
+					&error)) break;
+				if (stopRequested) {
+					interrupted = true;
+					break;
 				}
-				ftruncate(fdmatch, match.len);
+				nextCheckpoint = std::chrono::steady_clock::now()
+					+ std::chrono::seconds(checkpointInterval);
+			}
 
-				uint8_t *matchContent = (uint8_t *)mmap(0, match.len, PROT_WRITE, MAP_SHARED, fdmatch, 0);
-				if (matchContent == MAP_FAILED) {
-					std::cerr << "Unable to mmap() output file: " << strerror(errno) << std::endl;
-					return 7;
+			unsigned long long windowEnd = std::min<unsigned long long>(
+				offset + window, rangeEnd);
+			input.advance(offset);
+			{
+				TraceSpan span("wait for search threads", windowEnd - offset);
+				parallel.scan(content, lenFile, offset, windowEnd, &parts);
+			}
+			std::vector<ManifestEntry> keep, drop;
+			{
+				TraceSpan span("stitch");
+				for (std::vector<Manifest>::const_iterator
+					p = parts.begin(); p != parts.end(); p++
+				) {
+					stitcher.add(*p, &keep, &drop);
+				}
+			}
+			for (std::vector<ManifestEntry>::iterator
+				m = keep.begin(); m != keep.end(); m++
+			) {
+				TraceSpan span("save", m->len);
+				if (!output.save(content + m->offset, *m)) {
+					failed = true;
+					break;
 				}
-#endif
-				memcpy(matchContent, cp, match.len);
-#ifdef _WIN32
-				UnmapViewOfFile(matchContent);
-				CloseHandle(hMapMatch);
-				CloseHandle(hFileMatch);
-#else
-				munmap(matchContent, match.len);
-				close(fdmatch);
-#endif
-				matchCount++;
-				cp += match.len - 1;
-				lenRemaining -= match.len - 1;
-				break;
 			}
 		}
-		cp++;
-		lenRemaining--;
-	}
-	std::cout << "\033[2K\rComplete.  " << lenFile << " bytes (100%)" << std::endl;
-
-#ifdef _WIN32
-	UnmapViewOfFile(content);
-	CloseHandle(hMap);
-	CloseHandle(hFile);
-#else
-	munmap(content, s.st_size);
-	close(fd);
-#endif
-	return 0;
+		parallel.collectStats(&scanner);
+	}
+	PerfSample searchTotal = counters.read() - searchStart;
+	unsigned long long matchCount = output.matchCount;
+
+	if (!ret) {
+		TraceSpan span("wait for writers to finish");
+		ret = writer.finish(&error);
+	}
+	if (!ret && manifestFile && !interrupted && !manifest.complete()) {
+		error = std::string("Unable to write manifest ") + manifestFile;
+		ret = 8;
+	}
+	if (!ret && checkpointFile && !interrupted) {
+		// Record that the scan is complete, so resuming it does nothing
+		state.offset = rangeEnd;
+		state.matchCount = matchCount;
+		if (manifestFile) state.manifest = manifest.position();
+		if (!state.save(checkpointFile, &error)) ret = 8;
+	}
+	if (!ret && dedupFile && !store.save(dedupFile, &error)) ret = 8;
+	if (trace) {
+		// Stop the writer threads if an error skipped that above, so nothing
+		// else is recording
+		std::string traceError;
+		writer.finish(&traceError);
+		TraceLog::current() = NULL;
+		if (!trace->write(traceFile, &traceError) && !ret) {
+			error = traceError;
+			ret = 8;
+		}
+	}
+	if (ret) {
+		std::cerr << "\033[2K\r" << error << std::endl;
+	} else if (interrupted) {
+		std::cout << "\033[2K\rStopped at offset " << state.offset
+			<< ", use --resume to continue." << std::endl;
+		ret = 9;
+	} else {
+		std::cout << "\033[2K\rComplete.  " << rangeLen << " bytes (100%)" << std::endl;
+		if (writer.stallSeconds() >= 0.01) {
+			std::cout << "Waited " << std::fixed << std::setprecision(2)
+				<< writer.stallSeconds() << "s for matches to be saved." << std::endl;
+		}
+		if (limited) {
+			std::cout << "Held back by the limits for " << std::fixed
+				<< std::setprecision(2) << limits.read.waitedSeconds()
+				<< "s of searching and " << limits.write.waitedSeconds()
+				+ limits.files.waitedSeconds() << "s of saving." << std::endl;
+		}
+		if (dedupFile) {
+			std::cout << "Reused the matches in " << dedupStats.reused << " of "
+				<< dedupStats.chunks << " chunks, and searched " << dedupStats.searched
+				<< " bytes (" << (lenFile ? dedupStats.searched * 100 / lenFile : 0)
+				<< "%).  " << dedupFile << " had " << store.sizeLoaded()
+				<< " chunks." << std::endl;
+		}
+	}
+	if (perf) {
+		// Timed on its own after the search, as the fused loop does the
+		// prefilter's job inline with the checkers
+		unsigned long long searched = searchEndOffset - searchStartOffset;
+		PerfSample start = counters.read();
+		unsigned long long calls = scanner.countCandidates(content, lenFile,
+			searchStartOffset, searchEndOffset);
+		PerfSample prefilter = counters.read() - start;
+		PerfSample search = searchTotal - extraction;
+
+		std::cout << "Performance counters for the search thread:\n";
+		counters.reportHeading(std::cout);
+		counters.report(std::cout, "total", searched, searchTotal);
+		counters.report(std::cout, "search", searched, search);
+		counters.report(std::cout, "prefilter", searched, prefilter);
+		counters.report(std::cout, "checkers", searched, search - prefilter);
+		counters.report(std::cout, "extraction", extracted, extraction);
+		std::cout << "The prefilter chose " << calls << " checker calls.  It "
+			"was measured in a separate pass,\nand the checkers are the search "
+			"minus that pass." << std::endl;
+	}
+	if (adaptive) scanner.reportStats(std::cout);
+	if (saveStats && !scanner.saveStats(saveStats)) {
+		std::cerr << "Unable to write checker statistics to " << saveStats
+			<< std::endl;
+	}
+
+	return ret;
 }
@@ -0,0 +1,469 @@
+/**
+ * @file   manifest.hpp
+ * @brief  List of the matches found by a scan, for combining shards.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_MANIFEST_HPP_
+#define _RIPPER6_MANIFEST_HPP_
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include "platform.hpp"
+#include "check.hpp"
+#include "compress.hpp"
+
+/// Version written to and expected in manifest files.
+#define MANIFEST_VERSION 1
+
+/// Name of the file a match is saved in during a normal scan.
+inline std::string match_filename(unsigned long long count, const std::string& ext)
+{
+	std::ostringstream ss;
+	ss << std::setw(4) << std::setfill('0') << count << '.' << ext;
+	return ss.str();
+}
+
+/// Name of the file a match is saved in when only part of the input is
+/// scanned.
+/**
+ * The final number of the match is not known until the shards are merged,
+ * so the file is named after its offset instead.
+ */
+inline std::string shard_filename(unsigned long long offset, const std::string& ext)
+{
+	std::ostringstream ss;
+	ss << "at" << std::hex << std::setw(10) << std::setfill('0') << offset
+		<< '.' << ext;
+	return ss.str();
+}
+
+/// Is a path absolute, rather than relative to the current directory?
+inline bool path_is_absolute(const std::string& f)
+{
+	return !f.empty() && ((f[0] == '/') || (f[0] == '\\')
+		|| ((f.length() > 1) && (f[1] == ':')));
+}
+
+/// Turn a path relative to the current directory into an absolute one.
+/**
+ * Any "./" in the path is removed, but nothing else is done to it, so
+ * symlinks and ".." are left as they are.
+ *
+ * @return The path unchanged if it is already absolute, or the current
+ *   directory cannot be found.
+ */
+inline std::string absolute_path(const std::string& path)
+{
+	std::string full = path;
+	if (!path_is_absolute(path)) {
+#ifdef _WIN32
+		char buf[MAX_PATH];
+		DWORD n = GetCurrentDirectory(sizeof(buf), buf);
+		if ((n == 0) || (n >= sizeof(buf))) return path;
+		full = std::string(buf, n) + "\\" + path;
+#else
+		std::vector<char> buf(4096);
+		while (!getcwd(&buf[0], buf.size())) {
+			if (errno != ERANGE) return path;
+			buf.resize(buf.size() * 2);
+		}
+		full = std::string(&buf[0]) + "/" + path;
+#endif
+	}
+	static const char *dots[] = {"/./", "\\.\\"};
+	for (unsigned int i = 0; i < 2; i++) {
+		std::string::size_type p;
+		while ((p = full.find(dots[i])) != std::string::npos) full.erase(p, 2);
+	}
+	return full;
+}
+
+/// Write a filename as one word, with any spaces written as %20.
+/**
+ * Tabs, line breaks and % itself are written the same way.
+ */
+inline std::string escape_filename(const std::string& name)
+{
+	std::ostringstream ss;
+	for (std::string::const_iterator c = name.begin(); c != name.end(); c++) {
+		if ((*c == ' ') || (*c == '%') || (*c == '\t') || (*c == '\n')
+			|| (*c == '\r')
+		) {
+			ss << '%' << std::hex << std::uppercase << std::setw(2)
+				<< std::setfill('0') << (unsigned int)(uint8_t)*c;
+		} else {
+			ss << *c;
+		}
+	}
+	return ss.str();
+}
+
+/// Reverse of escape_filename().
+inline std::string unescape_filename(const std::string& word)
+{
+	std::string name;
+	for (std::string::size_type i = 0; i < word.length(); i++) {
+		if ((word[i] == '%') && (i + 2 < word.length()) && isxdigit(word[i + 1])
+			&& isxdigit(word[i + 2])
+		) {
+			name += (char)strtoul(word.substr(i + 1, 2).c_str(), NULL, 16);
+			i += 2;
+		} else {
+			name += word[i];
+		}
+	}
+	return name;
+}
+
+/// Word used for each check::MatchCategory in a manifest.
+inline const char *category_name(check::MatchCategory cat)
+{
+	switch (cat) {
+		case check::Unknown: break;
+		case check::Audio: return "audio";
+		case check::Image: return "image";
+		case check::Music: return "music";
+		case check::Video: return "video";
+		case check::Other: return "other";
+	}
+	return "unknown";
+}
+
+/// Find the format a manifest entry refers to from its filename extension.
+inline FormatId format_from_ext(const std::string& ext)
+{
+	for (unsigned int i = FormatUnknown + 1; i < format_count(); i++) {
+		if (ext == format_info((FormatId)i).ext) return (FormatId)i;
+	}
+	return FormatUnknown;
+}
+
+/// Write the fields of a MatchMeta that are set, as "key=value" pairs.
+/**
+ * The title is always last, as it may contain spaces.
+ *
+ * @return false if there is nothing to write.
+ */
+inline bool write_meta(std::ostream& out, const MatchMeta& meta)
+{
+	std::ostringstream ss;
+	if (meta.sampleRate) ss << " rate=" << meta.sampleRate;
+	if (meta.channels) ss << " channels=" << meta.channels;
+	if (meta.bits) ss << " bits=" << meta.bits;
+	if (meta.tracks) ss << " tracks=" << meta.tracks;
+	if (meta.patterns) ss << " patterns=" << meta.patterns;
+	if (meta.instruments) ss << " instruments=" << meta.instruments;
+	if (meta.width) ss << " width=" << meta.width;
+	if (meta.height) ss << " height=" << meta.height;
+	if (meta.title[0]) ss << " title=" << meta.title;
+	std::string fields = ss.str();
+	if (fields.empty()) return false;
+	out << fields.substr(1);
+	return true;
+}
+
+/// Reverse of write_meta().  Unknown keys are ignored.
+inline void read_meta(std::istream& in, MatchMeta *meta)
+{
+	std::string field;
+	while (in >> field) {
+		std::string::size_type eq = field.find('=');
+		if (eq == std::string::npos) continue;
+		std::string key = field.substr(0, eq);
+		if (key == "title") {
+			// Everything to the end of the line
+			std::string rest;
+			std::getline(in, rest);
+			std::string title = field.substr(eq + 1) + rest;
+			meta->setTitle((const uint8_t *)title.data(), title.length());
+			break;
+		}
+		unsigned long value = strtoul(field.c_str() + eq + 1, NULL, 10);
+		if (key == "rate") meta->sampleRate = value;
+		else if (key == "channels") meta->channels = value;
+		else if (key == "bits") meta->bits = value;
+		else if (key == "tracks") meta->tracks = value;
+		else if (key == "patterns") meta->patterns = value;
+		else if (key == "instruments") meta->instruments = value;
+		else if (key == "width") meta->width = value;
+		else if (key == "height") meta->height = value;
+	}
+}
+
+/// One match listed in a manifest.
+struct ManifestEntry {
+	unsigned long long offset;  ///< Where the match starts in the input
+	unsigned long len;          ///< Length of the match
+	FormatId format;
+	MatchMeta meta;
+	std::string filename;       ///< File the match was saved in, see Manifest
+
+	ManifestEntry()
+		:	offset(0),
+			len(0),
+			format(FormatUnknown)
+	{
+		memset(&this->meta, 0, sizeof(this->meta));
+	}
+
+	/// Record a match found by a checker.
+	/**
+	 * The filename is left empty, so this does not allocate.
+	 */
+	ManifestEntry(unsigned long long offset, const Match& match)
+		:	offset(offset),
+			len(match.len),
+			format(match.format),
+			meta(match.meta)
+	{
+	}
+
+	check::MatchCategory cat() const
+	{
+		return format_info(this->format).cat;
+	}
+
+	const char *ext() const
+	{
+		return format_info(this->format).ext;
+	}
+
+	const char *desc() const
+	{
+		return format_info(this->format).desc;
+	}
+};
+
+/// Describes which part of an input was scanned and what was found there.
+/**
+ * A manifest is a text file.  After a header giving the size of the input,
+ * the range that was scanned, the checkers, limits and signatures searched
+ * with and how the matches were compressed (if they were), there is one
+ * line per match, in order, and
+ * finally a "complete" line once the whole range has been scanned.  A
+ * manifest without the last line is from a scan that did not finish.
+ *
+ * A match may be followed by a "meta" line giving details read from inside
+ * the file, such as the sample rate of a sound or the size of an image.
+ *
+ * The file each match was saved in is given relative to the directory the
+ * manifest is in, so the two can be moved together, unless it is somewhere
+ * else, in which case the full path is given.  Spaces in it are written as
+ * %20, see escape_filename().
+ *
+ * @code
+ * # ripper6 manifest
+ * version 1
+ * input 1048576
+ * range 0 524288
+ * checkers cdfm cmf ibk iff midi riff s3m tbsa voc
+ * limit cdfm.max-sample 1048576
+ * ...
+ * compress gzip -1
+ * match 8192 4122 audio wav at0000002000.wav Microsoft Wave
+ * meta rate=22050 channels=1 bits=8
+ * complete
+ * @endcode
+ */
+struct Manifest {
+	unsigned long long size;       ///< Length of the whole input
+	unsigned long long start;      ///< First offset scanned
+	unsigned long long len;        ///< Number of offsets scanned
+	bool complete;                 ///< The whole range was scanned
+	std::string config;            ///< Search settings, from dedup_config()
+	std::string compression;       ///< Name of the --compress method
+	int compressLevel;             ///< Compression level, if compressed
+	std::vector<ManifestEntry> matches;
+
+	Manifest()
+		:	size(0),
+			start(0),
+			len(0),
+			complete(false),
+			compression(compression_name(CompressNone)),
+			compressLevel(COMPRESS_DEFAULT_LEVEL)
+	{
+	}
+
+	/// Read a manifest file.
+	/**
+	 * @param error
+	 *   On failure, set to a description of the problem.
+	 *
+	 * @return false if the file could not be read or is not a manifest.
+	 */
+	bool load(const std::string& filename, std::string *error)
+	{
+		std::ifstream f(filename.c_str());
+		if (!f) {
+			*error = "Unable to read manifest " + filename;
+			return false;
+		}
+		int version = 0;
+		std::string line;
+		while (std::getline(f, line)) {
+			if (line.empty() || (line[0] == '#')) continue;
+			std::istringstream ss(line);
+			std::string key;
+			ss >> key;
+			if (key == "version") {
+				ss >> version;
+			} else if (key == "input") {
+				ss >> this->size;
+			} else if (key == "range") {
+				ss >> this->start >> this->len;
+			} else if ((key == "checkers") || (key == "limit")
+				|| (key == "signature")
+			) {
+				this->config += line + "\n";
+			} else if (key == "compress") {
+				ss >> this->compression >> this->compressLevel;
+			} else if (key == "complete") {
+				this->complete = true;
+			} else if (key == "match") {
+				// The category and description come from the format, so
+				// they are only in the file for people to read
+				ManifestEntry m;
+				std::string cat, ext, file;
+				if (!(ss >> m.offset >> m.len >> cat >> ext >> file)) {
+					*error = filename + " has an invalid line: " + line;
+					return false;
+				}
+				m.format = format_from_ext(ext);
+				m.filename = unescape_filename(file);
+				this->matches.push_back(m);
+			} else if ((key == "meta") && !this->matches.empty()) {
+				read_meta(ss, &this->matches.back().meta);
+			}
+		}
+		if (version != MANIFEST_VERSION) {
+			*error = filename + " is not a valid manifest";
+			return false;
+		}
+		return true;
+	}
+};
+
+/// Writes a manifest as the scan runs.
+class ManifestWriter
+{
+	public:
+		/// Start a new manifest, or carry on with one from an interrupted scan.
+		/**
+		 * @param filename
+		 *   Manifest to write.
+		 *
+		 * @param m
+		 *   Input size, range, settings and compression to record.  The
+		 *   matches are ignored.
+		 *
+		 * @param resumeAt
+		 *   0 to start a new manifest, otherwise a value from position() to
+		 *   keep that much of the existing file and discard the rest.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the file could not be written.
+		 */
+		bool open(const std::string& filename, const Manifest& m,
+			unsigned long long resumeAt, std::string *error)
+		{
+			std::string keep;
+			if (resumeAt) {
+				std::ifstream old(filename.c_str(), std::ios::binary);
+				keep.resize(resumeAt);
+				if (!old.read(&keep[0], resumeAt)) {
+					*error = "Manifest " + filename + " is shorter than the checkpoint "
+						"expects";
+					return false;
+				}
+			}
+			this->f.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+			if (!this->f) {
+				*error = "Unable to write manifest " + filename;
+				return false;
+			}
+			std::string full = absolute_path(filename);
+			this->dir = full.substr(0, full.find_last_of("/\\") + 1);
+			if (resumeAt) {
+				this->f << keep;
+			} else {
+				this->f << "# ripper6 manifest\n"
+					"version " << MANIFEST_VERSION << "\n"
+					"input " << m.size << "\n"
+					"range " << m.start << ' ' << m.len << "\n"
+					<< m.config;
+				if (m.compression != compression_name(CompressNone)) {
+					this->f << "compress " << m.compression << ' ' << m.compressLevel
+						<< "\n";
+				}
+			}
+			return this->f.good();
+		}
+
+		/// Add a match to the list.
+		/**
+		 * @param m
+		 *   The match, whose filename is relative to the current directory or
+		 *   absolute.
+		 */
+		void add(const ManifestEntry& m)
+		{
+			std::string file = absolute_path(m.filename);
+			if (file.compare(0, this->dir.length(), this->dir) == 0) {
+				file.erase(0, this->dir.length());
+			}
+			this->f << "match " << m.offset << ' ' << m.len << ' '
+				<< category_name(m.cat()) << ' ' << m.ext() << ' '
+				<< escape_filename(file) << ' ' << m.desc() << "\n";
+			std::ostringstream meta;
+			if (write_meta(meta, m.meta)) this->f << "meta " << meta.str() << "\n";
+		}
+
+		/// Write out everything so far and return the length of the file.
+		/**
+		 * @return The file length to pass to open() when resuming, or 0 if
+		 *   there has been a write error.
+		 */
+		unsigned long long position()
+		{
+			this->f.flush();
+			if (!this->f) return 0;
+			return this->f.tellp();
+		}
+
+		/// Mark the manifest as complete.
+		/**
+		 * @return false if there has been a write error.
+		 */
+		bool complete()
+		{
+			this->f << "complete\n";
+			this->f.flush();
+			return this->f.good();
+		}
+
+	private:
+		std::ofstream f;
+		std::string dir;   ///< Full path of the manifest's directory
+};
+
+#endif // _RIPPER6_MANIFEST_HPP_
@@ -0,0 +1,326 @@
+/**
+ * @file   merge.cpp
+ * @brief  Combine the results of scanning an input in shards.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include "platform.hpp"
+#include "checkers.hpp"
+#include "dedup.hpp"
+#include "input.hpp"
+#include "manifest.hpp"
+#include "outdir.hpp"
+#include "profile.hpp"
+#include "scanner.hpp"
+#include "signature.hpp"
+#include "stitch.hpp"
+#include "writer.hpp"
+
+/// A shard's manifest and where its files are.
+struct Shard {
+	std::string dir;   ///< Directory holding the manifest, ending with '/'
+	Manifest m;
+
+	bool operator< (const Shard& o) const
+	{
+		return this->m.start < o.m.start;
+	}
+
+	/// Where one of the shard's files is now.
+	std::string path(const ManifestEntry& e) const
+	{
+		return path_is_absolute(e.filename) ? e.filename : this->dir + e.filename;
+	}
+};
+
+/// Move a file, copying it if it is on another filesystem.
+static int move_file(const std::string& from, const std::string& to,
+	std::string *error)
+{
+	if (rename(from.c_str(), to.c_str()) == 0) return 0;
+	InputFile f;
+	int ret = f.open(from.c_str(), error);
+	if (ret) return ret;
+	ret = write_file(to, f.data(), f.size(), error);
+	if (ret) return ret;
+	f.close();
+	remove(from.c_str());
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [options] <manifest> [<manifest>...]\n"
+		"\n"
+		"Combines the output of ripper6 --shard (or --range) scans into the same "
+		"files\n"
+		"a single scan would have produced.\n"
+		"\n"
+		"Options:\n"
+		"  --input FILE     The file that was scanned, needed if a match "
+			"crosses from\n"
+		"                   one shard into the next.  Give it once for each "
+			"part of\n"
+		"                   a file that was split.\n"
+		"  --manifest FILE  Write a manifest of the combined result\n"
+		"  --formats LIST   The --formats the shards were searched with\n"
+		"  --profile FILE   The profile the shards were searched with\n"
+		"  --signature SPEC, --signatures FILE\n"
+		"                   The user signatures the shards were searched with\n"
+		"  --output DIR     Save the files in DIR (default: current "
+			"directory)\n"
+		"  --layout L       Arrange the files in DIR: flat (default), category "
+			"or hash\n"
+		<< std::flush;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> inputFiles;
+	const char *manifestFile = NULL;
+	std::string outputRoot;
+	OutputDir::Layout layout = OutputDir::Flat;
+	std::vector<Shard> shards;
+	Profile profile;
+	std::vector<bool> formats;
+	std::string error;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if ((arg == "--input") && hasValue) {
+			inputFiles.push_back(argv[++i]);
+		} else if ((arg == "--formats") && hasValue) {
+			if (!parse_formats(argv[++i], &formats, &error)) {
+				std::cerr << error << std::endl;
+				usage(argv[0]);
+				return 1;
+			}
+		} else if ((arg == "--profile") && hasValue) {
+			if (!profile.load(argv[++i], &error)) {
+				std::cerr << error << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--signature") && hasValue) {
+			if (!UserSignatures::instance().add(argv[++i], &error)) {
+				std::cerr << error << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--signatures") && hasValue) {
+			if (!UserSignatures::instance().load(argv[++i], &error)) {
+				std::cerr << error << std::endl;
+				return 1;
+			}
+		} else if ((arg == "--manifest") && hasValue) {
+			manifestFile = argv[++i];
+		} else if ((arg == "--output") && hasValue) {
+			outputRoot = argv[++i];
+		} else if ((arg == "--layout") && hasValue) {
+			if (!OutputDir::parseLayout(argv[++i], &layout)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (arg.compare(0, 2, "--") == 0) {
+			usage(argv[0]);
+			return 1;
+		} else {
+			Shard s;
+			std::string::size_type slash = arg.find_last_of("/\\");
+			if (slash != std::string::npos) s.dir = arg.substr(0, slash + 1);
+			if (!s.m.load(arg, &error)) {
+				std::cerr << error << std::endl;
+				return 2;
+			}
+			if (!s.m.complete) {
+				std::cerr << arg << " is from a scan that did not finish" << std::endl;
+				return 2;
+			}
+			shards.push_back(s);
+		}
+	}
+	if (shards.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// The shards must cover the whole input with no gaps or overlaps
+	std::sort(shards.begin(), shards.end());
+	unsigned long long size = shards[0].m.size;
+	unsigned long long expected = 0;
+	for (std::vector<Shard>::const_iterator
+		s = shards.begin(); s != shards.end(); s++
+	) {
+		if (s->m.size != size) {
+			std::cerr << "The manifests are from different input files" << std::endl;
+			return 2;
+		}
+		if ((s->m.compression != shards[0].m.compression)
+			|| (s->m.compressLevel != shards[0].m.compressLevel)
+		) {
+			std::cerr << "The manifests are from searches with different --compress "
+				"options" << std::endl;
+			return 2;
+		}
+		if (s->m.start != expected) {
+			std::cerr << "No manifest covers offset " << expected << std::endl;
+			return 2;
+		}
+		expected = s->m.start + s->m.len;
+	}
+	if (expected != size) {
+		std::cerr << "No manifest covers offset " << expected << std::endl;
+		return 2;
+	}
+
+	// Matches found by scanning again are saved the way the shards saved theirs
+	Compression compression;
+	int compressLevel = shards[0].m.compressLevel;
+	if (!compression_from_name(shards[0].m.compression, &compression)) {
+		std::cerr << "The shards were compressed with " << shards[0].m.compression
+			<< ", which this build does not support" << std::endl;
+		return 2;
+	}
+
+	InputFile input;
+	if (!inputFiles.empty()) {
+		int ret = input.open(inputFiles, &error);
+		if (ret) {
+			std::cerr << error << std::endl;
+			return ret;
+		}
+		if (input.size() != size) {
+			std::cerr << inputFiles[0];
+			if (inputFiles.size() > 1) std::cerr << " and the parts after it are";
+			else std::cerr << " is";
+			std::cerr << " not the file that was scanned" << std::endl;
+			return 3;
+		}
+	} else {
+		// Find out before anything is moved
+		Stitcher check(NULL, NULL, size, 0);
+		std::vector<ManifestEntry> keep, drop;
+		for (std::vector<Shard>::const_iterator
+			s = shards.begin(); s != shards.end(); s++
+		) {
+			if (!check.add(s->m, &keep, &drop)) {
+				std::cerr << "A match crosses from one shard into the next, so "
+					"--input is needed" << std::endl;
+				return 3;
+			}
+		}
+	}
+	std::vector<Checker> active = profile.active(formats);
+	if (!UserSignatures::instance().empty()) {
+		active.push_back(UserSignatures::instance().checker());
+	}
+	// Rescanning with other checkers would not find what the shards did
+	std::string config = dedup_config(active);
+	for (std::vector<Shard>::const_iterator
+		s = shards.begin(); s != shards.end(); s++
+	) {
+		if (s->m.config != config) {
+			std::cerr << "The shards were searched with different --formats, "
+				"--profile or --signature options from those given" << std::endl;
+			return 2;
+		}
+	}
+	Scanner scanner(active);
+
+	OutputDir dir;
+	int ret = dir.open(outputRoot, layout, &error);
+	if (ret) {
+		std::cerr << error << std::endl;
+		return ret;
+	}
+
+	ManifestWriter out;
+	if (manifestFile) {
+		Manifest m;
+		m.size = size;
+		m.len = size;
+		m.config = config;
+		m.compression = shards[0].m.compression;
+		m.compressLevel = compressLevel;
+		if (!out.open(manifestFile, m, 0, &error)) {
+			std::cerr << error << std::endl;
+			return 5;
+		}
+	}
+
+	Stitcher stitcher(&scanner, input.data(), size, 0);
+	unsigned long long matchCount = 0;
+	for (std::vector<Shard>::const_iterator
+		s = shards.begin(); s != shards.end(); s++
+	) {
+		std::vector<ManifestEntry> keep, drop;
+		stitcher.add(s->m, &keep, &drop);
+		for (std::vector<ManifestEntry>::const_iterator
+			i = drop.begin(); i != drop.end(); i++
+		) {
+			remove(s->path(*i).c_str());
+		}
+		for (std::vector<ManifestEntry>::iterator
+			i = keep.begin(); i != keep.end(); i++
+		) {
+			OutputDir::Target to;
+			// A file saved with --compress keeps its suffix
+			std::string name = match_filename(matchCount++, i->ext())
+				+ (i->filename.empty() ? std::string(compression_suffix(compression))
+					: compressed_suffix(i->filename));
+			if (!dir.locate(i->cat(), name, &to, &error)) {
+				std::cerr << error << std::endl;
+				return 5;
+			}
+			if (i->filename.empty()) {
+				// Found by scanning the input again
+				if (compression == CompressNone) {
+					ret = write_file(to.name, input.data() + i->offset, i->len, &error,
+						to.dir);
+				} else {
+					ret = write_compressed(to.name, input.data() + i->offset, i->len,
+						compression, compressLevel, &error, to.dir);
+				}
+			} else {
+				ret = move_file(s->path(*i), to.path, &error);
+			}
+			if (ret) {
+				std::cerr << "Unable to save " << to.path << ": " << error << std::endl;
+				return ret;
+			}
+			i->filename = to.path;
+			if (manifestFile) out.add(*i);
+		}
+	}
+
+	if (manifestFile && !out.complete()) {
+		std::cerr << "Unable to write manifest " << manifestFile << std::endl;
+		return 5;
+	}
+	std::cout << "Merged " << shards.size() << " shards into " << matchCount
+		<< " matches";
+	if (stitcher.rescanned) {
+		std::cout << ", " << stitcher.rescanned << " found by rescanning";
+	}
+	if (stitcher.dropped) {
+		std::cout << ", " << stitcher.dropped << " overlapping matches removed";
+	}
+	std::cout << "." << std::endl;
+	return 0;
+}
@@ -0,0 +1,141 @@
+/**
+ * @file   numa.hpp
+ * @brief  Placement of threads and memory on NUMA nodes.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_NUMA_HPP_
+#define _RIPPER6_NUMA_HPP_
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "platform.hpp"
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+/// Highest node number looked for.
+#define NUMA_MAX_NODES 64
+
+/// The NUMA nodes in this machine and the CPUs in each.
+/**
+ * This reads the topology from sysfs and uses the system calls directly, so
+ * libnuma is not needed.  On other platforms, or machines with one node,
+ * everything reports a single node and binding does nothing.
+ */
+class NumaTopology
+{
+	public:
+		NumaTopology()
+		{
+#ifdef __linux__
+			for (int n = 0; n < NUMA_MAX_NODES; n++) {
+				std::ostringstream path;
+				path << "/sys/devices/system/node/node" << n << "/cpulist";
+				std::ifstream f(path.str().c_str());
+				if (!f) continue;
+				std::string list;
+				std::getline(f, list);
+				std::vector<int> cpus = parse_cpu_list(list);
+				if (cpus.empty()) continue; // memory-only node
+				this->ids.push_back(n);
+				this->cpus.push_back(cpus);
+			}
+#endif
+		}
+
+		/// Number of nodes with CPUs, always at least 1.
+		unsigned int nodes() const
+		{
+			return this->ids.empty() ? 1 : this->ids.size();
+		}
+
+		/// Limit the calling thread to the CPUs of one node.
+		/**
+		 * @param node
+		 *   Index of the node, less than nodes().
+		 *
+		 * @return false if the thread could not be bound.
+		 */
+		bool bindThread(unsigned int node) const
+		{
+#ifdef __linux__
+			if (node >= this->cpus.size()) return false;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (std::vector<int>::const_iterator
+				i = this->cpus[node].begin(); i != this->cpus[node].end(); i++
+			) {
+				if (*i < CPU_SETSIZE) CPU_SET(*i, &set);
+			}
+			return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+			return false;
+#endif
+		}
+
+		/// Find which node holds a page of memory.
+		/**
+		 * @param addr
+		 *   Any address within the page.
+		 *
+		 * @return Index of the node, or -1 if the page is not in memory or
+		 *   this cannot be found out.
+		 */
+		int pageNode(const void *addr) const
+		{
+#if defined(__linux__) && defined(SYS_move_pages)
+			if (this->ids.size() < 2) return -1;
+			static const unsigned long pageSize = sysconf(_SC_PAGESIZE);
+			void *page = (void *)((unsigned long)addr & ~(pageSize - 1));
+			int status = -1;
+			// With no target nodes, move_pages() only reports where pages are
+			if (syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) != 0) {
+				return -1;
+			}
+			for (unsigned int i = 0; i < this->ids.size(); i++) {
+				if (this->ids[i] == status) return i;
+			}
+#endif
+			return -1;
+		}
+
+	private:
+		std::vector<int> ids;                ///< Kernel's number for each node
+		std::vector<std::vector<int> > cpus; ///< CPUs in each node
+
+		/// Expand a list like "0-3,8-11" into the CPU numbers.
+		static std::vector<int> parse_cpu_list(const std::string& list)
+		{
+			std::vector<int> cpus;
+			std::istringstream ss(list);
+			std::string range;
+			while (std::getline(ss, range, ',')) {
+				int first, last;
+				char dash;
+				std::istringstream r(range);
+				if (!(r >> first)) continue;
+				if (!(r >> dash >> last)) last = first;
+				for (int c = first; c <= last; c++) cpus.push_back(c);
+			}
+			return cpus;
+		}
+};
+
+#endif // _RIPPER6_NUMA_HPP_
@@ -0,0 +1,234 @@
+/**
+ * @file   outdir.hpp
+ * @brief  Where in the output directory each match is saved.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_OUTDIR_HPP_
+#define _RIPPER6_OUTDIR_HPP_
+
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include "manifest.hpp"
+#include "writer.hpp"
+
+/// Number of subdirectories used by OutputDir::Hash.
+#define OUTDIR_HASH_DIRS 256
+
+/// The output directory, and the subdirectories matches are spread over.
+/**
+ * Creating files gets slow once a directory holds a few hundred thousand of
+ * them, so matches can be split up by category (music/, audio/, ...) or
+ * spread evenly over 256 subdirectories (00/ to ff/) by a hash of the
+ * filename.
+ *
+ * Each subdirectory is created the first time a match is saved there, and
+ * kept open so files can be created relative to it with openat(), without
+ * the kernel looking up the whole path every time.
+ */
+class OutputDir
+{
+	public:
+		/// How matches are arranged under the output directory.
+		enum Layout {
+			Flat,      ///< All in the output directory itself
+			Category,  ///< In a subdirectory named after the match category
+			Hash       ///< In one of OUTDIR_HASH_DIRS subdirectories
+		};
+
+		/// Where to save one file.
+		struct Target {
+			int dir;           ///< Directory handle to create the file in
+			std::string name;  ///< Filename relative to dir
+			std::string path;  ///< Filename relative to the current directory
+		};
+
+		OutputDir()
+			:	layout(Flat),
+				rootFd(OUTPUT_CWD)
+		{
+		}
+
+		~OutputDir()
+		{
+#ifndef _WIN32
+			for (std::vector<int>::iterator
+				i = this->fds.begin(); i != this->fds.end(); i++
+			) {
+				if (*i >= 0) ::close(*i);
+			}
+			if (this->rootFd >= 0) ::close(this->rootFd);
+#endif
+		}
+
+		/// Convert the name of a layout given on the command line.
+		/**
+		 * @return false if the name is not recognised.
+		 */
+		static bool parseLayout(const std::string& name, Layout *layout)
+		{
+			if (name == "flat") *layout = Flat;
+			else if (name == "category") *layout = Category;
+			else if (name == "hash") *layout = Hash;
+			else return false;
+			return true;
+		}
+
+		/// Use a directory for the output, creating it if needed.
+		/**
+		 * @param root
+		 *   Output directory.  Its parent must already exist.
+		 *
+		 * @param layout
+		 *   How to arrange the files inside it.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return 0 on success, or the program exit code to use on failure.
+		 */
+		int open(const std::string& root, Layout layout, std::string *error)
+		{
+			this->layout = layout;
+			this->prefix.clear();
+			if (!root.empty() && (root != ".")) {
+				this->prefix = root;
+				char last = root[root.length() - 1];
+				if ((last != '/') && (last != '\\')) this->prefix += '/';
+				if (!make_dir(OUTPUT_CWD, root, error)) return 5;
+			}
+			switch (layout) {
+				case Flat: this->fds.assign(1, -1); break;
+				case Category: this->fds.assign(check::Other + 1, -1); break;
+				case Hash: this->fds.assign(OUTDIR_HASH_DIRS, -1); break;
+			}
+#ifndef _WIN32
+			if (!this->prefix.empty()) {
+				this->rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY);
+				if (this->rootFd < 0) {
+					*error = "Unable to open output directory " + root + ": "
+						+ strerror(errno);
+					return 5;
+				}
+			}
+#endif
+			return 0;
+		}
+
+		/// Decide where a match is saved, creating its directory if needed.
+		/**
+		 * @param cat
+		 *   Category of the match.
+		 *
+		 * @param filename
+		 *   Name of the file, without any directory.
+		 *
+		 * @param target
+		 *   Set to where the file goes.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the directory could not be created.
+		 */
+		bool locate(check::MatchCategory cat, const std::string& filename,
+			Target *target, std::string *error)
+		{
+			unsigned int index = 0;
+			std::string sub;
+			if (this->layout == Category) {
+				index = cat;
+				sub = category_name(cat);
+			} else if (this->layout == Hash) {
+				index = hash_name(filename) % OUTDIR_HASH_DIRS;
+				std::ostringstream ss;
+				ss << std::hex << std::setw(2) << std::setfill('0') << index;
+				sub = ss.str();
+			}
+			target->path = this->prefix;
+			if (!sub.empty()) target->path += sub + '/';
+			target->path += filename;
+#ifdef _WIN32
+			if (!sub.empty() && (this->fds[index] < 0)) {
+				if (!make_dir(OUTPUT_CWD, this->prefix + sub, error)) return false;
+				this->fds[index] = 0;
+			}
+			target->dir = OUTPUT_CWD;
+			target->name = target->path;
+#else
+			if (sub.empty()) {
+				target->dir = this->rootFd;
+				target->name = filename;
+				return true;
+			}
+			if (this->fds[index] < 0) {
+				if (!make_dir(this->rootFd, sub, error)) return false;
+				this->fds[index] = openat(this->rootFd, sub.c_str(),
+					O_RDONLY | O_DIRECTORY);
+				if (this->fds[index] < 0) {
+					*error = "Unable to open output directory " + this->prefix + sub
+						+ ": " + strerror(errno);
+					return false;
+				}
+			}
+			target->dir = this->fds[index];
+			target->name = filename;
+#endif
+			return true;
+		}
+
+	private:
+		Layout layout;
+		std::string prefix;     ///< Output directory with a trailing slash, or ""
+		int rootFd;             ///< Handle to the output directory
+		std::vector<int> fds;   ///< Handle to each subdirectory, -1 until opened
+
+		/// Create a directory if it does not already exist.
+		/**
+		 * @param parent
+		 *   Handle to the directory name is relative to.  Ignored on Windows.
+		 */
+		static bool make_dir(int parent, const std::string& name,
+			std::string *error)
+		{
+#ifdef _WIN32
+			if (CreateDirectory(name.c_str(), NULL)) return true;
+			if (GetLastError() == ERROR_ALREADY_EXISTS) return true;
+			*error = "Unable to create directory " + name + ": "
+				+ GetLastErrorAsString();
+			return false;
+#else
+			if (mkdirat(parent, name.c_str(), 0755) == 0) return true;
+			if (errno == EEXIST) return true;
+			*error = "Unable to create directory " + name + ": " + strerror(errno);
+			return false;
+#endif
+		}
+
+		/// FNV-1a hash of a filename, to spread the files evenly.
+		static uint32_t hash_name(const std::string& name)
+		{
+			uint32_t h = 2166136261u;
+			for (std::string::const_iterator c = name.begin(); c != name.end(); c++) {
+				h = (h ^ (uint8_t)*c) * 16777619u;
+			}
+			return h;
+		}
+};
+
+#endif // _RIPPER6_OUTDIR_HPP_
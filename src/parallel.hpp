@@ -0,0 +1,210 @@
+/**
+ * @file   parallel.hpp
+ * @brief  Scan parts of the input on several threads at once.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_PARALLEL_HPP_
+#define _RIPPER6_PARALLEL_HPP_
+
+#include <thread>
+#include <vector>
+#include "manifest.hpp"
+#include "numa.hpp"
+#include "scanner.hpp"
+#include "trace.hpp"
+
+/// Amount of input given to each thread at a time.
+#define PARALLEL_PIECE_SIZE (8 * 1024 * 1024)
+
+/// Pages looked at to decide which node holds a piece of the input.
+#define PARALLEL_PLACEMENT_SAMPLES 8
+
+/// Divides a region of the input between threads, each with its own Scanner.
+/**
+ * Each thread scans its piece as though it were a shard, and the results
+ * must then be put through a Stitcher to get the matches a single scan
+ * would have found.
+ *
+ * With NUMA placement the threads are spread evenly over the nodes and
+ * bound to them.  Each piece goes to a thread on the node already holding
+ * most of its pages, and pieces not yet in memory go to the threads in
+ * order, so each node reads in and then scans its own part of the input.
+ */
+class ParallelScanner
+{
+	public:
+		/// Prepare the threads.
+		/**
+		 * @param prototype
+		 *   Scanner to copy for each thread, including its settings and any
+		 *   statistics it already has.
+		 *
+		 * @param numThreads
+		 *   Number of threads, at least 1.
+		 *
+		 * @param numa
+		 *   true to bind each thread to a NUMA node.  This does nothing on a
+		 *   machine with only one node.
+		 */
+		ParallelScanner(const Scanner& prototype, unsigned int numThreads, bool numa)
+			:	base(prototype),
+				workers(numThreads ? numThreads : 1, prototype),
+				node(workers.size(), -1)
+		{
+			if (numa && (this->topology.nodes() > 1)) {
+				for (unsigned int w = 0; w < this->workers.size(); w++) {
+					this->node[w] = w * this->topology.nodes() / this->workers.size();
+				}
+			}
+		}
+
+		/// Find the matches starting in a region, one piece per thread.
+		/**
+		 * @param content
+		 *   The input.
+		 *
+		 * @param size
+		 *   Length of the input.  Matches may extend past end, up to here.
+		 *
+		 * @param start
+		 *   First offset to scan.
+		 *
+		 * @param end
+		 *   Offset to stop scanning at.
+		 *
+		 * @param parts
+		 *   Set to the range and matches of each piece, in order.
+		 */
+		void scan(const uint8_t *content, unsigned long long size,
+			unsigned long long start, unsigned long long end,
+			std::vector<Manifest> *parts)
+		{
+			unsigned int n = this->workers.size();
+			parts->assign(n, Manifest());
+			for (unsigned int i = 0; i < n; i++) {
+				Manifest& p = (*parts)[i];
+				p.size = size;
+				p.start = start + (end - start) * i / n;
+				p.len = start + (end - start) * (i + 1) / n - p.start;
+			}
+			std::vector<unsigned int> assigned = this->place(content, *parts);
+
+			std::vector<std::thread> threads;
+			for (unsigned int i = 0; i < n; i++) {
+				threads.push_back(std::thread(&ParallelScanner::run, this,
+					assigned[i], content, &(*parts)[i]));
+			}
+			for (std::vector<std::thread>::iterator
+				t = threads.begin(); t != threads.end(); t++
+			) {
+				t->join();
+			}
+		}
+
+		/// Add the statistics gathered by every thread to a Scanner.
+		void collectStats(Scanner *into) const
+		{
+			for (std::vector<Scanner>::const_iterator
+				w = this->workers.begin(); w != this->workers.end(); w++
+			) {
+				into->addStats(*w, this->base);
+			}
+		}
+
+		/// Number of NUMA nodes the threads are bound to, 0 if not bound.
+		unsigned int nodesUsed() const
+		{
+			return this->node[0] < 0 ? 0 : this->topology.nodes();
+		}
+
+	private:
+		NumaTopology topology;
+		Scanner base;                   ///< Copied to make each worker
+		std::vector<Scanner> workers;   ///< One Scanner per thread
+		std::vector<int> node;          ///< Node of each thread, or -1
+
+		/// Decide which thread scans each piece.
+		/**
+		 * @return Thread index for each piece.
+		 */
+		std::vector<unsigned int> place(const uint8_t *content,
+			const std::vector<Manifest>& parts) const
+		{
+			unsigned int n = parts.size();
+			std::vector<unsigned int> assigned(n);
+			std::vector<bool> pieceDone(n, false), workerUsed(n, false);
+
+			if (this->node[0] >= 0) {
+				for (unsigned int i = 0; i < n; i++) {
+					int home = this->homeNode(content, parts[i]);
+					if (home < 0) continue;
+					for (unsigned int w = 0; w < n; w++) {
+						if (workerUsed[w] || (this->node[w] != home)) continue;
+						assigned[i] = w;
+						pieceDone[i] = workerUsed[w] = true;
+						break;
+					}
+				}
+			}
+			for (unsigned int i = 0; i < n; i++) {
+				if (pieceDone[i]) continue;
+				// Keep pieces with their matching thread where possible, so
+				// neighbouring pieces stay on the same node
+				unsigned int w = i;
+				if (workerUsed[w]) {
+					for (w = 0; workerUsed[w]; w++);
+				}
+				assigned[i] = w;
+				workerUsed[w] = true;
+			}
+			return assigned;
+		}
+
+		/// Node holding most of a piece's pages, or -1 if unknown.
+		int homeNode(const uint8_t *content, const Manifest& part) const
+		{
+			std::vector<unsigned int> count(this->topology.nodes(), 0);
+			int best = -1;
+			for (unsigned int s = 0; s < PARALLEL_PLACEMENT_SAMPLES; s++) {
+				int n = this->topology.pageNode(content + part.start
+					+ part.len * s / PARALLEL_PLACEMENT_SAMPLES);
+				if (n < 0) continue;
+				count[n]++;
+				if ((best < 0) || (count[n] > count[best])) best = n;
+			}
+			return best;
+		}
+
+		/// Thread scanning one piece.
+		void run(unsigned int w, const uint8_t *content, Manifest *part)
+		{
+			if (this->node[w] >= 0) this->topology.bindThread(this->node[w]);
+			trace_thread(TRACE_SEARCH_TRACK + w, "search thread", w);
+			TraceSpan span("search piece", part->len);
+			Scanner& scanner = this->workers[w];
+			unsigned long long end = part->start + part->len;
+			Match match;
+			for (unsigned long long pos = part->start; pos < end; ) {
+				if (scanner.next(content, part->size, &pos, end, &match) < 0) break;
+				part->matches.push_back(ManifestEntry(pos, match));
+				pos += match.len;
+			}
+		}
+};
+
+#endif // _RIPPER6_PARALLEL_HPP_
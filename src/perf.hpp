@@ -0,0 +1,230 @@
+/**
+ * @file   perf.hpp
+ * @brief  Hardware performance counters for profiling the search.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_PERF_HPP_
+#define _RIPPER6_PERF_HPP_
+
+#include <iomanip>
+#include <ostream>
+#include "platform.hpp"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/// Events counted by PerfCounters.
+enum PerfEvent {
+	PerfCycles,
+	PerfInstructions,
+	PerfBranchMisses,
+	PerfCacheMisses,     ///< Last level cache
+	PerfPageFaults,
+	PerfTaskClock,       ///< Nanoseconds spent running
+	PerfEventCount
+};
+
+/// Counter values at one moment, or the difference between two moments.
+struct PerfSample {
+	unsigned long long value[PerfEventCount];
+
+	PerfSample()
+	{
+		for (unsigned int e = 0; e < PerfEventCount; e++) this->value[e] = 0;
+	}
+
+	PerfSample& operator +=(const PerfSample& o)
+	{
+		for (unsigned int e = 0; e < PerfEventCount; e++) {
+			this->value[e] += o.value[e];
+		}
+		return *this;
+	}
+
+	PerfSample operator -(const PerfSample& o) const
+	{
+		PerfSample r;
+		for (unsigned int e = 0; e < PerfEventCount; e++) {
+			// Clamp, as an estimate made by subtraction can come out negative
+			r.value[e] = this->value[e] > o.value[e] ? this->value[e] - o.value[e] : 0;
+		}
+		return r;
+	}
+};
+
+/// Counts CPU events for the calling thread with perf_event_open().
+/**
+ * Each event is opened on its own, so that any the CPU or kernel does not
+ * support (e.g. inside most virtual machines there are no hardware counters
+ * at all) are simply left out of the report.  If the kernel has to share the
+ * counters between more events than the CPU can count at once, the values are
+ * scaled up by the fraction of time each one was actually counting.
+ *
+ * Only the thread that opened the counters is measured, so the time spent by
+ * the writer threads saving matches is not included.
+ *
+ * This is only available on Linux.
+ */
+class PerfCounters
+{
+	public:
+		PerfCounters()
+		{
+			for (unsigned int e = 0; e < PerfEventCount; e++) this->fd[e] = -1;
+		}
+
+		~PerfCounters()
+		{
+#ifdef __linux__
+			for (unsigned int e = 0; e < PerfEventCount; e++) {
+				if (this->fd[e] >= 0) ::close(this->fd[e]);
+			}
+#endif
+		}
+
+		/// Start counting.
+		/**
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if none of the events can be counted.
+		 */
+		bool open(std::string *error)
+		{
+#ifdef __linux__
+			static const struct {
+				uint32_t type;
+				uint64_t config;
+			} events[PerfEventCount] = {
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+				{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+				{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+				{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+			};
+			bool any = false;
+			int lastErrno = 0;
+			for (unsigned int e = 0; e < PerfEventCount; e++) {
+				struct perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = events[e].type;
+				attr.config = events[e].config;
+				attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+					| PERF_FORMAT_TOTAL_TIME_RUNNING;
+				// Allowed without privileges when perf_event_paranoid is 2
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				this->fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+					PERF_FLAG_FD_CLOEXEC);
+				if (this->fd[e] >= 0) any = true;
+				else lastErrno = errno;
+			}
+			if (!any) {
+				*error = std::string("Unable to use performance counters: ")
+					+ strerror(lastErrno);
+			}
+			return any;
+#else
+			*error = "Performance counters are only supported on Linux";
+			return false;
+#endif
+		}
+
+		/// Can this event be counted?
+		bool available(PerfEvent e) const
+		{
+			return this->fd[e] >= 0;
+		}
+
+		/// Read the current value of every counter.
+		PerfSample read() const
+		{
+			PerfSample s;
+#ifdef __linux__
+			for (unsigned int e = 0; e < PerfEventCount; e++) {
+				if (this->fd[e] < 0) continue;
+				uint64_t v[3]; // value, time enabled, time running
+				if (::read(this->fd[e], v, sizeof(v)) != sizeof(v)) continue;
+				if (v[2] && (v[2] < v[1])) {
+					v[0] = (uint64_t)((double)v[0] * v[1] / v[2]);
+				}
+				s.value[e] = v[0];
+			}
+#endif
+			return s;
+		}
+
+		/// Write the heading for report().
+		void reportHeading(std::ostream& out) const
+		{
+			static const char *names[PerfEventCount] = {
+				"cycles", "instructions", "branch-miss", "LLC-miss", "page-faults",
+				"ms",
+			};
+			out << std::left << std::setw(12) << "Phase" << std::right;
+			for (unsigned int e = 0; e < PerfEventCount; e++) {
+				if (this->available((PerfEvent)e)) out << std::setw(14) << names[e];
+			}
+			out << std::setw(12)
+				<< (this->available(PerfCycles) ? "bytes/cycle" : "MB/s") << "\n";
+		}
+
+		/// Write one line of counts.
+		/**
+		 * @param phase
+		 *   Name of the part of the search that was measured.
+		 *
+		 * @param bytes
+		 *   Amount of input that phase covered.
+		 *
+		 * @param s
+		 *   Counts for that phase.
+		 */
+		void report(std::ostream& out, const char *phase, unsigned long long bytes,
+			const PerfSample& s) const
+		{
+			out << std::left << std::setw(12) << phase << std::right;
+			for (unsigned int e = 0; e < PerfEventCount; e++) {
+				if (!this->available((PerfEvent)e)) continue;
+				if (e == PerfTaskClock) {
+					out << std::setw(14) << std::fixed << std::setprecision(1)
+						<< s.value[e] / 1e6;
+				} else {
+					out << std::setw(14) << s.value[e];
+				}
+			}
+			out << std::setw(12) << std::fixed << std::setprecision(3);
+			if (this->available(PerfCycles)) {
+				if (s.value[PerfCycles]) out << (double)bytes / s.value[PerfCycles];
+				else out << "-";
+			} else if (this->available(PerfTaskClock) && s.value[PerfTaskClock]) {
+				out << (double)bytes * 1000 / s.value[PerfTaskClock];
+			} else {
+				out << "-";
+			}
+			out << "\n";
+		}
+
+	private:
+		int fd[PerfEventCount];   ///< Counter for each PerfEvent, or -1
+};
+
+#endif // _RIPPER6_PERF_HPP_
@@ -0,0 +1,68 @@
+/**
+ * @file   platform.hpp
+ * @brief  Operating system headers and helpers.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_PLATFORM_HPP_
+#define _RIPPER6_PLATFORM_HPP_
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <stdint.h>
+#include <algorithm> // std::max
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+#include <string>
+
+#ifdef _WIN32
+inline std::string GetLastErrorAsString()
+{
+	DWORD error = GetLastError();
+	if (error) {
+		LPVOID lpMsgBuf;
+		DWORD bufLen = FormatMessage(
+			FORMAT_MESSAGE_ALLOCATE_BUFFER |
+			FORMAT_MESSAGE_FROM_SYSTEM |
+			FORMAT_MESSAGE_IGNORE_INSERTS,
+			NULL,
+			error,
+			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+			(LPTSTR)&lpMsgBuf,
+			0,
+			NULL
+		);
+		if (bufLen) {
+			LPCSTR lpMsgStr = (LPCSTR)lpMsgBuf;
+			std::string result(lpMsgStr, lpMsgStr + bufLen);
+			LocalFree(lpMsgBuf);
+			return result;
+		}
+	}
+	return std::string();
+}
+#endif
+
+#endif // _RIPPER6_PLATFORM_HPP_
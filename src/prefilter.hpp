@@ -0,0 +1,174 @@
+/**
+ * @file   prefilter.hpp
+ * @brief  Cheap test to decide which checkers are worth calling at an offset.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_PREFILTER_HPP_
+#define _RIPPER6_PREFILTER_HPP_
+
+#include <vector>
+#include "checkers.hpp"
+
+/// Set of checkers, one bit per index into the list given to the Prefilter.
+typedef uint64_t CheckerSet;
+
+/// Largest number of checkers that will fit in a CheckerSet.
+#define PREFILTER_MAX_CHECKERS 64
+
+/// Picks out the checkers that could possibly match at each offset.
+/**
+ * Every checker with a Signature is grouped by the offset of its magic bytes,
+ * and a table for each of these offsets maps the byte found there to the
+ * checkers whose magic starts with that byte (or, for a signature given as a
+ * range, whose range includes it).  A second table does the same
+ * for the byte after it, which thins out the candidates further when many
+ * checkers share an offset.  At each offset this costs two table lookups per
+ * distinct magic offset (usually only one or two), rather than one function
+ * call per checker.
+ *
+ * Checkers without a signature are always returned as candidates.
+ */
+class Prefilter
+{
+	public:
+		/// Build the lookup tables.
+		/**
+		 * @param list
+		 *   Checkers to consider, in priority order.  Bit n of the CheckerSet
+		 *   values returned by candidates() refers to list[n].  No more than
+		 *   PREFILTER_MAX_CHECKERS entries are used.
+		 */
+		Prefilter(const std::vector<Checker>& list)
+			:	always(0)
+		{
+			unsigned int count = std::min<size_t>(list.size(), PREFILTER_MAX_CHECKERS);
+			for (unsigned int i = 0; i < count; i++) {
+				CheckerSet bit = (CheckerSet)1 << i;
+				if (list[i].sigs) {
+					for (std::vector<Signature>::const_iterator
+						s = list[i].sigs->begin(); s != list[i].sigs->end(); s++
+					) {
+						this->add(*s, bit);
+					}
+				} else {
+					this->add(list[i].sig, bit);
+				}
+			}
+		}
+
+		/// Find the checkers that might match at this offset.
+		/**
+		 * @param content
+		 *   Candidate offset.
+		 *
+		 * @param len
+		 *   Bytes available at content.
+		 *
+		 * @return Checkers to call, lowest bit first.
+		 */
+		inline CheckerSet candidates(const uint8_t *content, unsigned long len) const
+		{
+			CheckerSet c = this->always;
+			for (std::vector<Anchor>::const_iterator
+				a = this->anchors.begin(); a != this->anchors.end(); a++
+			) {
+				// Near the end these read the padding, which at worst lets
+				// through a checker that will then reject the offset
+				CheckerSet m = a->byByte[content[a->offset]];
+				if (m) m &= a->bySecond[content[a->offset + 1]];
+				c |= m;
+			}
+			return c;
+		}
+
+		/// Find the next offset where any checker might match.
+		/**
+		 * @param content
+		 *   The input.
+		 *
+		 * @param size
+		 *   Length of the input.
+		 *
+		 * @param pos
+		 *   Offset to start at.
+		 *
+		 * @param end
+		 *   Offset to stop at.
+		 *
+		 * @return Offset of the first candidate, or end if there is none.
+		 */
+		unsigned long long skip(const uint8_t *content, unsigned long long size,
+			unsigned long long pos, unsigned long long end) const
+		{
+			if (this->always) return pos;
+			if (this->anchors.size() == 1) {
+				// Only two bytes to look at for each offset
+				const Anchor& a = this->anchors[0];
+				const uint8_t *p = content + a.offset;
+				for (; pos < end; pos++) {
+					if (a.byByte[p[pos]] & a.bySecond[p[pos + 1]]) return pos;
+				}
+				return pos;
+			}
+			for (; pos < end; pos++) {
+				if (this->candidates(content + pos, size - pos)) return pos;
+			}
+			return pos;
+		}
+
+	private:
+		/// Add one signature for the checkers in bit.
+		void add(const Signature& sig, CheckerSet bit)
+		{
+			if (sig.len == 0) {
+				this->always |= bit;
+				return;
+			}
+			std::vector<Anchor>::iterator a = this->anchors.begin();
+			while ((a != this->anchors.end()) && (a->offset != sig.offset)) a++;
+			if (a == this->anchors.end()) {
+				Anchor n;
+				n.offset = sig.offset;
+				for (unsigned int b = 0; b < 256; b++) {
+					n.byByte[b] = 0;
+					n.bySecond[b] = 0;
+				}
+				a = this->anchors.insert(this->anchors.end(), n);
+			}
+			const uint8_t *upper = sig.upper ? sig.upper : sig.magic;
+			for (unsigned int b = sig.magic[0]; b <= upper[0]; b++) {
+				a->byByte[b] |= bit;
+			}
+			for (unsigned int b = 0; b < 256; b++) {
+				if ((sig.len == 1) || ((b >= sig.magic[1]) && (b <= upper[1]))) {
+					a->bySecond[b] |= bit;
+				}
+			}
+		}
+
+		/// Checkers whose magic bytes are at the same offset.
+		struct Anchor {
+			unsigned int offset;      ///< Offset of the magic bytes
+			CheckerSet byByte[256];   ///< Checkers for each first magic byte
+			CheckerSet bySecond[256]; ///< Checkers for each second magic byte
+		};
+		std::vector<Anchor> anchors;
+		CheckerSet always;            ///< Checkers without a signature
+};
+
+#endif // _RIPPER6_PREFILTER_HPP_
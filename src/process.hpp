@@ -0,0 +1,181 @@
+/**
+ * @file   process.hpp
+ * @brief  Read the memory of another running process.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_PROCESS_HPP_
+#define _RIPPER6_PROCESS_HPP_
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "platform.hpp"
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+/// Amount of a process's memory searched at once.
+#define PROCESS_BATCH_SIZE (64 * 1024 * 1024)
+
+/// Memory read past the end of each batch, for matches that start near the
+/// end of it.  This is the largest file most of the checkers will accept.
+#define PROCESS_OVERLAP (16 * 1024 * 1024)
+
+/// One readable area of a process's address space.
+struct MemoryRegion {
+	unsigned long long start;   ///< First address
+	unsigned long long end;     ///< Address after the last byte
+	std::string name;           ///< File mapped there, or e.g. "[heap]"
+};
+
+/// The address space of another process.
+/**
+ * Memory is copied out of the process with process_vm_readv(), or through
+ * /proc/PID/mem on kernels without it.  Either way the caller needs the same
+ * permission as a debugger would, so normally it must be root or the same
+ * user as the process.
+ *
+ * This is only available on Linux.
+ */
+class ProcessMemory
+{
+	public:
+		ProcessMemory()
+			:	pid(0),
+				noReadv(false),
+				memFd(-1)
+		{
+		}
+
+		~ProcessMemory()
+		{
+#ifdef __linux__
+			if (this->memFd >= 0) ::close(this->memFd);
+#endif
+		}
+
+		/// Find the readable memory of a process.
+		/**
+		 * @param pid
+		 *   Process to read.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the process cannot be read.
+		 */
+		bool open(unsigned long pid, std::string *error)
+		{
+#ifdef __linux__
+			this->pid = pid;
+			std::ostringstream path;
+			path << "/proc/" << pid << "/maps";
+			std::ifstream maps(path.str().c_str());
+			if (!maps) {
+				*error = "Unable to read " + path.str();
+				return false;
+			}
+			std::string line;
+			while (std::getline(maps, line)) {
+				// start-end perms offset dev inode [name]
+				std::istringstream ss(line);
+				MemoryRegion r;
+				char dash;
+				std::string perms, offset, dev, inode;
+				if (!(ss >> std::hex >> r.start >> dash >> r.end >> perms >> offset
+					>> dev >> inode)) continue;
+				if (perms.empty() || (perms[0] != 'r')) continue;
+				std::getline(ss >> std::ws, r.name);
+				// Reading these fails, or has side effects
+				if ((r.name == "[vvar]") || (r.name == "[vsyscall]")) continue;
+				this->list.push_back(r);
+			}
+			if (this->list.empty()) {
+				*error = "No readable memory in " + path.str();
+				return false;
+			}
+			return true;
+#else
+			*error = "Reading process memory is only supported on Linux";
+			return false;
+#endif
+		}
+
+		/// Readable areas of memory, in address order.
+		const std::vector<MemoryRegion>& regions() const
+		{
+			return this->list;
+		}
+
+		/// Copy memory out of the process.
+		/**
+		 * @param addr
+		 *   Address in the process to start at.
+		 *
+		 * @param buf
+		 *   Where to put the data.
+		 *
+		 * @param len
+		 *   Number of bytes to read.
+		 *
+		 * @return Number of bytes read, which is less than len if some of
+		 *   the memory cannot be read, e.g. because the process has unmapped
+		 *   it since open().
+		 */
+		unsigned long read(unsigned long long addr, uint8_t *buf, unsigned long len)
+		{
+#ifdef __linux__
+			if (!this->noReadv) {
+				struct iovec local, remote;
+				local.iov_base = buf;
+				local.iov_len = len;
+				remote.iov_base = (void *)addr;
+				remote.iov_len = len;
+				ssize_t got = process_vm_readv(this->pid, &local, 1, &remote, 1, 0);
+				if (got >= 0) return got;
+				if (errno == ENOSYS) this->noReadv = true;
+			}
+
+			// This is slower, but unlike process_vm_readv() it reads as far as
+			// it can instead of failing if any page is missing
+			if (this->memFd < 0) {
+				std::ostringstream path;
+				path << "/proc/" << this->pid << "/mem";
+				this->memFd = ::open(path.str().c_str(), O_RDONLY);
+				if (this->memFd < 0) return 0;
+			}
+			unsigned long done = 0;
+			while (done < len) {
+				ssize_t got = pread(this->memFd, buf + done, len - done, addr + done);
+				if (got <= 0) break;
+				done += got;
+			}
+			return done;
+#else
+			return 0;
+#endif
+		}
+
+	private:
+		unsigned long pid;
+		bool noReadv;                     ///< process_vm_readv() is missing
+		int memFd;                        ///< /proc/PID/mem, once it is needed
+		std::vector<MemoryRegion> list;
+};
+
+#endif // _RIPPER6_PROCESS_HPP_
@@ -0,0 +1,220 @@
+/**
+ * @file   profile.hpp
+ * @brief  Checker selection, order and limits loaded from a file.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_PROFILE_HPP_
+#define _RIPPER6_PROFILE_HPP_
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "checkers.hpp"
+
+/// A limit one of the checkers applies, which a profile can change.
+struct CheckerLimit {
+	const char *name;      ///< Name used in profiles
+	unsigned long *value;  ///< Variable the checker reads
+};
+
+/// Every limit that can be changed, and the variable holding it.
+inline const std::vector<CheckerLimit>& checker_limits()
+{
+	static const CheckerLimit list[] = {
+		{"cdfm.max-sample", &cdfm_max_sample_len},
+		{"cdfm.max-size", &cdfm_max_filesize},
+		{"cmf.max-size", &cmf_max_size},
+		{"iff.max-len", &iff_max_len},
+		{"midi.max-tracks", &mid_max_tracks},
+		{"riff.max-len", &riff_max_len},
+		{"voc.max-blocks", &voc_max_blocks},
+	};
+	static const std::vector<CheckerLimit> limits(list,
+		list + sizeof(list) / sizeof(list[0]));
+	return limits;
+}
+
+/// Read the list of checkers given to --formats.
+/**
+ * @param list
+ *   Checker names, separated by commas.
+ *
+ * @param formats
+ *   Set to one entry per checkers[] entry, true for those in the list.
+ *
+ * @param error
+ *   On failure, set to a description of the problem.
+ *
+ * @return false if one of the names is not a checker.
+ */
+inline bool parse_formats(const std::string& list, std::vector<bool> *formats,
+	std::string *error)
+{
+	formats->assign(numCheckers, false);
+	std::istringstream ss(list);
+	std::string name;
+	while (std::getline(ss, name, ',')) {
+		unsigned int c = 0;
+		while ((c < numCheckers) && (name != checkers[c].name)) c++;
+		if (c == numCheckers) {
+			*error = "Unknown format \"" + name + "\".";
+			return false;
+		}
+		(*formats)[c] = true;
+	}
+	return true;
+}
+
+/// Which checkers to use, in what order, and with what limits.
+/**
+ * A profile is a text file, usually written for the files of one particular
+ * game, with one setting per line and # starting a comment:
+ *
+ * @code
+ * formats voc cmf            # Only look for these formats
+ * priority cmf               # Try these first, in this order
+ * limit voc.max-blocks 2048  # Change a checker's limit
+ * @endcode
+ *
+ * Checkers left out of the profile are not given to the Scanner at all, so
+ * they cost nothing during the search.  A profile that changes the priority
+ * order cannot use the fused scan loop, which has the checkers in their
+ * normal order.
+ */
+class Profile
+{
+	public:
+		/// Start with every checker in its normal order.
+		Profile()
+			:	enabled(numCheckers, true)
+		{
+			for (unsigned int c = 0; c < numCheckers; c++) this->order.push_back(c);
+		}
+
+		/// Read a profile, and apply its limits to the checkers.
+		/**
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the file could not be read or is not valid.
+		 */
+		bool load(const char *filename, std::string *error)
+		{
+			std::ifstream f(filename);
+			if (!f) {
+				*error = std::string("Unable to read profile ") + filename;
+				return false;
+			}
+			std::string line;
+			for (unsigned int lineNum = 1; std::getline(f, line); lineNum++) {
+				std::string::size_type hash = line.find('#');
+				if (hash != std::string::npos) line.erase(hash);
+				std::istringstream ss(line);
+				std::string key;
+				if (!(ss >> key)) continue;
+
+				std::ostringstream where;
+				where << filename << " line " << lineNum << ": ";
+				std::string name;
+				if (key == "formats") {
+					this->enabled.assign(numCheckers, false);
+					while (ss >> name) {
+						int c = find_checker(name);
+						if (c < 0) {
+							*error = where.str() + "unknown format \"" + name + "\"";
+							return false;
+						}
+						this->enabled[c] = true;
+					}
+				} else if (key == "priority") {
+					std::vector<unsigned int> first;
+					while (ss >> name) {
+						int c = find_checker(name);
+						if (c < 0) {
+							*error = where.str() + "unknown format \"" + name + "\"";
+							return false;
+						}
+						if (std::find(first.begin(), first.end(), c) == first.end()) {
+							first.push_back(c);
+						}
+					}
+					// The rest carry on in their normal order
+					for (unsigned int c = 0; c < numCheckers; c++) {
+						if (std::find(first.begin(), first.end(), c) == first.end()) {
+							first.push_back(c);
+						}
+					}
+					this->order = first;
+				} else if (key == "limit") {
+					unsigned long value;
+					if (!(ss >> name >> value)) {
+						*error = where.str() + "expected \"limit NAME VALUE\"";
+						return false;
+					}
+					const std::vector<CheckerLimit>& limits = checker_limits();
+					std::vector<CheckerLimit>::const_iterator i = limits.begin();
+					while ((i != limits.end()) && (name != i->name)) i++;
+					if (i == limits.end()) {
+						*error = where.str() + "unknown limit \"" + name + "\"";
+						return false;
+					}
+					*i->value = value;
+				} else {
+					*error = where.str() + "unknown setting \"" + key + "\"";
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/// The checkers to search with, in priority order.
+		/**
+		 * @param formats
+		 *   Checkers chosen on the command line, by index into checkers[],
+		 *   which replace those chosen by the profile.  Empty to use the
+		 *   profile's choice.
+		 */
+		std::vector<Checker> active(const std::vector<bool>& formats) const
+		{
+			std::vector<Checker> list;
+			for (std::vector<unsigned int>::const_iterator
+				c = this->order.begin(); c != this->order.end(); c++
+			) {
+				if (formats.empty() ? this->enabled[*c] : formats[*c]) {
+					list.push_back(checkers[*c]);
+				}
+			}
+			return list;
+		}
+
+	private:
+		std::vector<bool> enabled;         ///< Which checkers[] entries to use
+		std::vector<unsigned int> order;   ///< checkers[] indices, by priority
+
+		/// Index in checkers[] of the named checker, or -1.
+		static int find_checker(const std::string& name)
+		{
+			for (unsigned int c = 0; c < numCheckers; c++) {
+				if (name == checkers[c].name) return c;
+			}
+			return -1;
+		}
+};
+
+#endif // _RIPPER6_PROFILE_HPP_
@@ -0,0 +1,205 @@
+/**
+ * @file   ratelimit.hpp
+ * @brief  Limit how fast the input is read and the matches are written.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_RATELIMIT_HPP_
+#define _RIPPER6_RATELIMIT_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <mutex>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include "trace.hpp"
+
+/// Time the full rate can be exceeded for after being idle, in seconds.
+#define RATELIMIT_BURST 0.25
+
+/// A token bucket, limiting something to a number of units per second.
+/**
+ * Tokens are added at the rate, up to RATELIMIT_BURST seconds' worth.  take()
+ * removes tokens, and may leave the bucket in debt, in which case the caller
+ * sleeps until the debt would be paid off.  A large request is therefore let
+ * through at once but delays the next one, and several threads sharing the
+ * bucket are held to the rate between them.
+ *
+ * The rate can be changed at any time, from any thread.
+ */
+class RateLimit
+{
+	public:
+		RateLimit()
+			:	rate(0),
+				tokens(0),
+				last(std::chrono::steady_clock::now()),
+				waited(0)
+		{
+		}
+
+		/// Change the rate.
+		/**
+		 * @param rate
+		 *   Units per second, or 0 for no limit.
+		 */
+		void setRate(double rate)
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->refill();
+			this->rate = rate;
+			this->tokens = std::min(this->tokens, rate * RATELIMIT_BURST);
+		}
+
+		/// Units per second, or 0 if there is no limit.
+		double getRate() const
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			return this->rate;
+		}
+
+		/// Use up some units, waiting first if the rate has been exceeded.
+		void take(double amount)
+		{
+			double wait;
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				if (this->rate <= 0) return;
+				this->refill();
+				this->tokens -= amount;
+				if (this->tokens >= 0) return;
+				wait = -this->tokens / this->rate;
+				this->waited += wait;
+			}
+			TraceSpan span("throttled");
+			std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+		}
+
+		/// Time spent waiting in take(), added up over every thread.
+		double waitedSeconds() const
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			return this->waited;
+		}
+
+	private:
+		mutable std::mutex mutex;
+		double rate;        ///< Units per second, or 0 for no limit
+		double tokens;      ///< Units available, negative when in debt
+		std::chrono::steady_clock::time_point last;  ///< When tokens was correct
+		double waited;      ///< Seconds spent in take()
+
+		/// Add the tokens earned since the last call.
+		void refill()
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			double elapsed = std::chrono::duration<double>(now - this->last).count();
+			this->tokens = std::min(this->tokens + elapsed * this->rate,
+				this->rate * RATELIMIT_BURST);
+			this->last = now;
+		}
+};
+
+/// Limits on the disk traffic of a search.
+/**
+ * The limits can be kept in a file, which is read again when the program
+ * receives SIGHUP, so they can be changed while a search is running.  The
+ * input and the writers call poll() as they go, which does the reading in
+ * whichever thread gets there first.
+ */
+struct IoLimits {
+	RateLimit read;     ///< Bytes of the input searched per second
+	RateLimit write;    ///< Bytes of matches saved per second
+	RateLimit files;    ///< Matches saved per second
+	std::string filename;  ///< File for poll() to read, if any
+
+	/// Set by the SIGHUP handler to have poll() read the file again.
+	static volatile sig_atomic_t& reloadRequested()
+	{
+		static volatile sig_atomic_t flag = 0;
+		return flag;
+	}
+
+	/// Read the file again if SIGHUP has been received since the last call.
+	void poll()
+	{
+		if (!reloadRequested()) return;
+		reloadRequested() = 0;
+		if (this->filename.empty()) return;
+		std::string error;
+		std::ostringstream msg;
+		if (this->load(this->filename.c_str(), &error)) {
+			msg << "\033[2K\rNew limits from " << this->filename << "\n";
+			std::cout << msg.str() << std::flush;
+		} else {
+			msg << "\033[2K\r" << error << ", keeping the old limits\n";
+			std::cerr << msg.str() << std::flush;
+		}
+	}
+
+	/// Set the limits from a file.
+	/**
+	 * Each line is "read", "write" or "files" followed by the limit, in MB
+	 * per second for the first two.  A limit that is not given, or given as
+	 * 0, is removed.  Blank lines and lines starting with # are ignored.
+	 *
+	 * @param error
+	 *   On failure, set to a description of the problem.
+	 *
+	 * @return false if the file could not be read, leaving the limits as
+	 *   they were.
+	 */
+	bool load(const char *filename, std::string *error)
+	{
+		std::ifstream f(filename);
+		if (!f) {
+			*error = std::string("Unable to read limits from ") + filename;
+			return false;
+		}
+		double r = 0, w = 0, n = 0;
+		std::string line;
+		while (std::getline(f, line)) {
+			if (line.empty() || (line[0] == '#')) continue;
+			std::istringstream ss(line);
+			std::string key;
+			double value;
+			if (!(ss >> key >> value) || (value < 0)) {
+				*error = std::string(filename) + " has an invalid line: " + line;
+				return false;
+			}
+			if (key == "read") {
+				r = value * 1048576;
+			} else if (key == "write") {
+				w = value * 1048576;
+			} else if (key == "files") {
+				n = value;
+			} else {
+				*error = std::string(filename) + " has an unknown limit: " + key;
+				return false;
+			}
+		}
+		this->read.setRate(r);
+		this->write.setRate(w);
+		this->files.setRate(n);
+		return true;
+	}
+};
+
+#endif // _RIPPER6_RATELIMIT_HPP_
@@ -0,0 +1,421 @@
+/**
+ * @file   scanner.hpp
+ * @brief  Runs the checkers at each offset and picks the winning match.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_SCANNER_HPP_
+#define _RIPPER6_SCANNER_HPP_
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include "checkers.hpp"
+#include "fused.hpp"
+#include "prefilter.hpp"
+
+/// Only time one in this many calls to each checker, as timing is expensive.
+#define SCANNER_TIMING_INTERVAL 64
+
+/// Number of offsets between recalculations of the adaptive order.
+#define SCANNER_REORDER_INTERVAL 65536
+
+/// Offsets the fused loop searches at once when there is an extra checker
+/// after it, which is the most work thrown away when the extra one matches.
+#define SCANNER_TAIL_BLOCK 4096
+
+/// What has been seen of one checker so far.
+struct CheckerStats {
+	unsigned long long calls;   ///< Number of times the checker was called
+	unsigned long long hits;    ///< Number of those that matched
+	unsigned long long timed;   ///< Number of calls that were timed
+	double ns;                  ///< Total time of the timed calls
+
+	CheckerStats()
+		:	calls(0),
+			hits(0),
+			timed(0),
+			ns(0)
+	{
+	}
+
+	/// Average time per call in nanoseconds, or 0 if not yet measured.
+	double nsPerCall() const
+	{
+		return this->timed ? this->ns / this->timed : 0;
+	}
+
+	/// Fraction of calls that have matched.
+	double hitRate() const
+	{
+		return this->calls ? (double)this->hits / this->calls : 0;
+	}
+};
+
+/// Decides which checker, if any, matches at an offset.
+/**
+ * Checkers are in priority order: when more than one would match at the same
+ * offset, the one earliest in the list wins.  By default they are simply
+ * called in that order and the first match is taken.
+ *
+ * In adaptive mode the Scanner measures how long each checker takes and how
+ * often it matches, and calls the checkers in whichever order is expected to
+ * find a match for the least cost.  A match from a lower priority checker is
+ * only accepted once every higher priority candidate has also been tried, so
+ * the results are exactly the same as in the default mode.
+ *
+ * In the default mode, when the checkers are some or all of checkers[] in
+ * the same order, next() runs a scan loop generated from AllCheckers with
+ * the checkers inlined, instead of calling them through pointers.  One more
+ * checker that is not in checkers[], such as the one for user signatures, may
+ * come last in the list.  It is tried with its own prefilter over the offsets
+ * the fused loop has passed over, a block at a time.
+ */
+class Scanner
+{
+	public:
+		/// Prepare to scan.
+		/**
+		 * @param list
+		 *   Checkers to use, in priority order.
+		 */
+		Scanner(const std::vector<Checker>& list)
+			:	list(list),
+				prefilter(list),
+				adaptive(false),
+				untilReorder(SCANNER_REORDER_INTERVAL),
+				stats(list.size()),
+				fused(NULL),
+				fusedMask(0),
+				slot(numCheckers, -1),
+				tail(-1),
+				tailFilter(std::vector<Checker>())
+		{
+			for (unsigned int i = 0; i < list.size(); i++) this->order.push_back(i);
+
+			// The fused loop can only be used for checkers in the same order as
+			// checkers[], which is the order AllCheckers has them in
+			unsigned int next = 0;
+			for (unsigned int i = 0; i < list.size(); i++) {
+				while ((next < numCheckers) && (checkers[next].fn != list[i].fn)) next++;
+				if (next == numCheckers) {
+					if (i + 1 != list.size()) return;
+					this->tail = i;
+					this->tailFilter = Prefilter(std::vector<Checker>(1, list[i]));
+					break;
+				}
+				this->fusedMask |= (CheckerSet)1 << next;
+				this->slot[next] = i;
+			}
+			this->fused = select_fused(this->fusedMask);
+		}
+
+		/// Turn adaptive ordering on or off.
+		void setAdaptive(bool adaptive)
+		{
+			this->adaptive = adaptive;
+		}
+
+		/// Find the highest priority match at this offset.
+		/**
+		 * @param content
+		 *   Candidate offset.
+		 *
+		 * @param len
+		 *   Bytes available at content.
+		 *
+		 * @param mc
+		 *   Details of the match, if any.
+		 *
+		 * @return Index of the matching checker, or -1 if none matched.
+		 */
+		inline int matchAt(const uint8_t *content, unsigned long len, Match *mc)
+		{
+			CheckerSet candidates = this->prefilter.candidates(content, len);
+			if (this->adaptive) return this->matchAdaptive(candidates, content, len, mc);
+
+			for (unsigned int c = 0; candidates; c++, candidates >>= 1) {
+				if (!(candidates & 1)) continue;
+				if (this->list[c].fn(content, len, mc)) return c;
+			}
+			return -1;
+		}
+
+		/// Find the first match in a range of offsets.
+		/**
+		 * This gives the same result as calling matchAt() at each offset in
+		 * turn, but is faster when the fused loop can be used.
+		 *
+		 * @param content
+		 *   The input.
+		 *
+		 * @param size
+		 *   Length of the input.  Matches may extend past end, up to here.
+		 *
+		 * @param pos
+		 *   Offset to start at.  Set to the offset of the match, or to end if
+		 *   there is none.
+		 *
+		 * @param end
+		 *   Offset to stop scanning at.
+		 *
+		 * @param mc
+		 *   Details of the match, if any.
+		 *
+		 * @return Index of the matching checker, or -1 if none matched.
+		 */
+		inline int next(const uint8_t *content, unsigned long long size,
+			unsigned long long *pos, unsigned long long end, Match *mc)
+		{
+			if (this->fused && !this->adaptive) {
+				if (this->tail >= 0) return this->nextWithTail(content, size, pos, end, mc);
+				int c = this->fused(content, size, pos, end, mc, this->fusedMask);
+				return c < 0 ? -1 : this->slot[c];
+			}
+			for (; *pos < end; (*pos)++) {
+				int c = this->matchAt(content + *pos, size - *pos, mc);
+				if (c >= 0) return c;
+			}
+			return -1;
+		}
+
+		/// Run only the prefilter over a range of offsets, to profile it.
+		/**
+		 * @return Number of checker calls the prefilter would have made.
+		 */
+		unsigned long long countCandidates(const uint8_t *content,
+			unsigned long long size, unsigned long long start,
+			unsigned long long end) const
+		{
+			unsigned long long calls = 0;
+			for (unsigned long long p = start; p < end; p++) {
+				CheckerSet c = this->prefilter.candidates(content + p, size - p);
+				for (; c; c &= c - 1) calls++;
+			}
+			return calls;
+		}
+
+		/// Will next() use the fused loop?
+		bool isFused() const
+		{
+			return this->fused && !this->adaptive;
+		}
+
+		/// Load statistics saved from an earlier run with saveStats().
+		/**
+		 * The order is recalculated straight away, so the scan starts off with
+		 * the best order from the earlier run.
+		 *
+		 * @return false if the file could not be read.
+		 */
+		bool loadStats(const char *filename)
+		{
+			std::ifstream f(filename);
+			if (!f) return false;
+			std::string line;
+			while (std::getline(f, line)) {
+				if (line.empty() || (line[0] == '#')) continue;
+				std::istringstream ss(line);
+				std::string name;
+				CheckerStats s;
+				double nsPerCall;
+				if (!(ss >> name >> s.calls >> s.hits >> nsPerCall)) continue;
+				for (unsigned int i = 0; i < this->list.size(); i++) {
+					if (name != this->list[i].name) continue;
+					s.timed = s.calls / SCANNER_TIMING_INTERVAL + 1;
+					s.ns = nsPerCall * s.timed;
+					this->stats[i] = s;
+					break;
+				}
+			}
+			this->reorder();
+			return true;
+		}
+
+		/// Save the statistics gathered so far, for loadStats() in a later run.
+		/**
+		 * @return false if the file could not be written.
+		 */
+		bool saveStats(const char *filename) const
+		{
+			std::ofstream f(filename);
+			if (!f) return false;
+			f << "# ripper6 checker statistics: name, calls, hits, ns per call\n";
+			for (unsigned int i = 0; i < this->list.size(); i++) {
+				const CheckerStats& s = this->stats[i];
+				f << this->list[i].name << ' ' << s.calls << ' ' << s.hits << ' '
+					<< std::fixed << std::setprecision(3) << s.nsPerCall() << "\n";
+			}
+			return f.good();
+		}
+
+		/// Add the statistics another Scanner has gathered since it was copied.
+		/**
+		 * This combines the results of Scanners that have been running on
+		 * separate threads.
+		 *
+		 * @param other
+		 *   Scanner with the same checker list.
+		 *
+		 * @param base
+		 *   Scanner that other was copied from, whose statistics are not added
+		 *   again.
+		 */
+		void addStats(const Scanner& other, const Scanner& base)
+		{
+			for (unsigned int i = 0; i < this->stats.size(); i++) {
+				const CheckerStats& o = other.stats[i];
+				const CheckerStats& b = base.stats[i];
+				CheckerStats& s = this->stats[i];
+				s.calls += o.calls - b.calls;
+				s.hits += o.hits - b.hits;
+				s.timed += o.timed - b.timed;
+				s.ns += o.ns - b.ns;
+			}
+			this->reorder();
+		}
+
+		/// Write a table of the statistics, in the current order.
+		void reportStats(std::ostream& out) const
+		{
+			out << "Checker order:\n";
+			for (std::vector<unsigned int>::const_iterator
+				i = this->order.begin(); i != this->order.end(); i++
+			) {
+				const CheckerStats& s = this->stats[*i];
+				out << "  " << std::left << std::setw(8) << this->list[*i].name
+					<< std::right << std::setw(14) << s.calls << " calls"
+					<< std::setw(10) << s.hits << " hits"
+					<< std::fixed << std::setprecision(1) << std::setw(10)
+					<< s.nsPerCall() << " ns/call\n";
+			}
+		}
+
+	private:
+		std::vector<Checker> list;
+		Prefilter prefilter;
+		bool adaptive;
+		std::vector<unsigned int> order;  ///< Checker indices in calling order
+		unsigned long untilReorder;       ///< Offsets left before reorder()
+		std::vector<CheckerStats> stats;  ///< One entry per checker in list
+		Match trial;                      ///< Match being tried in adaptive mode
+		FusedScan fused;                  ///< Loop for next(), or NULL
+		CheckerSet fusedMask;             ///< Checkers used, by checkers[] index
+		std::vector<int> slot;            ///< Index in list of each checkers[]
+		int tail;                         ///< Index of the extra checker, or -1
+		Prefilter tailFilter;             ///< Prefilter for just the tail
+
+		/// next() for the fused loop followed by the tail checker.
+		int nextWithTail(const uint8_t *content, unsigned long long size,
+			unsigned long long *pos, unsigned long long end, Match *mc)
+		{
+			const Checker& t = this->list[this->tail];
+			while (*pos < end) {
+				unsigned long long blockEnd = std::min<unsigned long long>(
+					*pos + SCANNER_TAIL_BLOCK, end);
+				unsigned long long p = *pos;
+				int c = this->fused(content, size, &p, blockEnd, mc, this->fusedMask);
+				// The tail has the lowest priority, so only offsets before a
+				// match from the fused loop are left for it
+				for (unsigned long long q = *pos;
+					(q = this->tailFilter.skip(content, size, q, p)) < p; q++
+				) {
+					if (t.fn(content + q, size - q, &this->trial)) {
+						*mc = this->trial;
+						*pos = q;
+						return this->tail;
+					}
+				}
+				*pos = p;
+				if (c >= 0) return this->slot[c];
+			}
+			return -1;
+		}
+
+		int matchAdaptive(CheckerSet candidates, const uint8_t *content,
+			unsigned long len, Match *mc)
+		{
+			if (--this->untilReorder == 0) this->reorder();
+			if (!candidates) return -1;
+
+			int winner = -1;
+			for (std::vector<unsigned int>::const_iterator
+				i = this->order.begin(); i != this->order.end(); i++
+			) {
+				CheckerSet bit = (CheckerSet)1 << *i;
+				if (!(candidates & bit)) continue;
+				candidates &= ~bit;
+
+				if (this->call(*i, content, len)) {
+					*mc = this->trial;
+					winner = *i;
+					// Only higher priority checkers could still take precedence
+					candidates &= bit - 1;
+				}
+				if (!candidates) break;
+			}
+			return winner;
+		}
+
+		/// Call one checker and update its statistics.
+		inline bool call(unsigned int i, const uint8_t *content, unsigned long len)
+		{
+			CheckerStats& s = this->stats[i];
+			bool matched;
+			if (s.calls++ % SCANNER_TIMING_INTERVAL == 0) {
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				matched = this->list[i].fn(content, len, &this->trial);
+				std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+				s.ns += std::chrono::duration<double, std::nano>(stop - start).count();
+				s.timed++;
+			} else {
+				matched = this->list[i].fn(content, len, &this->trial);
+			}
+			if (matched) s.hits++;
+			return matched;
+		}
+
+		/// Sort the checkers so the cheapest way to find a match comes first.
+		/**
+		 * Checkers are ordered by their cost per match (time per call divided
+		 * by the chance of a match), so those that match often and cheaply
+		 * are tried first and can save calling the others.  Checkers that have
+		 * never matched go last, cheapest first.
+		 */
+		void reorder()
+		{
+			this->untilReorder = SCANNER_REORDER_INTERVAL;
+			typedef std::pair<bool, double> Score; // never matched, cost
+			std::vector<std::pair<Score, unsigned int> > rank;
+			for (unsigned int i = 0; i < this->list.size(); i++) {
+				const CheckerStats& s = this->stats[i];
+				double cost = s.nsPerCall();
+				if (s.hits) cost /= s.hitRate();
+				rank.push_back(std::make_pair(Score(s.hits == 0, cost), i));
+			}
+			// Ties keep priority order
+			std::sort(rank.begin(), rank.end());
+			for (unsigned int i = 0; i < rank.size(); i++) {
+				this->order[i] = rank[i].second;
+			}
+		}
+};
+
+#endif // _RIPPER6_SCANNER_HPP_
@@ -0,0 +1,356 @@
+/**
+ * @file   signature.hpp
+ * @brief  Formats described on the command line by their magic bytes.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_SIGNATURE_HPP_
+#define _RIPPER6_SIGNATURE_HPP_
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "checkers.hpp"
+#include "manifest.hpp"
+
+/// Largest file a user signature accepts unless it sets max.
+#define SIGNATURE_DEFAULT_MAX 16777216
+
+/// A format that has magic bytes and a length field, described at run time.
+/**
+ * This is the same check a Format type does for the built-in checkers, with
+ * the details read from a string such as:
+ *
+ * @code
+ * ext=dat,magic=DATA\x1A,len=4:4le,bias=8,max=1048576,desc=Game data
+ * @endcode
+ */
+struct UserSignature {
+	std::vector<uint8_t> magic;   ///< Magic bytes
+	unsigned int offset;          ///< Offset of the magic bytes in the file
+	unsigned int lenOffset;       ///< Offset of the length field
+	unsigned int lenWidth;        ///< Size of the length field, 0 for size
+	Endian lenEndian;             ///< Byte order of the length field
+	long bias;                    ///< Added to the length field
+	unsigned long size;           ///< Length of every file if lenWidth is 0
+	unsigned long maxLen;         ///< Largest file to accept
+	FormatId format;              ///< Format reported for a match
+
+	/// Does the file at content match?
+	/**
+	 * @param lenTotal
+	 *   On success, set to the length of the file.
+	 */
+	bool check(const uint8_t *content, unsigned long len,
+		unsigned long *lenTotal) const
+	{
+		unsigned long lenHead = std::max<unsigned long>(
+			this->offset + this->magic.size(), this->lenOffset + this->lenWidth);
+		// Reading the header past len is safe, see UserSignatures::add()
+		if (memcmp(content + this->offset, &this->magic[0], this->magic.size())) {
+			return false;
+		}
+		long long total;
+		const uint8_t *p = content + this->lenOffset;
+		bool le = this->lenEndian == LittleEndian;
+		switch (this->lenWidth) {
+			case 0: total = this->size; break;
+			case 1: total = *p; break;
+			case 2: total = le ? as_u16le(p) : as_u16be(p); break;
+			default: total = le ? as_u32le(p) : as_u32be(p); break;
+		}
+		total += this->bias;
+		if (total < (long long)lenHead) total = lenHead;
+		if ((unsigned long long)total > this->maxLen) return false;
+		if ((unsigned long long)total > len) return false;
+		*lenTotal = total;
+		return true;
+	}
+};
+
+/// Every user signature, searched for by one extra checker.
+/**
+ * All the signatures share one Checker, whose signature list is given to the
+ * Prefilter, so the prefilter only calls the checker at offsets where one of
+ * the signatures could match.  The checker then uses its own table in the
+ * same way, to only try the signatures whose first magic byte is there.  This
+ * keeps the cost per byte low however many signatures there are.
+ *
+ * When more than one signature matches at the same offset, the one given
+ * first wins.
+ */
+class UserSignatures
+{
+	public:
+		/// The signatures in use by check_user().
+		static UserSignatures& instance()
+		{
+			static UserSignatures sigs;
+			return sigs;
+		}
+
+		/// Add a signature from its description.
+		/**
+		 * @param spec
+		 *   Comma separated key=value pairs, as described in the README.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the description is not valid.
+		 */
+		bool add(const std::string& spec, std::string *error)
+		{
+			UserSignature s;
+			s.offset = 0;
+			s.lenOffset = 0;
+			s.lenWidth = 0;
+			s.lenEndian = LittleEndian;
+			s.bias = 0;
+			s.size = 0;
+			s.maxLen = SIGNATURE_DEFAULT_MAX;
+			std::string ext, desc;
+			check::MatchCategory cat = check::Other;
+			bool haveLen = false;
+
+			std::istringstream ss(spec);
+			std::string field;
+			while (std::getline(ss, field, ',')) {
+				std::string::size_type eq = field.find('=');
+				if (eq == std::string::npos) {
+					*error = "Expected key=value in signature: " + field;
+					return false;
+				}
+				std::string key = field.substr(0, eq);
+				std::string value = field.substr(eq + 1);
+				char *end;
+				if (key == "ext") {
+					ext = value;
+				} else if (key == "desc") {
+					desc = value;
+				} else if (key == "cat") {
+					unsigned int c = check::Unknown;
+					while ((c <= check::Other)
+						&& (value != category_name((check::MatchCategory)c))
+					) {
+						c++;
+					}
+					if (c > check::Other) {
+						*error = "Unknown category in signature: " + value;
+						return false;
+					}
+					cat = (check::MatchCategory)c;
+				} else if (key == "magic") {
+					if (!unescape(value, &s.magic)) {
+						*error = "Invalid escape in signature magic: " + value;
+						return false;
+					}
+				} else if (key == "offset") {
+					s.offset = strtoul(value.c_str(), NULL, 0);
+				} else if (key == "len") {
+					// OFFSET:WIDTH followed by le or be
+					s.lenOffset = strtoul(value.c_str(), &end, 0);
+					if (*end == ':') s.lenWidth = strtoul(end + 1, &end, 10);
+					std::string order = end;
+					if (((s.lenWidth != 1) && (s.lenWidth != 2) && (s.lenWidth != 4))
+						|| ((order != "le") && (order != "be") && (order != ""))
+					) {
+						*error = "Signature length field must be OFFSET:WIDTH then le "
+							"or be, with a width of 1, 2 or 4: " + value;
+						return false;
+					}
+					s.lenEndian = order == "be" ? BigEndian : LittleEndian;
+					haveLen = true;
+				} else if (key == "size") {
+					s.size = strtoul(value.c_str(), NULL, 0);
+					haveLen = true;
+				} else if (key == "bias") {
+					s.bias = strtol(value.c_str(), NULL, 0);
+				} else if (key == "max") {
+					s.maxLen = strtoul(value.c_str(), NULL, 0);
+				} else {
+					*error = "Unknown key in signature: " + key;
+					return false;
+				}
+			}
+			if (ext.empty() || s.magic.empty() || !haveLen) {
+				*error = "A signature needs at least ext, magic and len or size: "
+					+ spec;
+				return false;
+			}
+			// The checker and prefilter read these without checking the length,
+			// which is only safe as far as the padding goes.  The prefilter
+			// also reads the byte after a single magic byte.
+			if ((s.offset + std::max<unsigned long>(s.magic.size(), 2) > CHECK_PADDING)
+				|| (s.lenOffset + s.lenWidth > CHECK_PADDING)
+			) {
+				std::ostringstream ss;
+				ss << "The magic and length field of a signature must be in the "
+					"first " << CHECK_PADDING << " bytes: " << spec;
+				*error = ss.str();
+				return false;
+			}
+			if (desc.empty()) desc = "User signature " + ext;
+			s.format = add_user_format(cat, ext, desc);
+			this->specList.push_back(spec);
+
+			unsigned int index = this->list.size();
+			this->list.push_back(s);
+			Signature sig;
+			sig.offset = s.offset;
+			sig.len = s.magic.size();
+			sig.magic = NULL; // Set by checker(), once list stops moving
+			sig.upper = NULL;
+			this->sigs.push_back(sig);
+
+			std::vector<Anchor>::iterator a = this->anchors.begin();
+			while ((a != this->anchors.end()) && (a->offset != s.offset)) a++;
+			if (a == this->anchors.end()) {
+				a = this->anchors.insert(this->anchors.end(), Anchor());
+				a->offset = s.offset;
+				a->pairs.assign(65536 / 8, 0);
+			}
+			a->byByte[s.magic[0]].push_back(index);
+			for (unsigned int b = 0; b < 256; b++) {
+				if ((s.magic.size() > 1) && (b != s.magic[1])) continue;
+				unsigned int pair = (s.magic[0] << 8) | b;
+				a->pairs[pair >> 3] |= 1 << (pair & 7);
+			}
+			return true;
+		}
+
+		/// Add every signature in a file, one per line.
+		/**
+		 * Blank lines and lines starting with # are ignored.
+		 *
+		 * @return false if the file cannot be read or a signature is invalid.
+		 */
+		bool load(const char *filename, std::string *error)
+		{
+			std::ifstream f(filename);
+			if (!f) {
+				*error = std::string("Unable to read signatures from ") + filename;
+				return false;
+			}
+			std::string line;
+			while (std::getline(f, line)) {
+				if (!line.empty() && (line[line.length() - 1] == '\r')) {
+					line.erase(line.length() - 1);
+				}
+				if (line.empty() || (line[0] == '#')) continue;
+				if (!this->add(line, error)) return false;
+			}
+			return true;
+		}
+
+		bool empty() const
+		{
+			return this->list.empty();
+		}
+
+		/// Descriptions passed to add(), in order.
+		const std::vector<std::string>& specs() const
+		{
+			return this->specList;
+		}
+
+		/// The checker that searches for every signature.
+		Checker checker()
+		{
+			for (unsigned int i = 0; i < this->sigs.size(); i++) {
+				this->sigs[i].magic = &this->list[i].magic[0];
+			}
+			Checker c = {"user", check_user, NO_SIGNATURE, &this->sigs};
+			return c;
+		}
+
+		/// Find the first signature that matches at this offset.
+		bool match(const uint8_t *content, unsigned long len, Match *mc) const
+		{
+			unsigned int best = this->list.size();
+			unsigned long bestLen = 0;
+			for (std::vector<Anchor>::const_iterator
+				a = this->anchors.begin(); a != this->anchors.end(); a++
+			) {
+				// Most offsets the prefilter lets through fail on the second byte
+				unsigned int pair = (content[a->offset] << 8) | content[a->offset + 1];
+				if (!(a->pairs[pair >> 3] & (1 << (pair & 7)))) continue;
+				const std::vector<unsigned int>& c = a->byByte[content[a->offset]];
+				// Lowest index first, so stop at the first match
+				for (std::vector<unsigned int>::const_iterator
+					i = c.begin(); (i != c.end()) && (*i < best); i++
+				) {
+					unsigned long lenTotal;
+					if (this->list[*i].check(content, len, &lenTotal)) {
+						best = *i;
+						bestLen = lenTotal;
+						break;
+					}
+				}
+			}
+			if (best == this->list.size()) return false;
+			mc->found(this->list[best].format);
+			mc->len = bestLen;
+			return true;
+		}
+
+	private:
+		/// Signatures whose magic bytes are at the same offset.
+		struct Anchor {
+			unsigned int offset;
+			std::vector<unsigned int> byByte[256];  ///< Indices in list
+			std::vector<uint8_t> pairs;  ///< Bit set for each first two bytes
+		};
+		std::vector<UserSignature> list;
+		std::vector<Signature> sigs;      ///< For the Prefilter
+		std::vector<Anchor> anchors;
+		std::vector<std::string> specList;
+
+		/// CheckFunction for every signature.
+		static bool check_user(const uint8_t *content, unsigned long len,
+			Match *mc)
+		{
+			return instance().match(content, len, mc);
+		}
+
+		/// Convert a string with \\xNN and \\\\ escapes into bytes.
+		static bool unescape(const std::string& s, std::vector<uint8_t> *out)
+		{
+			out->clear();
+			for (std::string::size_type i = 0; i < s.length(); i++) {
+				if (s[i] != '\\') {
+					out->push_back(s[i]);
+				} else if ((i + 1 < s.length()) && (s[i + 1] == '\\')) {
+					out->push_back('\\');
+					i++;
+				} else if ((i + 3 < s.length()) && (s[i + 1] == 'x')) {
+					std::string hex = s.substr(i + 2, 2);
+					char *end;
+					unsigned long v = strtoul(hex.c_str(), &end, 16);
+					if (*end || (hex.length() != 2)) return false;
+					out->push_back(v);
+					i += 3;
+				} else {
+					return false;
+				}
+			}
+			return true;
+		}
+};
+
+#endif // _RIPPER6_SIGNATURE_HPP_
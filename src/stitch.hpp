@@ -0,0 +1,157 @@
+/**
+ * @file   stitch.hpp
+ * @brief  Combine matches found in separate parts of the input.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_STITCH_HPP_
+#define _RIPPER6_STITCH_HPP_
+
+#include <algorithm>
+#include <vector>
+#include "manifest.hpp"
+#include "scanner.hpp"
+
+/// Turns the matches found in consecutive parts of the input into the
+/// matches a single scan of the whole input would have found.
+/**
+ * A scan looks at every offset except those inside a match, which it skips.
+ * When a part is scanned on its own, its first offsets may really be inside
+ * a match from the previous part, so some of its matches must be dropped.
+ * Once the part's scan and the single scan have both looked at the same
+ * offset they make exactly the same decisions from then on, so the rest of
+ * the part's matches can be used as they are.
+ *
+ * If the single scan carries on from inside one of the part's matches, the
+ * input between there and the first offset both scans look at is scanned
+ * again here.  This is never more than the length of a match.
+ */
+class Stitcher
+{
+	public:
+		unsigned long rescanned;  ///< Matches found by scanning again
+		unsigned long dropped;    ///< Matches from parts that were not used
+
+		/// Prepare to stitch parts together.
+		/**
+		 * @param scanner
+		 *   Scanner for searching gaps again, or NULL if this is not possible,
+		 *   in which case add() fails when it is needed.
+		 *
+		 * @param content
+		 *   The input, for the scanner.
+		 *
+		 * @param size
+		 *   Length of the input.
+		 *
+		 * @param pos
+		 *   Offset the single scan starts at.
+		 */
+		Stitcher(Scanner *scanner, const uint8_t *content,
+			unsigned long long size, unsigned long long pos)
+			:	rescanned(0),
+				dropped(0),
+				scanner(scanner),
+				content(content),
+				size(size),
+				pos(pos)
+		{
+		}
+
+		/// Add the next part of the input.
+		/**
+		 * Parts must be added in order, and must leave no gaps.
+		 *
+		 * @param part
+		 *   Range scanned and the matches found in it, in order.
+		 *
+		 * @param keep
+		 *   Matches the single scan would find are appended here.  Those found
+		 *   by scanning again have an empty filename.
+		 *
+		 * @param drop
+		 *   Matches from part that are not used are appended here.
+		 *
+		 * @return false if part of the input needed to be scanned again but
+		 *   there is no scanner.
+		 */
+		bool add(const Manifest& part, std::vector<ManifestEntry> *keep,
+			std::vector<ManifestEntry> *drop)
+		{
+			unsigned long long end = part.start + part.len;
+			if (this->pos < part.start) this->pos = part.start;
+
+			while ((this->pos < end) && !visits(part, this->pos)) {
+				if (!this->scanner) return false;
+				Match match;
+				const uint8_t *cp = this->content + this->pos;
+				if (this->scanner->matchAt(cp, this->size - this->pos, &match) < 0) {
+					this->pos++;
+					continue;
+				}
+				keep->push_back(ManifestEntry(this->pos, match));
+				this->rescanned++;
+				this->pos += match.len;
+			}
+
+			for (std::vector<ManifestEntry>::const_iterator
+				i = part.matches.begin(); i != part.matches.end(); i++
+			) {
+				if (i->offset < this->pos) {
+					// Inside a match the single scan found earlier
+					drop->push_back(*i);
+					this->dropped++;
+					continue;
+				}
+				keep->push_back(*i);
+				this->pos = i->offset + i->len;
+			}
+			if (this->pos < end) this->pos = end;
+			return true;
+		}
+
+		/// Offset the single scan has reached.
+		unsigned long long position() const
+		{
+			return this->pos;
+		}
+
+	private:
+		Scanner *scanner;
+		const uint8_t *content;
+		unsigned long long size;
+		unsigned long long pos;
+
+		static bool before(const ManifestEntry& m, unsigned long long offset)
+		{
+			return m.offset < offset;
+		}
+
+		/// Does the part's scan look at this offset?
+		static bool visits(const Manifest& part, unsigned long long offset)
+		{
+			// Matches never overlap, so only the last one before offset can
+			// cover it
+			std::vector<ManifestEntry>::const_iterator i = std::lower_bound(
+				part.matches.begin(), part.matches.end(), offset, before);
+			if (i == part.matches.begin()) return true;
+			i--;
+			return i->offset + i->len <= offset;
+		}
+};
+
+#endif // _RIPPER6_STITCH_HPP_
@@ -0,0 +1,215 @@
+/**
+ * @file   survey.hpp
+ * @brief  Estimate what a search would find from a sample of the input.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_SURVEY_HPP_
+#define _RIPPER6_SURVEY_HPP_
+
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <random>
+#include <vector>
+#include "check.hpp"
+#include "manifest.hpp"
+
+/// Default size of each block searched by a survey, in kB.
+#define SURVEY_DEFAULT_BLOCK 64
+
+/// Number of standard deviations either side of an estimate for a 95%
+/// confidence interval.
+#define SURVEY_Z 1.96
+
+/// Number of each category, for counting matches by category.
+#define SURVEY_CATEGORIES (check::Other + 1)
+
+/// Estimates the number of matches in the input from a sample of blocks.
+/**
+ * The input is divided into blocks, and the blocks into as many equal groups
+ * (strata) as there are blocks to search.  One block is chosen at random from
+ * each group, so the sample is spread over the whole input but still random,
+ * and an image that holds different things in different areas is sampled
+ * from each area.
+ *
+ * A block is searched like the whole input would be, and a match is counted
+ * in the block it starts in, even if it runs on past the end of it.  The
+ * total for each format is then the average per block times the number of
+ * blocks.  The interval given with it uses the variance for a simple random
+ * sample, which overstates the uncertainty of a stratified one a little, so
+ * it errs on the side of being too wide.
+ */
+class Survey
+{
+	public:
+		/// Choose the blocks to search.
+		/**
+		 * @param start
+		 *   First offset to survey.
+		 *
+		 * @param len
+		 *   Number of offsets to survey.
+		 *
+		 * @param blockSize
+		 *   Size of each block.
+		 *
+		 * @param fraction
+		 *   Part of the blocks to search, greater than 0 and at most 1.
+		 *
+		 * @param seed
+		 *   Seed for choosing the blocks, so a survey can be repeated.
+		 */
+		Survey(unsigned long long start, unsigned long long len,
+			unsigned long long blockSize, double fraction, unsigned long long seed)
+			:	numBlocks((len + blockSize - 1) / blockSize),
+				byFormat(format_count()),
+				byCategory(SURVEY_CATEGORIES)
+		{
+			unsigned long long k = (unsigned long long)std::ceil(
+				fraction * this->numBlocks);
+			if (k < 1) k = 1;
+			if (k > this->numBlocks) k = this->numBlocks;
+			std::mt19937_64 rng(seed);
+			for (unsigned long long s = 0; s < k; s++) {
+				unsigned long long first = this->numBlocks * s / k;
+				unsigned long long count = this->numBlocks * (s + 1) / k - first;
+				this->list.push_back(start + (first + rng() % count) * blockSize);
+			}
+		}
+
+		/// Offset of each block to search, in order.
+		const std::vector<unsigned long long>& blocks() const
+		{
+			return this->list;
+		}
+
+		/// Number of blocks the whole input is divided into.
+		unsigned long long totalBlocks() const
+		{
+			return this->numBlocks;
+		}
+
+		/// Record the matches found in one block.
+		/**
+		 * @param matches
+		 *   Matches starting in the block.
+		 */
+		void add(const std::vector<ManifestEntry>& matches)
+		{
+			std::vector<unsigned long> f(this->byFormat.size(), 0);
+			std::vector<unsigned long> c(SURVEY_CATEGORIES, 0);
+			for (std::vector<ManifestEntry>::const_iterator
+				m = matches.begin(); m != matches.end(); m++
+			) {
+				f[m->format]++;
+				c[m->cat()]++;
+			}
+			for (unsigned int i = 0; i < f.size(); i++) this->byFormat[i].add(f[i]);
+			for (unsigned int i = 0; i < c.size(); i++) this->byCategory[i].add(c[i]);
+		}
+
+		/// Write the estimates.
+		void report(std::ostream& out) const
+		{
+			out << std::left << std::setw(32) << "Format" << std::right
+				<< std::setw(9) << "Sampled" << std::setw(11) << "Estimate"
+				<< "   95% interval\n";
+			bool any = false;
+			for (unsigned int i = FormatUnknown + 1; i < this->byFormat.size(); i++) {
+				const FormatInfo& info = format_info((FormatId)i);
+				std::string name = std::string(info.ext) + " (" + info.desc + ")";
+				any |= this->reportLine(out, name, this->byFormat[i]);
+			}
+			if (!any) out << "(none found in the sample)\n";
+
+			out << "\n" << std::left << std::setw(32) << "Category" << std::right
+				<< std::setw(9) << "Sampled" << std::setw(11) << "Estimate"
+				<< "   95% interval\n";
+			for (unsigned int i = 0; i < SURVEY_CATEGORIES; i++) {
+				this->reportLine(out, category_name((check::MatchCategory)i),
+					this->byCategory[i]);
+			}
+
+			unsigned long long k = this->list.size();
+			if (k < this->numBlocks) {
+				// With none seen in k blocks, the rate is below 3/k with 95%
+				// confidence (the "rule of three")
+				out << "\nA format not seen in the sample could still have up to about "
+					<< (unsigned long long)std::ceil(3.0 * this->numBlocks / k)
+					<< " matches.\n";
+			}
+		}
+
+	private:
+		/// Running totals of the number of matches per block.
+		struct Tally {
+			unsigned long long n;       ///< Blocks added
+			double sum;
+			double sumSq;
+
+			Tally()
+				:	n(0),
+					sum(0),
+					sumSq(0)
+			{
+			}
+
+			void add(unsigned long count)
+			{
+				this->n++;
+				this->sum += count;
+				this->sumSq += (double)count * count;
+			}
+		};
+
+		unsigned long long numBlocks;
+		std::vector<unsigned long long> list;  ///< Offset of each block
+		std::vector<Tally> byFormat;           ///< Indexed by FormatId
+		std::vector<Tally> byCategory;         ///< Indexed by MatchCategory
+
+		/// Write one estimate, if anything was found.
+		/**
+		 * @return false if there were no matches, so nothing was written.
+		 */
+		bool reportLine(std::ostream& out, const std::string& name,
+			const Tally& t) const
+		{
+			if (t.sum == 0) return false;
+			double k = t.n, b = this->numBlocks;
+			double estimate = b * t.sum / k;
+			double sd = 0;
+			if (t.n > 1) {
+				double variance = (t.sumSq - t.sum * t.sum / k) / (k - 1);
+				// Finite population correction, as blocks are not sampled twice
+				sd = b * std::sqrt(std::max(0.0, variance) * (1 - k / b) / k);
+			}
+			// There are at least as many as were actually found
+			double low = std::max(t.sum, estimate - SURVEY_Z * sd);
+			double high = estimate + SURVEY_Z * sd;
+			out << std::left << std::setw(32) << name.substr(0, 31) << std::right
+				<< std::setw(9) << (unsigned long long)t.sum
+				<< std::setw(11) << (unsigned long long)(estimate + 0.5)
+				<< "   " << (unsigned long long)(low + 0.5) << " - "
+				<< (unsigned long long)(high + 0.5);
+			if ((t.n == 1) && (k < b)) out << " (one block, no interval)";
+			out << "\n";
+			return true;
+		}
+};
+
+#endif // _RIPPER6_SURVEY_HPP_
@@ -0,0 +1,310 @@
+/**
+ * @file   trace.hpp
+ * @brief  Timeline of what each thread is doing, for chrome://tracing.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_TRACE_HPP_
+#define _RIPPER6_TRACE_HPP_
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
+
+/// Amount of input covered by each span of a search loop.
+#define TRACE_SEARCH_STEP (1024 * 1024)
+
+/// Track of the main thread.
+#define TRACE_MAIN_TRACK 1
+
+/// Track of the first writer thread, with the others after it.
+#define TRACE_WRITER_TRACK 100
+
+/// Track of the thread searching the first piece of a window, with the
+/// others after it.
+#define TRACE_SEARCH_TRACK 200
+
+/// One thing that happened, as recorded by a thread.
+struct TraceEvent {
+	const char *name;          ///< What happened, which must be a literal
+	char phase;                ///< 'X' for a span of time, 'C' for a counter
+	unsigned long long start;  ///< Nanoseconds since the trace began
+	unsigned long long dur;    ///< Nanoseconds, for a span
+	unsigned long long value;  ///< Bytes dealt with by a span, or the count
+};
+
+/// Events recorded by every thread, written out in the Chrome trace format.
+/**
+ * Each thread appends to its own buffer, so recording an event takes no
+ * locks and never waits for another thread.  The buffers are only read by
+ * write(), once the threads have finished.
+ *
+ * A thread can be given a track with trace_thread(), so the threads the
+ * parallel search starts afresh for each window all appear on the same row
+ * for their piece, and the output can be loaded into chrome://tracing or
+ * https://ui.perfetto.dev.
+ *
+ * When no trace is being recorded current() is NULL, and the helpers below
+ * only test that.
+ */
+class TraceLog
+{
+	public:
+		TraceLog()
+			:	begin(std::chrono::steady_clock::now()),
+				nextTid(1)
+		{
+		}
+
+		~TraceLog()
+		{
+			for (std::vector<Buffer *>::iterator
+				b = this->buffers.begin(); b != this->buffers.end(); b++
+			) {
+				delete *b;
+			}
+		}
+
+		/// The trace being recorded, or NULL if tracing is off.
+		static TraceLog *&current()
+		{
+			static TraceLog *log = NULL;
+			return log;
+		}
+
+		/// Time since the trace began, in nanoseconds.
+		unsigned long long now() const
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - this->begin).count();
+		}
+
+		/// Record an event for the calling thread.
+		void add(const TraceEvent& e)
+		{
+			this->thread()->events.push_back(e);
+		}
+
+		/// Put the calling thread on a track of its own.
+		/**
+		 * @param tid
+		 *   Track number.  Threads given the same number share a track, and
+		 *   must not run at the same time.
+		 *
+		 * @param name
+		 *   Name shown for the track.
+		 */
+		void setThread(unsigned int tid, const std::string& name)
+		{
+			Buffer *b = this->thread();
+			b->tid = tid;
+			b->name = name;
+		}
+
+		/// Write every thread's events as a Chrome trace file.
+		/**
+		 * Every thread that recorded anything must have finished.
+		 *
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the file could not be written.
+		 */
+		bool write(const std::string& filename, std::string *error) const
+		{
+			std::ofstream f(filename.c_str(), std::ios::binary | std::ios::trunc);
+			f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+				<< std::fixed << std::setprecision(3);
+			bool first = true;
+			std::set<unsigned int> named;
+			for (std::vector<Buffer *>::const_iterator
+				b = this->buffers.begin(); b != this->buffers.end(); b++
+			) {
+				const Buffer& buf = **b;
+				if (named.insert(buf.tid).second) {
+					f << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\","
+						"\"pid\":1,\"tid\":" << buf.tid << ",\"args\":{\"name\":\""
+						<< buf.name << "\"}}";
+					first = false;
+				}
+				for (std::vector<TraceEvent>::const_iterator
+					e = buf.events.begin(); e != buf.events.end(); e++
+				) {
+					// Chrome wants microseconds
+					f << ",\n{\"name\":\"" << e->name << "\",\"ph\":\"" << e->phase
+						<< "\",\"pid\":1,\"tid\":" << buf.tid << ",\"ts\":"
+						<< e->start / 1000.0;
+					if (e->phase == 'C') {
+						f << ",\"args\":{\"" << e->name << "\":" << e->value << "}}";
+						continue;
+					}
+					f << ",\"dur\":" << e->dur / 1000.0;
+					if (e->value) f << ",\"args\":{\"bytes\":" << e->value << "}";
+					f << "}";
+				}
+			}
+			f << "\n]}\n";
+			f.flush();
+			if (!f) {
+				*error = "Unable to write trace " + filename;
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		/// Events from one thread.
+		struct Buffer {
+			unsigned int tid;
+			std::string name;
+			std::vector<TraceEvent> events;
+		};
+
+		std::chrono::steady_clock::time_point begin;
+		std::mutex mutex;                ///< Protects buffers and nextTid
+		std::vector<Buffer *> buffers;   ///< In the order threads started
+		unsigned int nextTid;            ///< Track for the next unnamed thread
+
+		/// The calling thread's buffer, which is made on first use.
+		Buffer *thread()
+		{
+			static thread_local Buffer *buf = NULL;
+			if (!buf) {
+				buf = new Buffer();
+				std::lock_guard<std::mutex> lock(this->mutex);
+				buf->tid = this->nextTid++;
+				std::ostringstream name;
+				name << "thread " << buf->tid;
+				buf->name = name.str();
+				this->buffers.push_back(buf);
+			}
+			return buf;
+		}
+};
+
+/// Put the calling thread on its own track, see TraceLog::setThread().
+/**
+ * @param number
+ *   Added to the end of the name, unless it is negative.
+ */
+inline void trace_thread(unsigned int tid, const char *name, int number = -1)
+{
+	TraceLog *log = TraceLog::current();
+	if (!log) return;
+	std::ostringstream ss;
+	ss << name;
+	if (number >= 0) ss << ' ' << number;
+	log->setThread(tid, ss.str());
+}
+
+/// Record the value of a counter, such as the length of a queue.
+inline void trace_counter(const char *name, unsigned long long value)
+{
+	TraceLog *log = TraceLog::current();
+	if (!log) return;
+	TraceEvent e = {name, 'C', log->now(), 0, value};
+	log->add(e);
+}
+
+/// Records the time from its construction to its destruction as a span.
+class TraceSpan
+{
+	public:
+		/**
+		 * @param name
+		 *   What the thread is doing, which must be a literal.
+		 *
+		 * @param bytes
+		 *   Amount of data being dealt with, or 0.
+		 */
+		TraceSpan(const char *name, unsigned long long bytes = 0)
+			:	log(TraceLog::current()),
+				name(name),
+				start(log ? log->now() : 0),
+				bytes(bytes)
+		{
+		}
+
+		~TraceSpan()
+		{
+			if (!this->log) return;
+			TraceEvent e = {this->name, 'X', this->start,
+				this->log->now() - this->start, this->bytes};
+			this->log->add(e);
+		}
+
+	private:
+		TraceLog *log;
+		const char *name;
+		unsigned long long start;
+		unsigned long long bytes;
+};
+
+/// Records a loop that moves through the input as a series of spans.
+/**
+ * Timing the loop in steps of TRACE_SEARCH_STEP keeps the number of events
+ * down for a large input.  Any spans recorded in between, such as for saving
+ * a match, show up nested inside these.
+ */
+class TraceProgress
+{
+	public:
+		/**
+		 * @param name
+		 *   Name of each span, which must be a literal.
+		 *
+		 * @param pos
+		 *   Where the loop starts.
+		 */
+		TraceProgress(const char *name, unsigned long long pos)
+			:	log(TraceLog::current()),
+				name(name),
+				start(log ? log->now() : 0),
+				from(pos)
+		{
+		}
+
+		/// Record a span if the loop has covered another step.
+		inline void advance(unsigned long long pos)
+		{
+			if (this->log && (pos >= this->from + TRACE_SEARCH_STEP)) this->finish(pos);
+		}
+
+		/// Record the span so far, and start another.
+		void finish(unsigned long long pos)
+		{
+			if (!this->log || (pos <= this->from)) return;
+			unsigned long long t = this->log->now();
+			TraceEvent e = {this->name, 'X', this->start, t - this->start,
+				pos - this->from};
+			this->log->add(e);
+			this->start = t;
+			this->from = pos;
+		}
+
+	private:
+		TraceLog *log;
+		const char *name;
+		unsigned long long start;
+		unsigned long long from;   ///< Position at start
+};
+
+#endif // _RIPPER6_TRACE_HPP_
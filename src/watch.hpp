@@ -0,0 +1,131 @@
+/**
+ * @file   watch.hpp
+ * @brief  Notice files being added to a directory.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_WATCH_HPP_
+#define _RIPPER6_WATCH_HPP_
+
+#include <vector>
+#include "platform.hpp"
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+/// Size of the buffer for reading inotify events.
+#define WATCH_BUFFER_SIZE 65536
+
+/// Reports files in a directory once they have been written.
+/**
+ * A file is reported each time a program that opened it for writing closes
+ * it, or when it is moved into the directory, so a file that is appended to
+ * now and then is reported after each append.  Subdirectories are not
+ * watched.
+ *
+ * This uses inotify, so it is only available on Linux.
+ */
+class DirWatcher
+{
+	public:
+		DirWatcher()
+			:	fd(-1)
+		{
+		}
+
+		~DirWatcher()
+		{
+#ifdef __linux__
+			if (this->fd >= 0) ::close(this->fd);
+#endif
+		}
+
+		/// Start watching a directory.
+		/**
+		 * @param error
+		 *   On failure, set to a description of the problem.
+		 *
+		 * @return false if the directory cannot be watched.
+		 */
+		bool open(const std::string& dir, std::string *error)
+		{
+#ifdef __linux__
+			this->fd = inotify_init1(IN_CLOEXEC);
+			if (this->fd < 0) {
+				*error = std::string("Unable to start inotify: ") + strerror(errno);
+				return false;
+			}
+			if (inotify_add_watch(this->fd, dir.c_str(),
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0
+			) {
+				*error = "Unable to watch " + dir + ": " + strerror(errno);
+				return false;
+			}
+			return true;
+#else
+			*error = "Watching a directory is only supported on Linux";
+			return false;
+#endif
+		}
+
+		/// Wait for files to be written.
+		/**
+		 * @param names
+		 *   Names of the files written, relative to the directory, are
+		 *   appended here.  The same file may appear more than once.
+		 *
+		 * @param timeout
+		 *   Longest time to wait in milliseconds, so the caller can check
+		 *   whether it should stop.
+		 *
+		 * @return false if the directory can no longer be watched, e.g. as it
+		 *   has been deleted.
+		 */
+		bool wait(std::vector<std::string> *names, int timeout)
+		{
+#ifdef __linux__
+			struct pollfd p;
+			p.fd = this->fd;
+			p.events = POLLIN;
+			int n = poll(&p, 1, timeout);
+			if (n < 0) return errno == EINTR;
+			if (n == 0) return true;
+
+			// Aligned as the kernel expects for struct inotify_event
+			char buf[WATCH_BUFFER_SIZE]
+				__attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len = read(this->fd, buf, sizeof(buf));
+			if (len < 0) return (errno == EINTR) || (errno == EAGAIN);
+			for (char *ptr = buf; ptr < buf + len; ) {
+				const struct inotify_event *ev = (const struct inotify_event *)ptr;
+				ptr += sizeof(struct inotify_event) + ev->len;
+				if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_UNMOUNT)) return false;
+				if (ev->mask & IN_ISDIR) continue;
+				if (ev->len) names->push_back(ev->name);
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+	private:
+		int fd;   ///< inotify instance
+};
+
+#endif // _RIPPER6_WATCH_HPP_
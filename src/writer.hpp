@@ -0,0 +1,384 @@
+/**
+ * @file   writer.hpp
+ * @brief  Background threads that save matches to disk.
+ *
+ * Copyright (C) 2014-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RIPPER6_WRITER_HPP_
+#define _RIPPER6_WRITER_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "platform.hpp"
+#include "compress.hpp"
+#include "ratelimit.hpp"
+#include "trace.hpp"
+
+/// Default number of matches that can be waiting to be written.
+#define WRITER_DEFAULT_QUEUE 64
+
+/// Directory handle meaning the current directory.
+#ifdef _WIN32
+#define OUTPUT_CWD -1
+#else
+#define OUTPUT_CWD AT_FDCWD
+#endif
+
+/// Save a block of data to a new file.
+/**
+ * @param filename
+ *   File to create.  It is overwritten if it already exists.
+ *
+ * @param data
+ *   Content to write.
+ *
+ * @param len
+ *   Number of bytes at data.
+ *
+ * @param error
+ *   On failure, set to a description of the problem.
+ *
+ * @param dir
+ *   Handle to the directory filename is relative to.  On Windows this is
+ *   ignored and filename must be the full path.
+ *
+ * @return 0 on success, or the program exit code to use on failure.
+ */
+inline int write_file(const std::string& filename, const uint8_t *data,
+	unsigned long len, std::string *error, int dir = OUTPUT_CWD)
+{
+	TraceSpan span("write file", len);
+#ifdef _WIN32
+	HANDLE hFileMatch = CreateFile(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, NULL, NULL);
+	if (hFileMatch == INVALID_HANDLE_VALUE) {
+		*error = "Unable to create output file: " + GetLastErrorAsString();
+		return 5;
+	}
+	SetFilePointer(hFileMatch, len, 0, FILE_BEGIN);
+	SetEndOfFile(hFileMatch);
+	HANDLE hMapMatch = CreateFileMapping(hFileMatch, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if (hMapMatch == NULL) {
+		*error = "Unable to memory map output file: " + GetLastErrorAsString();
+		CloseHandle(hFileMatch);
+		return 6;
+	}
+	uint8_t *matchContent = (uint8_t *)MapViewOfFile(hMapMatch, FILE_MAP_WRITE, 0, 0, 0);
+	if (matchContent == NULL) {
+		*error = "Unable to memory map output file view: " + GetLastErrorAsString();
+		CloseHandle(hMapMatch);
+		CloseHandle(hFileMatch);
+		return 7;
+	}
+#else
+	int fdmatch = openat(dir, filename.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fdmatch < 0) {
+		*error = std::string("Unable to open output file: ") + strerror(errno);
+		return 5;
+	}
+	if (ftruncate(fdmatch, len) < 0) {
+		*error = std::string("Unable to set output file size: ") + strerror(errno);
+		close(fdmatch);
+		return 6;
+	}
+
+	uint8_t *matchContent = (uint8_t *)mmap(0, len, PROT_WRITE, MAP_SHARED, fdmatch, 0);
+	if (matchContent == MAP_FAILED) {
+		*error = std::string("Unable to mmap() output file: ") + strerror(errno);
+		close(fdmatch);
+		return 7;
+	}
+#endif
+	{
+		// Apart from this the time goes on creating and closing the file
+		TraceSpan copy("copy", len);
+		memcpy(matchContent, data, len);
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(matchContent);
+	CloseHandle(hMapMatch);
+	CloseHandle(hFileMatch);
+#else
+	munmap(matchContent, len);
+	close(fdmatch);
+#endif
+	return 0;
+}
+
+/// Saves matches on background threads so the scan does not wait for disk.
+/**
+ * The scanner queues each match with write() and carries on.  The queue has
+ * a fixed size, and write() blocks when it is full so that a slow destination
+ * cannot make memory use grow without limit.
+ *
+ * The data is not copied, so it must remain valid until finish() returns.
+ * For the usual case of data inside the memory-mapped input file this is
+ * free.
+ */
+class OutputWriter
+{
+	public:
+		/// Start the writer threads.
+		/**
+		 * @param numThreads
+		 *   Number of threads writing files.  If 0, write() saves the file
+		 *   itself before returning, as in a single-threaded program.
+		 *
+		 * @param maxQueue
+		 *   Number of matches that can be waiting before write() blocks.
+		 */
+		OutputWriter(unsigned int numThreads, unsigned int maxQueue)
+			:	maxQueue(maxQueue ? maxQueue : 1),
+				busy(0),
+				stopping(false),
+				errorCode(0),
+				stall(0),
+				compression(CompressNone),
+				level(COMPRESS_DEFAULT_LEVEL),
+				limits(NULL)
+		{
+			for (unsigned int i = 0; i < numThreads; i++) {
+				this->threads.push_back(std::thread(&OutputWriter::run, this, i));
+			}
+		}
+
+		~OutputWriter()
+		{
+			std::string error;
+			this->finish(&error);
+		}
+
+		/// Compress every file saved from now on.
+		/**
+		 * This must be called before any files are queued.  The compressing
+		 * is done by the writer threads, so with more than one the work is
+		 * shared between them.
+		 *
+		 * @param level
+		 *   Compression level, or COMPRESS_DEFAULT_LEVEL.
+		 */
+		void setCompression(Compression method, int level)
+		{
+			this->compression = method;
+			this->level = level;
+		}
+
+		/// Hold the writers to the write and files limits.
+		/**
+		 * The size of each match is counted before it is compressed.
+		 *
+		 * @param limits
+		 *   Limits to follow, which must stay valid until finish() returns.
+		 */
+		void setLimits(IoLimits *limits)
+		{
+			this->limits = limits;
+		}
+
+		/// Suffix to add to the name of each file, for its compression.
+		const char *suffix() const
+		{
+			return compression_suffix(this->compression);
+		}
+
+		/// Save a match to a file, possibly later.
+		/**
+		 * @param dir
+		 *   Handle to the directory filename is relative to, which must stay
+		 *   open until finish() returns.
+		 *
+		 * @return false if an earlier write failed, in which case the scan
+		 *   should stop and finish() will return the reason.
+		 */
+		bool write(const std::string& filename, const uint8_t *data,
+			unsigned long len, int dir = OUTPUT_CWD)
+		{
+			if (this->threads.empty()) {
+				if (this->errorCode) return false;
+				this->errorCode = this->save(filename, data, len, &this->errorMsg, dir);
+				return this->errorCode == 0;
+			}
+
+			std::unique_lock<std::mutex> lock(this->mutex);
+			if (this->queue.size() >= this->maxQueue) {
+				TraceSpan span("wait for writers");
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				while ((this->queue.size() >= this->maxQueue) && !this->errorCode) {
+					this->notFull.wait(lock);
+				}
+				this->stall += std::chrono::steady_clock::now() - start;
+			}
+			if (this->errorCode) return false;
+			Job job;
+			job.dir = dir;
+			job.filename = filename;
+			job.data = data;
+			job.len = len;
+			this->queue.push_back(job);
+			trace_counter("queued", this->queue.size());
+			this->notEmpty.notify_one();
+			return true;
+		}
+
+		/// Record a failure to save a match that happened outside the writer.
+		/**
+		 * This is reported by finish() like any other failure, unless an
+		 * earlier one has already been recorded.
+		 *
+		 * @param code
+		 *   Program exit code to use.
+		 *
+		 * @param error
+		 *   Description of the problem.
+		 */
+		void fail(int code, const std::string& error)
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			if (this->errorCode) return;
+			this->errorCode = code;
+			this->errorMsg = error;
+			this->notFull.notify_all();
+			this->idle.notify_all();
+		}
+
+		/// Wait until every queued match has been written.
+		/**
+		 * The threads keep running, so more matches can be queued afterwards.
+		 *
+		 * @return false if any write has failed.
+		 */
+		bool flush()
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			while ((!this->queue.empty() || this->busy) && !this->errorCode) {
+				this->idle.wait(lock);
+			}
+			return this->errorCode == 0;
+		}
+
+		/// Wait until every queued match has been written, and stop the threads.
+		/**
+		 * @param error
+		 *   On failure, set to a description of the first problem encountered.
+		 *
+		 * @return 0 on success, or the program exit code to use on failure.
+		 */
+		int finish(std::string *error)
+		{
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->stopping = true;
+				this->notEmpty.notify_all();
+			}
+			for (std::vector<std::thread>::iterator
+				t = this->threads.begin(); t != this->threads.end(); t++
+			) {
+				t->join();
+			}
+			this->threads.clear();
+			if (this->errorCode) *error = this->errorMsg;
+			return this->errorCode;
+		}
+
+		/// Time the scanner has spent waiting for room in the queue.
+		double stallSeconds() const
+		{
+			return std::chrono::duration<double>(this->stall).count();
+		}
+
+	private:
+		struct Job {
+			int dir;
+			std::string filename;
+			const uint8_t *data;
+			unsigned long len;
+		};
+
+		std::vector<std::thread> threads;
+		std::deque<Job> queue;
+		unsigned int maxQueue;
+		std::mutex mutex;
+		std::condition_variable notEmpty; ///< Signalled when a job is queued
+		std::condition_variable notFull;  ///< Signalled when a job is taken
+		std::condition_variable idle;     ///< Signalled when a job is done
+		unsigned int busy;                ///< Jobs taken but not yet written
+		bool stopping;                    ///< finish() has been called
+		int errorCode;                    ///< Exit code of the first failure
+		std::string errorMsg;             ///< Description of the first failure
+		std::chrono::steady_clock::duration stall;
+		Compression compression;
+		int level;                        ///< Compression level
+		IoLimits *limits;                 ///< Limits to follow, or NULL
+
+		/// Write one file, compressed if need be.
+		int save(const std::string& filename, const uint8_t *data,
+			unsigned long len, std::string *error, int dir) const
+		{
+			if (this->limits) {
+				this->limits->poll();
+				this->limits->files.take(1);
+				this->limits->write.take(len);
+			}
+			if (this->compression == CompressNone) {
+				return write_file(filename, data, len, error, dir);
+			}
+			return write_compressed(filename, data, len, this->compression,
+				this->level, error, dir);
+		}
+
+		/// Writer thread.
+		/**
+		 * @param index
+		 *   Number of the thread, from 0.
+		 */
+		void run(unsigned int index)
+		{
+			trace_thread(TRACE_WRITER_TRACK + index, "writer", index);
+			std::unique_lock<std::mutex> lock(this->mutex);
+			for (;;) {
+				while (this->queue.empty() && !this->stopping) {
+					this->notEmpty.wait(lock);
+				}
+				if (this->queue.empty()) break; // stopping and nothing left
+				Job job = this->queue.front();
+				this->queue.pop_front();
+				trace_counter("queued", this->queue.size());
+				this->busy++;
+				this->notFull.notify_one();
+
+				lock.unlock();
+				std::string error;
+				int code = this->save(job.filename, job.data, job.len, &error,
+					job.dir);
+				lock.lock();
+
+				this->busy--;
+				if (code && !this->errorCode) {
+					this->errorCode = code;
+					this->errorMsg = error;
+					// Wake the scanner in case it is waiting for space
+					this->notFull.notify_all();
+				}
+				this->idle.notify_all();
+			}
+		}
+};
+
+#endif // _RIPPER6_WRITER_HPP_